@@ -153,5 +153,6 @@ include $(LOCAL_PATH)/minui/Android.mk \
     $(LOCAL_PATH)/rsa/Android.mk	\
     $(LOCAL_PATH)/crc/Android.mk	\
     $(LOCAL_PATH)/board_id/Android.mk	\
+    $(LOCAL_PATH)/testutil/Android.mk	\
     $(LOCAL_PATH)/libxml2/Android.mk
     
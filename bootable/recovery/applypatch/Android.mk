@@ -15,11 +15,19 @@
 LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := applypatch.c bspatch.c freecache.c imgpatch.c utils.c
+LOCAL_SRC_FILES := applypatch.c bspatch.c freecache.c hashcache.c imgpatch.c utils.c
 LOCAL_MODULE := libapplypatch
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += external/bzip2 external/zlib bootable/recovery
 LOCAL_STATIC_LIBRARIES += libmtdutils libmincrypt libbz libz librk_emmcutils
+ifeq ($(RECOVERY_PATCH_USE_ZSTD), true)
+LOCAL_CFLAGS += -DUSE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+ifeq ($(RECOVERY_CACHE_EVICT_OLDEST), true)
+LOCAL_CFLAGS += -DRECOVERY_CACHE_EVICT_OLDEST
+endif
 
 include $(BUILD_STATIC_LIBRARY)
 
@@ -29,6 +37,9 @@ LOCAL_SRC_FILES := main.c
 LOCAL_MODULE := applypatch
 LOCAL_C_INCLUDES += bootable/recovery 
 LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf librk_emmcutils
+ifeq ($(RECOVERY_PATCH_USE_ZSTD), true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 LOCAL_SHARED_LIBRARIES += libz libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
@@ -41,16 +52,89 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += bootable/recovery
 LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf librk_emmcutils
+ifeq ($(RECOVERY_PATCH_USE_ZSTD), true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 LOCAL_STATIC_LIBRARIES += libz libcutils libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := imgdiff.c utils.c bsdiff.c
+LOCAL_SRC_FILES := freecache_test.c
+LOCAL_MODULE := freecache_test
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES += bootable/recovery
+LOCAL_STATIC_LIBRARIES += librecovery_testutil
+LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf librk_emmcutils
+ifeq ($(RECOVERY_PATCH_USE_ZSTD), true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+LOCAL_STATIC_LIBRARIES += libz libcutils libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bspatch_test.c
+LOCAL_MODULE := bspatch_test
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES += external/bzip2 bootable/recovery
+LOCAL_STATIC_LIBRARIES += librecovery_testutil
+LOCAL_STATIC_LIBRARIES += libapplypatch libmtdutils libmincrypt libbz libminelf librk_emmcutils
+ifeq ($(RECOVERY_PATCH_USE_ZSTD), true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+LOCAL_STATIC_LIBRARIES += libz libcutils libstdc++ libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := imgdiff.c utils.c bsdiff.c sufsort.c
 LOCAL_MODULE := imgdiff
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 LOCAL_C_INCLUDES += external/zlib external/bzip2
 LOCAL_STATIC_LIBRARIES += libz libbz
+LOCAL_LDLIBS += -lpthread
+ifeq ($(RECOVERY_PATCH_USE_ZSTD), true)
+LOCAL_CFLAGS += -DUSE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := bspatch_bench.c bspatch.c imgpatch.c utils.c
+LOCAL_MODULE := bspatch_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_C_INCLUDES += external/zlib external/bzip2 bootable/recovery
+LOCAL_STATIC_LIBRARIES += libmincrypt libz libbz
+LOCAL_LDLIBS += -lpthread
+ifeq ($(RECOVERY_PATCH_USE_ZSTD), true)
+LOCAL_CFLAGS += -DUSE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := sufsort_bench.c sufsort.c bsdiff.c
+LOCAL_MODULE := sufsort_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_C_INCLUDES += external/bzip2
+LOCAL_STATIC_LIBRARIES += libbz
+LOCAL_LDLIBS += -lpthread
+ifeq ($(RECOVERY_PATCH_USE_ZSTD), true)
+LOCAL_CFLAGS += -DUSE_ZSTD
+LOCAL_C_INCLUDES += external/zstd/lib
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
 
 include $(BUILD_HOST_EXECUTABLE)
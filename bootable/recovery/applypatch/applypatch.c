@@ -19,6 +19,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
@@ -34,6 +36,10 @@
 #include "mtdutils/rk29.h"
 #endif
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
 static int LoadPartitionContents(const char* filename, FileContents* file);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
@@ -45,9 +51,21 @@ static int GenerateTarget(FileContents* source_file,
                           const uint8_t target_sha1[SHA_DIGEST_SIZE],
                           size_t target_size,
                           const Value* bonus_data);
+static int BackUpSource(const char* source_filename,
+                        const FileContents* source_file, int remove_source);
 
 static int mtd_partitions_scanned = 0;
 
+// Fill in file->sha1 from the hash cache if possible, hashing the
+// data (and caching the result) if not.
+static void HashFileContents(FileContents* file, int retouch_flag) {
+    if (HashCacheLookup(&file->st, retouch_flag, file->sha1) == 0) {
+        return;
+    }
+    SHA(file->data, file->size, file->sha1);
+    HashCacheStore(&file->st, retouch_flag, file->sha1);
+}
+
 // Read a file into memory; optionally (retouch_flag == RETOUCH_DO_MASK) mask
 // the retouched entries back to their original value (such that SHA-1 checks
 // don't fail due to randomization); store the file contents and associated
@@ -57,6 +75,7 @@ static int mtd_partitions_scanned = 0;
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag) {
     file->data = NULL;
+    file->mapped = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
@@ -105,10 +124,84 @@ int LoadFileContents(const char* filename, FileContents* file,
         }
     }
 
-    SHA(file->data, file->size, file->sha1);
+    HashFileContents(file, retouch_flag);
+    return 0;
+}
+
+// Like LoadFileContents, but map a regular file into memory rather
+// than reading it, so that hashing streams through the page cache and
+// patching only faults in the pages it actually uses.  The mapping is
+// private, so masking retouched entries only copies the pages it
+// touches.  Partitions (and anything that can't be mapped) fall back
+// to LoadFileContents.  The result must be released with
+// FreeFileContents, never free().
+//
+// Return 0 on success.
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag) {
+    file->data = NULL;
+    file->mapped = 0;
+
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0) {
+        return LoadPartitionContents(filename, file);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &file->st) != 0) {
+        printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (!S_ISREG(file->st.st_mode) || file->st.st_size == 0) {
+        close(fd);
+        return LoadFileContents(filename, file, retouch_flag);
+    }
+
+    file->size = file->st.st_size;
+    void* data = mmap(NULL, file->size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        printf("failed to mmap \"%s\" (%s); reading instead\n",
+               filename, strerror(errno));
+        return LoadFileContents(filename, file, retouch_flag);
+    }
+    file->data = data;
+    file->mapped = 1;
+
+    if (retouch_flag) {
+        int32_t desired_offset = 0;
+        if (retouch_mask_data(file->data, file->size,
+                              &desired_offset, NULL) != RETOUCH_DATA_MATCHED) {
+            printf("error trying to mask retouch entries\n");
+            FreeFileContents(file);
+            return -1;
+        }
+    }
+
+    madvise(file->data, file->size, MADV_SEQUENTIAL);
+    HashFileContents(file, retouch_flag);
+    madvise(file->data, file->size, MADV_NORMAL);
     return 0;
 }
 
+void FreeFileContents(FileContents* file) {
+    if (file->data != NULL) {
+        if (file->mapped) {
+            munmap(file->data, file->size);
+        } else {
+            free(file->data);
+        }
+    }
+    file->data = NULL;
+    file->mapped = 0;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -238,6 +331,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
 
     // allocate enough memory to hold the largest size.
     file->data = malloc(size[index[pairs-1]]);
+    file->mapped = 0;
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
 
@@ -338,9 +432,11 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
 
 
 // Save the contents of the given FileContents object under the given
-// filename.  Return 0 on success.
+// filename.  The file is overwritten in place rather than truncated
+// first, so that any space reserved for it with ReserveCacheFile() is
+// kept.  Return 0 on success.
 int SaveFileContents(const char* filename, const FileContents* file) {
-    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    int fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
     if (fd < 0) {
         printf("failed to open \"%s\" for write: %s\n",
                filename, strerror(errno));
@@ -355,6 +451,11 @@ int SaveFileContents(const char* filename, const FileContents* file) {
         close(fd);
         return -1;
     }
+    if (ftruncate(fd, file->size) != 0) {
+        printf("failed to truncate \"%s\": %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
     fsync(fd);
     close(fd);
 
@@ -521,19 +622,19 @@ int applypatch_check(const char* filename,
                      int num_patches, char** const patch_sha1_str) {
     FileContents file;
     file.data = NULL;
+    file.mapped = 0;
 
     // It's okay to specify no sha1s; the check will pass if the
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    if (LoadFileContents(filename, &file, RETOUCH_DO_MASK) != 0 ||
+    if (MapFileContents(filename, &file, RETOUCH_DO_MASK) != 0 ||
         (num_patches > 0 &&
          FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0)) {
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
-        file.data = NULL;
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -541,19 +642,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file, RETOUCH_DO_MASK) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
@@ -664,19 +765,21 @@ int applypatch(const char* source_filename,
     FileContents copy_file;
     FileContents source_file;
     copy_file.data = NULL;
+    copy_file.mapped = 0;
     source_file.data = NULL;
+    source_file.mapped = 0;
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
+    if (MapFileContents(target_filename, &source_file,
                          RETOUCH_DO_MASK) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
                    target_filename);
-            free(source_file.data);
+            FreeFileContents(&source_file);
             return 0;
         }
     }
@@ -686,9 +789,8 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file,
+        FreeFileContents(&source_file);
+        MapFileContents(source_filename, &source_file,
                          RETOUCH_DO_MASK);
     }
 
@@ -701,11 +803,10 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
-        source_file.data = NULL;
+        FreeFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file,
                              RETOUCH_DO_MASK) < 0) {
             // fail.
             printf("failed to read copy file\n");
@@ -721,7 +822,7 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
             return 1;
         }
     }
@@ -730,12 +831,107 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
 
     return result;
 }
 
+// Make a copy of the file 'source' at 'dest' that shares its data
+// blocks, on filesystems that support it.  Returns 0 on success.
+static int CloneFile(const char* source, const char* dest,
+                     const struct stat* st) {
+    int src = open(source, O_RDONLY);
+    if (src < 0) return -1;
+    // 'dest' may be left over as a hard link to a live file; truncating
+    // it would truncate that file, so always start from a new inode.
+    unlink(dest);
+    int dst = open(dest, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (dst < 0) {
+        close(src);
+        return -1;
+    }
+    int result = ioctl(dst, FICLONE, src);
+    if (result == 0 &&
+        (fchmod(dst, st->st_mode) != 0 ||
+         fchown(dst, st->st_uid, st->st_gid) != 0 ||
+         fsync(dst) != 0)) {
+        result = -1;
+    }
+    close(src);
+    close(dst);
+    if (result != 0) unlink(dest);
+    return result;
+}
+
+// Save the source file as CACHE_TEMP_SOURCE before it's patched, so
+// that the patch can be redone from there if we're interrupted.  If
+// remove_source is set, the source is also removed from its original
+// location, to free space there.
+//
+// Copying the whole file is avoided where possible: if the cache is
+// on the same filesystem as the source, it's moved (or linked, if
+// it's to be kept) there; otherwise on filesystems that support it,
+// a clone sharing the source's blocks is made.  The patched file is
+// always written beside the target and renamed over it, so none of
+// these alter the saved data.  Returns 0 on success.
+static int BackUpSource(const char* source_filename,
+                        const FileContents* source_file, int remove_source) {
+    if (strncmp(source_filename, "MTD:", 4) != 0 &&
+        strncmp(source_filename, "EMMC:", 5) != 0) {
+        if (remove_source) {
+            if (rename(source_filename, CACHE_TEMP_SOURCE) == 0) {
+                printf("moved \"%s\" to cache\n", source_filename);
+                return 0;
+            }
+        } else {
+            unlink(CACHE_TEMP_SOURCE);
+            if (link(source_filename, CACHE_TEMP_SOURCE) == 0) {
+                printf("linked \"%s\" into cache\n", source_filename);
+                return 0;
+            }
+        }
+
+        if (CloneFile(source_filename, CACHE_TEMP_SOURCE,
+                      &source_file->st) == 0) {
+            printf("cloned \"%s\" to cache\n", source_filename);
+            if (remove_source) unlink(source_filename);
+            return 0;
+        }
+    }
+
+    // CACHE_TEMP_SOURCE may still be a hard link to a live file, from
+    // an earlier backup of a source that was kept; writing through it
+    // would change that file, so remove it before copying.
+    unlink(CACHE_TEMP_SOURCE);
+    if (ReserveCacheFile(CACHE_TEMP_SOURCE, source_file->size) < 0) {
+        printf("not enough free space on /cache\n");
+        return -1;
+    }
+    if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+        printf("failed to back up source file\n");
+        return -1;
+    }
+    if (remove_source) {
+        // A mapped file's blocks aren't freed until it's unmapped, so
+        // map the copy (which holds the same bytes, masking included)
+        // in place of the source before removing it.
+        if (source_file->mapped) {
+            int fd = open(CACHE_TEMP_SOURCE, O_RDONLY);
+            if (fd < 0 ||
+                mmap(source_file->data, source_file->size,
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                     fd, 0) == MAP_FAILED) {
+                printf("failed to map copy of \"%s\"; its space won't be "
+                       "freed\n", source_filename);
+            }
+            if (fd >= 0) close(fd);
+        }
+        unlink(source_filename);
+    }
+    return 0;
+}
+
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
                           FileContents* copy_file,
@@ -779,13 +975,11 @@ static int GenerateTarget(FileContents* source_file,
             // space to hold the file.
 
             // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
+            // the partition write is interrupted.  If we're already
+            // working from the cached copy it's there (and mapped), so
+            // it must not be rewritten.
+            if (source_patch_value != NULL &&
+                BackUpSource(source_filename, source_file, 0) != 0) {
                 return 1;
             }
             made_copy = 1;
@@ -820,17 +1014,10 @@ static int GenerateTarget(FileContents* source_file,
                     return 1;
                 }
 
-                if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                    printf("not enough free space on /cache\n");
-                    return 1;
-                }
-
-                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                    printf("failed to back up source file\n");
+                if (BackUpSource(source_filename, source_file, 1) != 0) {
                     return 1;
                 }
                 made_copy = 1;
-                unlink(source_filename);
 
                 size_t free_space = FreeSpaceForFile(target_fs);
                 printf("(now %ld bytes free for target)\n", (long)free_space);
@@ -892,7 +1079,8 @@ static int GenerateTarget(FileContents* source_file,
         int result;
 
         if (header_bytes_read >= 8 &&
-            memcmp(header, "BSDIFF40", 8) == 0) {
+            (memcmp(header, "BSDIFF40", 8) == 0 ||
+             memcmp(header, "BSDIFF41", 8) == 0)) {
             result = ApplyBSDiffPatch(source_to_use->data, source_to_use->size,
                                       patch, 0, sink, token, &ctx);
         } else if (header_bytes_read >= 8 &&
@@ -961,7 +1149,10 @@ static int GenerateTarget(FileContents* source_file,
 
     // If this run of applypatch created the copy, and we're here, we
     // can delete it.
-    if (made_copy) unlink(CACHE_TEMP_SOURCE);
+    if (made_copy) {
+        unlink(CACHE_TEMP_SOURCE);
+        ReleaseCacheFile(CACHE_TEMP_SOURCE);
+    }
 
     // Success!
     return 0;
@@ -32,6 +32,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;     // data is a private mmap() of the file, not malloc()ed
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -41,6 +42,11 @@ typedef struct _FileContents {
 // and use it as the source instead.
 #define CACHE_TEMP_SOURCE "/cache/saved.file"
 
+// The SHA-1s of the files checked and patched by an install are saved
+// here, so that if it's interrupted and restarted they needn't all be
+// read and hashed again.  See hashcache.c.
+#define CACHE_HASH_FILE "/cache/saved.hashes"
+
 typedef ssize_t (*SinkFn)(unsigned char*, ssize_t, void*);
 
 // applypatch.c
@@ -63,6 +69,8 @@ int applypatch_check(const char* filename,
 
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag);
+int MapFileContents(const char* filename, FileContents* file,
+                    int retouch_flag);
 int SaveFileContents(const char* filename, const FileContents* file);
 void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, const char** patch_sha1_str,
@@ -84,6 +92,23 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
                     const Value* bonus_data);
 
 // freecache.c
+typedef enum {
+  CACHE_EVICT_LARGEST,    // delete the biggest files first
+  CACHE_EVICT_OLDEST,     // delete the least recently modified first
+                          // (the default with RECOVERY_CACHE_EVICT_OLDEST)
+} CacheEvictPolicy;
+
+void CacheSpaceInit(const char* root, CacheEvictPolicy policy);
 int MakeFreeSpaceOnCache(size_t bytes_needed);
+int ReserveCacheFile(const char* filename, size_t bytes);
+void ReleaseCacheFile(const char* filename);
+
+// hashcache.c
+int HashCacheLookup(const struct stat* st, int retouch_flag,
+                    uint8_t sha1[SHA_DIGEST_SIZE]);
+void HashCacheStore(const struct stat* st, int retouch_flag,
+                    const uint8_t sha1[SHA_DIGEST_SIZE]);
+int HashCacheOpen(const char* path);
+void HashCacheDiscard();
 
 #endif
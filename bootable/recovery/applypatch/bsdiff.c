@@ -55,8 +55,17 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "imgdiff.h"
+#include "sufsort.h"
+
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
+#define BSDIFF_ZSTD_LEVEL 19
+
 static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
 {
 	off_t i,j,k,x,tmp,jj,kk;
@@ -156,6 +165,29 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
 }
 
+int qsufsort_suffix_sort(off_t* I, const u_char* buf, off_t size)
+{
+	off_t *V;
+
+	if ((V = malloc((size+1) * sizeof(off_t))) == NULL)
+		return -1;
+	qsufsort(I, V, (u_char*)buf, size);
+	free(V);
+	return 0;
+}
+
+static SuffixSortFn suffix_sort = sais_suffix_sort;
+
+int bsdiff_set_suffix_sort(const char* name)
+{
+	SuffixSortFn fn = FindSuffixSort(name);
+
+	if (fn == NULL)
+		return -1;
+	suffix_sort = fn;
+	return 0;
+}
+
 static off_t matchlen(u_char *old,off_t oldsize,u_char *new,off_t newsize)
 {
 	off_t i;
@@ -210,6 +242,90 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+// Growable buffer that the patch is assembled in.
+typedef struct {
+	u_char* data;
+	off_t len;
+	off_t size;
+} PatchBuffer;
+
+// Make room for 'len' more bytes at the end of pb, and return a
+// pointer to them.  pb->len is not advanced.
+static u_char* reserve(PatchBuffer* pb, off_t len)
+{
+	if (pb->len + len > pb->size) {
+		off_t n = pb->size ? pb->size : 4096;
+		while (n < pb->len + len)
+			n *= 2;
+		if ((pb->data = realloc(pb->data, n)) == NULL)
+			err(1, NULL);
+		pb->size = n;
+	}
+	return pb->data + pb->len;
+}
+
+// Append one compressed block to the patch.  For BSDIFF_ZSTD_SRC, the
+// zstd frame is compressed with 'old' as a prefix, so that long
+// matches against the source can be encoded as back-references
+// instead of literals.
+static void writeblock(PatchBuffer* pb, u_char* data, off_t len,
+                       int compression, u_char* old, off_t oldsize)
+{
+	if (compression == BSDIFF_BZIP2) {
+		unsigned int bound = len + len / 100 + 600;
+		unsigned int out_len = bound;
+		int bz2err;
+
+		bz2err = BZ2_bzBuffToBuffCompress((char*)reserve(pb, bound),
+		                                  &out_len, (char*)data, len,
+		                                  9, 0, 0);
+		if (bz2err != BZ_OK)
+			errx(1, "BZ2_bzBuffToBuffCompress, bz2err = %d", bz2err);
+		pb->len += out_len;
+		return;
+	}
+
+#ifdef USE_ZSTD
+	ZSTD_CCtx* cctx;
+	size_t bound, r;
+
+	if ((cctx = ZSTD_createCCtx()) == NULL)
+		errx(1, "ZSTD_createCCtx");
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, BSDIFF_ZSTD_LEVEL);
+	if (compression == BSDIFF_ZSTD_SRC && oldsize > 0) {
+		int wlog = 10;	/* zstd's minimum window */
+		while (wlog < BSDIFF_ZSTD_MAX_WINDOW_LOG &&
+		       ((off_t)1 << wlog) < oldsize + len)
+			wlog++;
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, wlog);
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_enableLongDistanceMatching, 1);
+		r = ZSTD_CCtx_refPrefix(cctx, old, oldsize);
+		if (ZSTD_isError(r))
+			errx(1, "ZSTD_CCtx_refPrefix: %s", ZSTD_getErrorName(r));
+	}
+
+	bound = ZSTD_compressBound(len);
+	r = ZSTD_compress2(cctx, reserve(pb, bound), bound, data, len);
+	if (ZSTD_isError(r))
+		errx(1, "ZSTD_compress2: %s", ZSTD_getErrorName(r));
+	pb->len += r;
+	ZSTD_freeCCtx(cctx);
+#else
+	errx(1, "zstd compression not supported in this build");
+#endif
+}
+
+// Build the suffix array for 'old' in *IP, unless the caller already
+// has one there.
+void bsdiff_index(u_char* old, off_t oldsize, off_t** IP)
+{
+	if (*IP == NULL) {
+		if ((*IP = malloc((oldsize+1) * sizeof(off_t))) == NULL ||
+		    suffix_sort(*IP, old, oldsize) != 0)
+			err(1, "suffix sort");
+	}
+}
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, new, newsize are arguments; we don't load this
@@ -219,12 +335,24 @@ static void offtout(off_t x,u_char *buf)
 //    - the "I" block of memory is owned by the caller, who passes a
 //      pointer to *I, which can be NULL.  This way if we call
 //      bsdiff() multiple times with the same 'old' data, we only do
-//      the qsufsort() step the first time.
+//      the suffix sort step the first time.  The sort itself is done
+//      by whichever backend bsdiff_set_suffix_sort() selected (see
+//      sufsort.h).
+//
+//    - the patch is built in memory rather than written to a file.
+//      It is returned in *patch (malloc'd; the caller frees it), with
+//      its length in *patch_size.  Nothing here touches global state,
+//      so calls with different 'I' blocks can run on separate
+//      threads.
+//
+//    - 'compression' selects how the three blocks are compressed.
+//      BSDIFF_BZIP2 produces a standard BSDIFF40 patch; anything
+//      else produces a BSDIFF41 patch (see the header description
+//      below).
 //
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename)
+           u_char** patch, off_t* patch_size, int compression)
 {
-	int fd;
 	off_t *I;
 	off_t scan,pos,len;
 	off_t lastscan,lastpos,lastoffset;
@@ -232,52 +360,67 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	off_t s,Sf,lenf,Sb,lenb;
 	off_t overlap,Ss,lens;
 	off_t i;
-	off_t dblen,eblen;
-	u_char *db,*eb;
-	u_char buf[8];
-	u_char header[32];
-	FILE * pf;
-	BZFILE * pfbz2;
-	int bz2err;
-
-        if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
-        }
-        I = *IP;
+	off_t cblen,cbsize,dblen,eblen;
+	u_char *cb,*db,*eb;
+	u_char header[40];
+	size_t header_len;
+	int cc,dc,ec;
+	PatchBuffer pb;
+
+	bsdiff_index(old, oldsize, IP);
+	I = *IP;
 
 	if(((db=malloc(newsize+1))==NULL) ||
 		((eb=malloc(newsize+1))==NULL)) err(1,NULL);
+	cbsize=4096;
+	if ((cb=malloc(cbsize))==NULL) err(1,NULL);
+	cblen=0;
 	dblen=0;
 	eblen=0;
 
-	/* Create the patch file */
-	if ((pf = fopen(patch_filename, "w")) == NULL)
-              err(1, "%s", patch_filename);
-
 	/* Header is
 		0	8	 "BSDIFF40"
 		8	8	length of bzip2ed ctrl block
 		16	8	length of bzip2ed diff block
 		24	8	length of new file */
+	/* or
+		0	8	 "BSDIFF41"
+		8	8	length of compressed ctrl block
+		16	8	length of compressed diff block
+		24	8	length of new file
+		32	1	compression of ctrl block (BSDIFF_*)
+		33	1	compression of diff block
+		34	1	compression of extra block
+		35	5	zero */
 	/* File is
-		0	32	Header
-		32	??	Bzip2ed ctrl block
-		??	??	Bzip2ed diff block
-		??	??	Bzip2ed extra block */
-	memcpy(header,"BSDIFF40",8);
-	offtout(0, header + 8);
-	offtout(0, header + 16);
+		0	32/40	Header
+		??	??	Compressed ctrl block
+		??	??	Compressed diff block
+		??	??	Compressed extra block */
+	memset(header, 0, sizeof(header));
+	if (compression == BSDIFF_BZIP2) {
+		memcpy(header,"BSDIFF40",8);
+		header_len = 32;
+		cc = dc = ec = BSDIFF_BZIP2;
+	} else {
+		/* The source only helps the extra block; the ctrl and diff
+		   blocks never contain source bytes. */
+		memcpy(header,"BSDIFF41",8);
+		header_len = 40;
+		cc = dc = BSDIFF_ZSTD;
+		ec = compression;
+		header[32] = cc;
+		header[33] = dc;
+		header[34] = ec;
+	}
 	offtout(newsize, header + 24);
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
 
-	/* Compute the differences, writing ctrl as we go */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
+	/* Leave room for the header, which is filled in at the end */
+	memset(&pb, 0, sizeof(pb));
+	reserve(&pb, header_len);
+	pb.len = header_len;
+
+	/* Compute the differences, collecting ctrl as we go */
 	scan=0;len=0;
 	lastscan=0;lastpos=0;lastoffset=0;
 	while(scan<newsize) {
@@ -340,69 +483,39 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 			dblen+=lenf;
 			eblen+=(scan-lenb)-(lastscan+lenf);
 
-			offtout(lenf,buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((scan-lenb)-(lastscan+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-
-			offtout((pos-lenb)-(lastpos+lenf),buf);
-			BZ2_bzWrite(&bz2err, pfbz2, buf, 8);
-			if (bz2err != BZ_OK)
-				errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
+			if (cblen+24 > cbsize) {
+				cbsize*=2;
+				if ((cb=realloc(cb,cbsize))==NULL) err(1,NULL);
+			};
+			offtout(lenf,cb+cblen);
+			offtout((scan-lenb)-(lastscan+lenf),cb+cblen+8);
+			offtout((pos-lenb)-(lastpos+lenf),cb+cblen+16);
+			cblen+=24;
 
 			lastscan=scan-lenb;
 			lastpos=pos-lenb;
 			lastoffset=pos-scan;
 		};
 	};
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed ctrl data */
-	if ((len = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(len-32, header + 8);
+	/* Write compressed ctrl data */
+	writeblock(&pb, cb, cblen, cc, old, oldsize);
+	offtout(pb.len-header_len, header + 8);
 
 	/* Write compressed diff data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, db, dblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Compute size of compressed diff data */
-	if ((newsize = ftello(pf)) == -1)
-		err(1, "ftello");
-	offtout(newsize - len, header + 16);
+	len = pb.len;
+	writeblock(&pb, db, dblen, dc, old, oldsize);
+	offtout(pb.len - len, header + 16);
 
 	/* Write compressed extra data */
-	if ((pfbz2 = BZ2_bzWriteOpen(&bz2err, pf, 9, 0, 0)) == NULL)
-		errx(1, "BZ2_bzWriteOpen, bz2err = %d", bz2err);
-	BZ2_bzWrite(&bz2err, pfbz2, eb, eblen);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWrite, bz2err = %d", bz2err);
-	BZ2_bzWriteClose(&bz2err, pfbz2, 0, NULL, NULL);
-	if (bz2err != BZ_OK)
-		errx(1, "BZ2_bzWriteClose, bz2err = %d", bz2err);
-
-	/* Seek to the beginning, write the header, and close the file */
-	if (fseeko(pf, 0, SEEK_SET))
-		err(1, "fseeko");
-	if (fwrite(header, 32, 1, pf) != 1)
-		err(1, "fwrite(%s)", patch_filename);
-	if (fclose(pf))
-		err(1, "fclose");
+	writeblock(&pb, eb, eblen, ec, old, oldsize);
+
+	/* Fill in the header */
+	memcpy(pb.data, header, header_len);
+	*patch = pb.data;
+	*patch_size = pb.len;
 
 	/* Free the memory we used */
+	free(cb);
 	free(db);
 	free(eb);
 
@@ -21,15 +21,26 @@
 // notice.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
 #include <bzlib.h>
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "mincrypt/sha.h"
 #include "applypatch.h"
+#include "imgdiff.h"
 
 void ShowBSDiffLicense() {
     puts("The bsdiff library used herein is:\n"
@@ -81,48 +92,302 @@ static off_t offtin(u_char *buf)
     return y;
 }
 
-int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
-    stream->next_out = (char*)buffer;
-    stream->avail_out = size;
-    while (stream->avail_out > 0) {
-        int bzerr = BZ2_bzDecompress(stream);
-        if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
-            printf("bz error %d decompressing\n", bzerr);
+// out[i] += old[i] for i in [0, len), 16 bytes at a time where the
+// CPU allows.  The caller has already clipped the range to the
+// source, so there are no per-byte bounds checks here.
+static void AddOldData(unsigned char* out, const unsigned char* old,
+                       off_t len) {
+    off_t i = 0;
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+    for (; i + 16 <= len; i += 16) {
+        vst1q_u8(out+i, vaddq_u8(vld1q_u8(out+i), vld1q_u8(old+i)));
+    }
+#elif defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(out+i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(old+i));
+        _mm_storeu_si128((__m128i*)(out+i), _mm_add_epi8(a, b));
+    }
+#endif
+    for (; i < len; ++i) {
+        out[i] += old[i];
+    }
+}
+
+// Streams with at least this much compressed data are decoded ahead
+// of the apply loop by their own thread; smaller ones (the control
+// stream, and the patches for most imgdiff chunks) aren't worth the
+// thread and are decoded inline.
+#define BSPATCH_THREAD_MIN_INPUT (64*1024)
+
+// Size of the queue of decoded-but-unconsumed bytes for each
+// threaded stream.
+#define BSPATCH_QUEUE_SIZE (256*1024)
+
+typedef struct {
+    int compression;    // BSDIFF_*
+    bz_stream bz;
+#ifdef USE_ZSTD
+    ZSTD_DStream* zs;
+    ZSTD_inBuffer zin;
+#endif
+    int threaded;
+
+    // The rest is only used when threaded.  The decoder thread
+    // appends to the ring buffer 'queue'; the apply loop consumes
+    // from it.  Both sides block on 'cond' when it's full or empty.
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    unsigned char* queue;
+    size_t head;        // offset of the next byte to consume
+    size_t count;       // number of decoded bytes not yet consumed
+    int done;           // decoder reached the end of its input
+    int error;          // decoder failed
+    int stop;           // consumer is finished with the stream
+} DecodedStream;
+
+// Decode up to 'space' bytes into out, setting *produced.  Returns 1
+// once the stream (or its input) has ended, 0 if there may be more to
+// come, or -1 on error.
+static int DecodeSome(DecodedStream* s, unsigned char* out, size_t space,
+                      size_t* produced) {
+#ifdef USE_ZSTD
+    if (s->compression != BSDIFF_BZIP2) {
+        ZSTD_outBuffer zout = { out, space, 0 };
+        size_t r = ZSTD_decompressStream(s->zs, &zout, &s->zin);
+        *produced = zout.pos;
+        if (ZSTD_isError(r)) {
+            printf("zstd error decompressing: %s\n", ZSTD_getErrorName(r));
             return -1;
         }
-        if (stream->avail_out > 0) {
-            printf("need %d more bytes\n", stream->avail_out);
+        if (r == 0 || (zout.pos == 0 && s->zin.pos == s->zin.size)) {
+            return 1;
         }
+        return 0;
+    }
+#endif
+
+    s->bz.next_out = (char*)out;
+    s->bz.avail_out = space;
+    int bzerr = BZ2_bzDecompress(&s->bz);
+    *produced = space - s->bz.avail_out;
+    if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
+        printf("bz error %d decompressing\n", bzerr);
+        return -1;
+    }
+    if (bzerr == BZ_STREAM_END || (*produced == 0 && s->bz.avail_in == 0)) {
+        return 1;
     }
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+static void* DecodeThread(void* cookie) {
+    DecodedStream* s = (DecodedStream*)cookie;
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
+    pthread_mutex_lock(&s->lock);
+    while (!s->stop && !s->done) {
+        if (s->count == BSPATCH_QUEUE_SIZE) {
+            pthread_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+
+        // Decode straight into the largest contiguous free span of
+        // the ring.  The consumer never touches free space, so the
+        // lock can be dropped while the decompressor runs.
+        size_t tail = (s->head + s->count) % BSPATCH_QUEUE_SIZE;
+        size_t space = (tail < s->head) ? s->head - tail
+                                        : BSPATCH_QUEUE_SIZE - tail;
+        pthread_mutex_unlock(&s->lock);
+
+        size_t produced;
+        int status = DecodeSome(s, s->queue + tail, space, &produced);
+
+        pthread_mutex_lock(&s->lock);
+        s->count += produced;
+        if (status != 0) {
+            s->error = status < 0;
+            s->done = 1;
+        }
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// Set up decoding of a stream compressed with the given BSDIFF_*
+// method.  old_data is only used for BSDIFF_ZSTD_SRC streams, which
+// were compressed with the source as a prefix.
+static int StartStream(DecodedStream* s, int compression,
+                       char* data, size_t len,
+                       const unsigned char* old_data, ssize_t old_size,
+                       const char* what) {
+    memset(s, 0, sizeof(*s));
+    s->compression = compression;
+
+    if (compression == BSDIFF_BZIP2) {
+        s->bz.next_in = data;
+        s->bz.avail_in = len;
+        int bzerr = BZ2_bzDecompressInit(&s->bz, 0, 0);
+        if (bzerr != BZ_OK) {
+            printf("failed to bzinit %s stream (%d)\n", what, bzerr);
+            return -1;
+        }
+    } else if (compression == BSDIFF_ZSTD ||
+               compression == BSDIFF_ZSTD_SRC) {
+#ifdef USE_ZSTD
+        s->zs = ZSTD_createDStream();
+        if (s->zs == NULL) {
+            printf("failed to create zstd %s stream\n", what);
+            return -1;
+        }
+        ZSTD_DCtx_setParameter(s->zs, ZSTD_d_windowLogMax,
+                               BSDIFF_ZSTD_MAX_WINDOW_LOG);
+        if (compression == BSDIFF_ZSTD_SRC && old_size > 0) {
+            size_t r = ZSTD_DCtx_refPrefix(s->zs, old_data, old_size);
+            if (ZSTD_isError(r)) {
+                printf("failed to set zstd prefix for %s stream: %s\n",
+                       what, ZSTD_getErrorName(r));
+                ZSTD_freeDStream(s->zs);
+                return -1;
+            }
+        }
+        s->zin.src = data;
+        s->zin.size = len;
+        s->zin.pos = 0;
+#else
+        printf("%s stream is zstd-compressed; not supported in this build\n",
+               what);
+        return -1;
+#endif
+    } else {
+        printf("unknown compression %d for %s stream\n", compression, what);
         return -1;
     }
 
-    if (sink(new_data, new_size, token) < new_size) {
-        printf("short write of output: %d (%s)\n", errno, strerror(errno));
-        return 1;
+    if (len < BSPATCH_THREAD_MIN_INPUT) return 0;
+
+    s->queue = malloc(BSPATCH_QUEUE_SIZE);
+    if (s->queue == NULL) return 0;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    if (pthread_create(&s->thread, NULL, DecodeThread, s) != 0) {
+        // Fall back to decoding on the caller's thread.
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->cond);
+        free(s->queue);
+        s->queue = NULL;
+        return 0;
+    }
+    s->threaded = 1;
+    return 0;
+}
+
+static void EndStream(DecodedStream* s) {
+    if (s->threaded) {
+        pthread_mutex_lock(&s->lock);
+        s->stop = 1;
+        pthread_cond_broadcast(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+        pthread_mutex_destroy(&s->lock);
+        pthread_cond_destroy(&s->cond);
+        free(s->queue);
+        s->threaded = 0;
     }
-    if (ctx) {
-        SHA_update(ctx, new_data, new_size);
+#ifdef USE_ZSTD
+    if (s->compression != BSDIFF_BZIP2) {
+        ZSTD_freeDStream(s->zs);
+        return;
     }
-    free(new_data);
+#endif
+    BZ2_bzDecompressEnd(&s->bz);
+}
+
+// Read exactly 'size' decoded bytes from the stream into buffer.
+// Returns 0 on success.
+static int ReadStream(unsigned char* buffer, size_t size, DecodedStream* s) {
+    if (!s->threaded) {
+        while (size > 0) {
+            size_t produced;
+            int status = DecodeSome(s, buffer, size, &produced);
+            buffer += produced;
+            size -= produced;
+            if (status < 0) return -1;
+            if (status > 0 && size > 0) {
+                printf("need %ld more bytes\n", (long)size);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while (size > 0) {
+        while (s->count == 0 && !s->done) {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->count == 0) {
+            if (!s->error) {
+                printf("need %ld more bytes\n", (long)size);
+            }
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
 
+        size_t len = s->count;
+        if (len > BSPATCH_QUEUE_SIZE - s->head) {
+            len = BSPATCH_QUEUE_SIZE - s->head;
+        }
+        if (len > size) len = size;
+        memcpy(buffer, s->queue + s->head, len);
+        s->head = (s->head + len) % BSPATCH_QUEUE_SIZE;
+        s->count -= len;
+        buffer += len;
+        size -= len;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+// Output of the patch is produced into a window of at most this
+// many bytes, which is handed to the sink every time it fills up.
+// This bounds the memory used for the target regardless of its size.
+#define BSPATCH_WINDOW_SIZE (1024*1024)
+
+typedef struct {
+    unsigned char* buffer;
+    ssize_t size;
+    ssize_t used;
+    SinkFn sink;        // NULL if the buffer holds the whole output
+    void* token;
+    SHA_CTX* ctx;
+} OutputWindow;
+
+static int FlushWindow(OutputWindow* w) {
+    if (w->sink == NULL || w->used == 0) return 0;
+    if (w->sink(w->buffer, w->used, w->token) < w->used) {
+        printf("short write of output: %d (%s)\n", errno, strerror(errno));
+        return -1;
+    }
+    if (w->ctx) {
+        SHA_update(w->ctx, w->buffer, w->used);
+    }
+    w->used = 0;
+    return 0;
+}
+
+// Run the patch, writing the output into the window (and through
+// the window's sink, if it has one).  new_size is filled in from
+// the patch header as soon as it has been read, so that callers can
+// size the window via the setup callback.
+static int ApplyBSDiffPatchWindowed(const unsigned char* old_data,
+                                    ssize_t old_size,
+                                    const Value* patch, ssize_t patch_offset,
+                                    ssize_t* new_size,
+                                    int (*setup)(OutputWindow*, ssize_t),
+                                    OutputWindow* w) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -134,9 +399,33 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     // with control block a set of triples (x,y,z) meaning "add x bytes
     // from oldfile to x bytes from the diff block; copy y bytes from the
     // extra block; seek forwards in oldfile by z bytes".
-
+    //
+    // BSDIFF41 is the same, except that the header is 40 bytes long
+    // and bytes 32, 33 and 34 give the compression (BSDIFF_* in
+    // imgdiff.h) of the control, diff and extra blocks respectively.
+
+    // patch_offset comes from the patch itself, when it's a chunk of an
+    // imgdiff patch, so none of these lengths can be trusted to add up
+    // without overflowing: each is checked against what's left instead.
+    if (patch_offset < 0 || patch_offset > patch->size ||
+        patch->size - patch_offset < 32) {
+        printf("patch too short to contain bsdiff header\n");
+        return 1;
+    }
+    ssize_t patch_left = patch->size - patch_offset;
     unsigned char* header = (unsigned char*) patch->data + patch_offset;
-    if (memcmp(header, "BSDIFF40", 8) != 0) {
+    ssize_t header_len;
+    int ctrl_comp, diff_comp, extra_comp;
+    if (memcmp(header, "BSDIFF40", 8) == 0) {
+        header_len = 32;
+        ctrl_comp = diff_comp = extra_comp = BSDIFF_BZIP2;
+    } else if (memcmp(header, "BSDIFF41", 8) == 0 &&
+               patch_left >= 40) {
+        header_len = 40;
+        ctrl_comp = header[32];
+        diff_comp = header[33];
+        extra_comp = header[34];
+    } else {
         printf("corrupt bsdiff patch file header (magic number)\n");
         return 1;
     }
@@ -146,107 +435,183 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
     data_len = offtin(header+16);
     *new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    patch_left -= header_len;
+    if (ctrl_len < 0 || ctrl_len > patch_left ||
+        data_len < 0 || data_len > patch_left - ctrl_len || *new_size < 0) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
+    patch_left -= ctrl_len + data_len;
 
-    int bzerr;
-
-    bz_stream cstream;
-    cstream.next_in = patch->data + patch_offset + 32;
-    cstream.avail_in = ctrl_len;
-    cstream.bzalloc = NULL;
-    cstream.bzfree = NULL;
-    cstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&cstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit control stream (%d)\n", bzerr);
-    }
-
-    bz_stream dstream;
-    dstream.next_in = patch->data + patch_offset + 32 + ctrl_len;
-    dstream.avail_in = data_len;
-    dstream.bzalloc = NULL;
-    dstream.bzfree = NULL;
-    dstream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&dstream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit diff stream (%d)\n", bzerr);
+    if (setup(w, *new_size) != 0) {
+        return 1;
     }
 
-    bz_stream estream;
-    estream.next_in = patch->data + patch_offset + 32 + ctrl_len + data_len;
-    estream.avail_in = patch->size - (patch_offset + 32 + ctrl_len + data_len);
-    estream.bzalloc = NULL;
-    estream.bzfree = NULL;
-    estream.opaque = NULL;
-    if ((bzerr = BZ2_bzDecompressInit(&estream, 0, 0)) != BZ_OK) {
-        printf("failed to bzinit extra stream (%d)\n", bzerr);
-    }
+    int result = 1;
+    char* blocks = patch->data + patch_offset + header_len;
+    DecodedStream cstream, dstream, estream;
+    int started = 0;
 
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
+    // The control, diff and extra blocks are independent compressed
+    // streams; the diff and extra streams are decoded ahead of the
+    // loop below on their own threads when they're large enough.
+    if (StartStream(&cstream, ctrl_comp, blocks, ctrl_len,
+                    old_data, old_size, "control") != 0) {
         return 1;
     }
+    ++started;
+    if (StartStream(&dstream, diff_comp, blocks + ctrl_len, data_len,
+                    old_data, old_size, "diff") != 0) {
+        goto done;
+    }
+    ++started;
+    if (StartStream(&estream, extra_comp, blocks + ctrl_len + data_len,
+                    patch_left, old_data, old_size, "extra") != 0) {
+        goto done;
+    }
+    ++started;
 
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
-    int i;
     unsigned char buf[24];
     while (newpos < *new_size) {
         // Read control data
-        if (FillBuffer(buf, 24, &cstream) != 0) {
+        if (ReadStream(buf, 24, &cstream) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
         ctrl[2] = offtin(buf+16);
 
-        // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        // Sanity check, without adding lengths that could overflow.
+        if (ctrl[0] < 0 || ctrl[1] < 0 ||
+            ctrl[0] > *new_size - newpos ||
+            ctrl[1] > *new_size - newpos - ctrl[0]) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
-        }
+        // Read diff string and add old data to it, a window at a time.
+        off_t remaining = ctrl[0];
+        while (remaining > 0) {
+            if (w->used == w->size && FlushWindow(w) != 0) goto done;
+            off_t len = w->size - w->used;
+            if (remaining < len) len = remaining;
+
+            unsigned char* out = w->buffer + w->used;
+            if (ReadStream(out, len, &dstream) != 0) {
+                printf("error while reading diff stream\n");
+                goto done;
+            }
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+            // Only the part of [oldpos, oldpos+len) that lies within
+            // the source gets old data added; the rest of the diff
+            // bytes are used as-is.
+            off_t lo = oldpos < 0 ? -oldpos : 0;
+            off_t hi = old_size - oldpos < len ? old_size - oldpos : len;
+            if (lo < hi) {
+                AddOldData(out + lo, old_data + oldpos + lo, hi - lo);
             }
+
+            w->used += len;
+            newpos += len;
+            oldpos += len;
+            remaining -= len;
         }
 
-        // Adjust pointers
-        newpos += ctrl[0];
-        oldpos += ctrl[0];
+        // Read extra string, a window at a time.
+        remaining = ctrl[1];
+        while (remaining > 0) {
+            if (w->used == w->size && FlushWindow(w) != 0) goto done;
+            off_t len = w->size - w->used;
+            if (remaining < len) len = remaining;
 
-        // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
-            printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
+            if (ReadStream(w->buffer + w->used, len, &estream) != 0) {
+                printf("error while reading extra stream\n");
+                goto done;
+            }
 
-        // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+            w->used += len;
+            newpos += len;
+            remaining -= len;
         }
 
         // Adjust pointers
-        newpos += ctrl[1];
         oldpos += ctrl[2];
     }
 
-    BZ2_bzDecompressEnd(&cstream);
-    BZ2_bzDecompressEnd(&dstream);
-    BZ2_bzDecompressEnd(&estream);
+    if (FlushWindow(w) != 0) goto done;
+    result = 0;
+
+  done:
+    if (started > 0) EndStream(&cstream);
+    if (started > 1) EndStream(&dstream);
+    if (started > 2) EndStream(&estream);
+    return result;
+}
+
+// The streaming window is a fixed-size buffer, reused until the
+// whole target has been passed to the sink.
+static int SetupStreamingWindow(OutputWindow* w, ssize_t new_size) {
+    w->size = new_size < BSPATCH_WINDOW_SIZE ? new_size : BSPATCH_WINDOW_SIZE;
+    w->used = 0;
+    w->buffer = malloc(w->size > 0 ? w->size : 1);
+    if (w->buffer == NULL) {
+        printf("failed to allocate %ld bytes of memory for output window\n",
+               (long)w->size);
+        return -1;
+    }
+    return 0;
+}
+
+// The in-memory "window" holds the entire target.
+static int SetupMemoryWindow(OutputWindow* w, ssize_t new_size) {
+    w->size = new_size;
+    w->used = 0;
+    w->buffer = malloc(new_size > 0 ? new_size : 1);
+    if (w->buffer == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)new_size);
+        return -1;
+    }
+    return 0;
+}
+
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
+    OutputWindow w;
+    w.buffer = NULL;
+    w.sink = sink;
+    w.token = token;
+    w.ctx = ctx;
+
+    ssize_t new_size;
+    int result = ApplyBSDiffPatchWindowed(old_data, old_size, patch,
+                                          patch_offset, &new_size,
+                                          SetupStreamingWindow, &w);
+    free(w.buffer);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    OutputWindow w;
+    w.buffer = NULL;
+    w.sink = NULL;
+    w.token = NULL;
+    w.ctx = NULL;
+
+    int result = ApplyBSDiffPatchWindowed(old_data, old_size, patch,
+                                          patch_offset, new_size,
+                                          SetupMemoryWindow, &w);
+    if (result != 0) {
+        free(w.buffer);
+        *new_data = NULL;
+        return result;
+    }
+    *new_data = w.buffer;
     return 0;
 }
@@ -0,0 +1,282 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times patch application for a set of (source, patch) pairs, such as
+// the files from a real incremental OTA package, without touching any
+// filesystem other than to read the inputs.  Output is hashed but
+// otherwise discarded.
+//
+// usage: bspatch_bench [-n <iterations>] [-s <megabytes>]
+//                      [<src> <patch> ...]
+//
+// BSDIFF40, BSDIFF41 and IMGDIFF2 patches are accepted; for instance
+// "bspatch_bench testdata/old.file testdata/patch.bsdiff" replays the
+// patch used by applypatch.sh.  -s adds a synthetic bsdiff patch that
+// produces a target of the given size, with the sparse diff blocks and
+// short extra runs typical of patches between builds.  The SHA-1 of
+// each output is printed so that results can be compared between
+// builds.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <bzlib.h>
+
+#include "mincrypt/sha.h"
+#include "applypatch.h"
+
+static unsigned char* ReadWholeFile(const char* filename, ssize_t* size) {
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+        return NULL;
+    }
+    unsigned char* data = malloc(st.st_size > 0 ? st.st_size : 1);
+    FILE* f = fopen(filename, "rb");
+    if (f == NULL) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        free(data);
+        return NULL;
+    }
+    if (fread(data, 1, st.st_size, f) != (size_t)st.st_size) {
+        printf("short read of \"%s\"\n", filename);
+        fclose(f);
+        free(data);
+        return NULL;
+    }
+    fclose(f);
+    *size = st.st_size;
+    return data;
+}
+
+static void offtout(off_t x, unsigned char* buf) {
+    off_t y = x < 0 ? -x : x;
+    int i;
+    for (i = 0; i < 8; ++i) {
+        buf[i] = y % 256;
+        y /= 256;
+    }
+    if (x < 0) buf[7] |= 0x80;
+}
+
+static unsigned char* Compress(unsigned char* data, unsigned int len,
+                               unsigned int* out_len) {
+    *out_len = len + len / 100 + 600;
+    unsigned char* out = malloc(*out_len);
+    if (BZ2_bzBuffToBuffCompress((char*)out, out_len, (char*)data, len,
+                                 9, 0, 0) != BZ_OK) {
+        printf("failed to compress synthetic patch\n");
+        exit(1);
+    }
+    return out;
+}
+
+// Build a source of 'size' bytes and a BSDIFF40 patch that turns it
+// into a target of about the same size.  Each 64k of target is 60k of
+// diff bytes (one in 64 nonzero) followed by 4k of extra bytes.  The
+// last few triples run past the end of the source, so the clipped
+// part of the add loop is exercised too.
+static void MakeSyntheticPatch(size_t size, unsigned char** src,
+                               ssize_t* src_size, Value* patch) {
+    const size_t kDiff = 60*1024, kExtra = 4*1024;
+    size_t triples = size / (kDiff + kExtra) + 1;
+    size_t new_size = triples * (kDiff + kExtra);
+    unsigned int seed = 1;
+    size_t i;
+
+    *src_size = size;
+    *src = malloc(size);
+    for (i = 0; i < size; ++i) {
+        seed = seed * 1103515245 + 12345;
+        (*src)[i] = seed >> 16;
+    }
+
+    unsigned char* ctrl = malloc(triples * 24);
+    unsigned char* diff = calloc(triples, kDiff);
+    unsigned char* extra = malloc(triples * kExtra);
+    for (i = 0; i < triples; ++i) {
+        offtout(kDiff, ctrl + i*24);
+        offtout(kExtra, ctrl + i*24 + 8);
+        offtout(0, ctrl + i*24 + 16);
+    }
+    for (i = 0; i < triples * kDiff; i += 64) {
+        seed = seed * 1103515245 + 12345;
+        diff[i + (seed >> 16) % 64] = seed >> 8;
+    }
+    for (i = 0; i < triples * kExtra; ++i) {
+        seed = seed * 1103515245 + 12345;
+        extra[i] = seed >> 16;
+    }
+
+    unsigned int clen, dlen, elen;
+    unsigned char* c = Compress(ctrl, triples * 24, &clen);
+    unsigned char* d = Compress(diff, triples * kDiff, &dlen);
+    unsigned char* e = Compress(extra, triples * kExtra, &elen);
+
+    patch->type = VAL_BLOB;
+    patch->size = 32 + clen + dlen + elen;
+    patch->data = malloc(patch->size);
+    unsigned char* p = (unsigned char*)patch->data;
+    memcpy(p, "BSDIFF40", 8);
+    offtout(clen, p+8);
+    offtout(dlen, p+16);
+    offtout(new_size, p+24);
+    memcpy(p+32, c, clen);
+    memcpy(p+32+clen, d, dlen);
+    memcpy(p+32+clen+dlen, e, elen);
+
+    free(ctrl); free(diff); free(extra);
+    free(c); free(d); free(e);
+}
+
+static ssize_t CountingSink(unsigned char* data, ssize_t len, void* token) {
+    *(ssize_t*)token += len;
+    return len;
+}
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Apply the patch 'iterations' times and report the best and mean
+// times.  Returns 0 on success.
+static int Run(const char* name, unsigned char* src, ssize_t src_size,
+               Value* patch, int iterations,
+               double* total_time, double* total_bytes) {
+    int imgdiff = patch->size >= 8 && memcmp(patch->data, "IMGDIFF2", 8) == 0;
+    if (!imgdiff && (patch->size < 8 ||
+                     (memcmp(patch->data, "BSDIFF40", 8) != 0 &&
+                      memcmp(patch->data, "BSDIFF41", 8) != 0))) {
+        printf("%s: unknown patch type\n", name);
+        return -1;
+    }
+
+    double best = 0, sum = 0;
+    ssize_t out_size = 0;
+    uint8_t digest[SHA_DIGEST_SIZE];
+    int j;
+    for (j = 0; j < iterations; ++j) {
+        SHA_CTX ctx;
+        SHA_init(&ctx);
+        out_size = 0;
+
+        double start = Now();
+        int result;
+        if (imgdiff) {
+            result = ApplyImagePatch(src, src_size, patch, CountingSink,
+                                     &out_size, &ctx, NULL);
+        } else {
+            result = ApplyBSDiffPatch(src, src_size, patch, 0,
+                                      CountingSink, &out_size, &ctx);
+        }
+        double elapsed = Now() - start;
+        if (result != 0) {
+            printf("%s: failed to apply patch\n", name);
+            return -1;
+        }
+        memcpy(digest, SHA_final(&ctx), SHA_DIGEST_SIZE);
+
+        sum += elapsed;
+        if (j == 0 || elapsed < best) best = elapsed;
+    }
+
+    printf("%s: %ld bytes out; best %.3f s (%.1f MB/s), mean %.3f s; sha1 ",
+           name, (long)out_size, best,
+           best > 0 ? out_size / best / 1e6 : 0.0, sum / iterations);
+    for (j = 0; j < SHA_DIGEST_SIZE; ++j) {
+        printf("%02x", digest[j]);
+    }
+    printf("\n");
+    *total_time += best;
+    *total_bytes += out_size;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int iterations = 5;
+    int synthetic_mb = 0;
+    const char* prog = argv[0];
+    if (argc >= 3 && strcmp(argv[1], "-n") == 0) {
+        iterations = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
+        synthetic_mb = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if ((argc-1) % 2 != 0 || iterations < 1 ||
+        (argc < 3 && synthetic_mb <= 0)) {
+        fprintf(stderr, "usage: %s [-n <iterations>] [-s <megabytes>] "
+                "[<src> <patch> ...]\n", prog);
+        return 2;
+    }
+
+    double total_time = 0;
+    double total_bytes = 0;
+    int runs = 0;
+
+    if (synthetic_mb > 0) {
+        unsigned char* src;
+        ssize_t src_size;
+        Value patch;
+        MakeSyntheticPatch((size_t)synthetic_mb << 20, &src, &src_size, &patch);
+        if (Run("synthetic", src, src_size, &patch, iterations,
+                &total_time, &total_bytes) != 0) {
+            return 1;
+        }
+        ++runs;
+        free(src);
+        free(patch.data);
+    }
+
+    int i;
+    for (i = 1; i < argc; i += 2) {
+        ssize_t src_size, patch_size;
+        unsigned char* src = ReadWholeFile(argv[i], &src_size);
+        if (src == NULL) return 1;
+        unsigned char* patch_data = ReadWholeFile(argv[i+1], &patch_size);
+        if (patch_data == NULL) return 1;
+
+        Value patch;
+        patch.type = VAL_BLOB;
+        patch.size = patch_size;
+        patch.data = (char*)patch_data;
+
+        if (Run(argv[i+1], src, src_size, &patch, iterations,
+                &total_time, &total_bytes) != 0) {
+            return 1;
+        }
+        ++runs;
+
+        free(src);
+        free(patch_data);
+    }
+
+    if (runs > 1) {
+        printf("total: %.0f bytes out; %.3f s (%.1f MB/s)\n",
+               total_bytes, total_time,
+               total_time > 0 ? total_bytes / total_time / 1e6 : 0.0);
+    }
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests for bspatch.c's handling of malformed patches.  Each test
+// builds a small BSDIFF40 patch in memory and applies it both to a
+// buffer and through a sink.  A patch that makes bspatch loop forever
+// fails the test by alarm.
+//
+// usage: bspatch_test
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bzlib.h"
+#include "applypatch.h"
+#include "testutil/testutil.h"
+
+static const unsigned char old_data[8] = "01234567";
+
+static void offtout(long long x, unsigned char* buf) {
+    unsigned long long y = x < 0 ? -x : x;
+    int i;
+    for (i = 0; i < 8; ++i) {
+        buf[i] = y & 0xff;
+        y >>= 8;
+    }
+    if (x < 0) buf[7] |= 0x80;
+}
+
+// Append the bzip2 compression of 'data' to 'out'.  Returns the
+// compressed length.
+static long long AppendBzip2(unsigned char* out, const void* data,
+                             unsigned int len) {
+    unsigned int out_len = 1024;
+    if (BZ2_bzBuffToBuffCompress((char*)out, &out_len, (char*)data, len,
+                                 9, 0, 0) != BZ_OK) {
+        printf("  failed to compress test data\n");
+        exit(2);
+    }
+    return out_len;
+}
+
+// Build a patch with a single control triple, producing 'new_size'
+// bytes.  The caller frees patch->data.
+static void MakePatch(Value* patch, long long new_size,
+                      long long add, long long copy, long long seek,
+                      const char* diff, const char* extra) {
+    unsigned char triple[24];
+    offtout(add, triple);
+    offtout(copy, triple + 8);
+    offtout(seek, triple + 16);
+
+    unsigned char* p = malloc(4096);
+    memcpy(p, "BSDIFF40", 8);
+    long long ctrl_len = AppendBzip2(p + 32, triple, sizeof(triple));
+    long long diff_len = AppendBzip2(p + 32 + ctrl_len, diff, strlen(diff));
+    long long extra_len = AppendBzip2(p + 32 + ctrl_len + diff_len,
+                                      extra, strlen(extra));
+    offtout(ctrl_len, p + 8);
+    offtout(diff_len, p + 16);
+    offtout(new_size, p + 24);
+
+    patch->type = VAL_BLOB;
+    patch->size = 32 + ctrl_len + diff_len + extra_len;
+    patch->data = (char*)p;
+}
+
+static ssize_t sunk;
+
+static ssize_t CountingSink(unsigned char* data, ssize_t len, void* token) {
+    sunk += len;
+    return len;
+}
+
+// Apply 'patch' to old_data in memory.  Returns 0 on success, leaving
+// the result in new_data.
+static int ApplyMem(const Value* patch, unsigned char** new_data,
+                    ssize_t* new_size) {
+    *new_data = NULL;
+    return ApplyBSDiffPatchMem(old_data, sizeof(old_data), patch, 0,
+                               new_data, new_size);
+}
+
+// Apply 'patch' through CountingSink.  Returns 0 on success.
+static int ApplyStreaming(const Value* patch) {
+    sunk = 0;
+    return ApplyBSDiffPatch(old_data, sizeof(old_data), patch, 0,
+                            CountingSink, NULL, NULL);
+}
+
+static void TestValid() {
+    printf("valid patch\n");
+    // Add 1 to the first four bytes, then copy "abcd".
+    Value patch;
+    MakePatch(&patch, 8, 4, 4, 0, "\1\1\1\1", "abcd");
+
+    unsigned char* new_data;
+    ssize_t new_size;
+    EXPECT(ApplyMem(&patch, &new_data, &new_size) == 0);
+    EXPECT(new_size == 8);
+    EXPECT(new_data != NULL && memcmp(new_data, "1234abcd", 8) == 0);
+    free(new_data);
+
+    EXPECT(ApplyStreaming(&patch) == 0);
+    EXPECT(sunk == 8);
+    free(patch.data);
+}
+
+static void TestHugeControlValues() {
+    printf("control values that overflow when added\n");
+    // 2^62 + 2^62 wraps negative, so a check that adds them first
+    // lets the diff run past the end of the output: in memory it
+    // spins once the buffer is full, and streaming it writes more
+    // than new_size bytes.
+    Value patch;
+    MakePatch(&patch, 8, 1LL << 62, 1LL << 62, 0,
+              "\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1\1", "");
+
+    unsigned char* new_data;
+    ssize_t new_size;
+    EXPECT(ApplyMem(&patch, &new_data, &new_size) != 0);
+    free(new_data);
+
+    EXPECT(ApplyStreaming(&patch) != 0);
+    EXPECT(sunk <= 8);
+    free(patch.data);
+}
+
+static void TestOverrun() {
+    printf("control values past the end of the output\n");
+    Value patch;
+    MakePatch(&patch, 8, 4, 5, 0, "\0\0\0\0", "abcde");
+
+    unsigned char* new_data;
+    ssize_t new_size;
+    EXPECT(ApplyMem(&patch, &new_data, &new_size) != 0);
+    free(new_data);
+
+    EXPECT(ApplyStreaming(&patch) != 0);
+    EXPECT(sunk <= 8);
+    free(patch.data);
+}
+
+static void TestHugeBlockLengths() {
+    printf("block lengths that overflow when added\n");
+    Value patch;
+    MakePatch(&patch, 8, 4, 4, 0, "\0\0\0\0", "abcd");
+    offtout(1LL << 62, (unsigned char*)patch.data + 8);
+    offtout((1LL << 62) + (1LL << 61) + (1LL << 60),
+            (unsigned char*)patch.data + 16);
+
+    unsigned char* new_data;
+    ssize_t new_size;
+    EXPECT(ApplyMem(&patch, &new_data, &new_size) != 0);
+    free(new_data);
+    EXPECT(ApplyStreaming(&patch) != 0);
+    free(patch.data);
+}
+
+static void Timeout(int sig) {
+    static const char msg[] = "  FAILED: timed out\nFAILURE\n";
+    write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    _exit(1);
+}
+
+int main(int argc, char** argv) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    signal(SIGALRM, Timeout);
+    alarm(30);
+
+    TestValid();
+    TestHugeControlValues();
+    TestOverrun();
+    TestHugeBlockLengths();
+
+    return TestFinish();
+}
@@ -1,19 +1,104 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <libgen.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <ctype.h>
+#include <signal.h>
 
 #include "applypatch.h"
 
-static int EliminateOpenFiles(char** files, int file_count) {
+// Space on /cache is managed from an index of the files that could be
+// deleted, built the first time space is needed rather than on every
+// call.  Building it is the expensive part, since the only way to find
+// out which files are open is to look through every process's fds.
+// Files opened after that are either ones applypatch made itself
+// (which it marks in use with ReserveCacheFile()) or are caught just
+// before each file is deleted by trying to take a write lease on it,
+// which the kernel only grants when no other fd has the file open;
+// files created after that are left alone, and if the indexed files
+// aren't enough, the index is rebuilt once to pick those up.
+//
+// Boards that build with RECOVERY_CACHE_EVICT_OLDEST := true delete
+// the least recently modified files first instead of the largest.
+
+#ifdef RECOVERY_CACHE_EVICT_OLDEST
+#define DEFAULT_EVICT_POLICY CACHE_EVICT_OLDEST
+#else
+#define DEFAULT_EVICT_POLICY CACHE_EVICT_LARGEST
+#endif
+
+typedef struct {
+  char* path;
+  off_t bytes;        // space the file occupies, not its length
+  time_t mtime;
+  int gone;           // deleted, or found to be in use
+} CacheFile;
+
+typedef struct {
+  char* root;
+  CacheEvictPolicy policy;
+  CacheFile* files;   // sorted in the order to delete them
+  int count;
+  int indexed;
+  char** in_use;      // files reserved by applypatch
+  int in_use_count;
+} CacheSpace;
+
+static CacheSpace cache = { NULL, DEFAULT_EVICT_POLICY, NULL, 0, 0, NULL, 0 };
+
+static const char* CacheRoot() {
+  return cache.root ? cache.root : "/cache";
+}
+
+static void ClearIndex() {
+  int i;
+  for (i = 0; i < cache.count; ++i) {
+    free(cache.files[i].path);
+  }
+  free(cache.files);
+  cache.files = NULL;
+  cache.count = 0;
+  cache.indexed = 0;
+}
+
+// Use 'root' (normally "/cache") as the cache directory and 'policy'
+// to choose which files to delete first.  Any existing index is
+// discarded.
+void CacheSpaceInit(const char* root, CacheEvictPolicy policy) {
+  ClearIndex();
+  free(cache.root);
+  cache.root = root ? strdup(root) : NULL;
+  cache.policy = policy;
+}
+
+static int IsInUse(const char* path) {
+  int i;
+  if (strcmp(path, CACHE_TEMP_SOURCE) == 0 ||
+      strcmp(path, CACHE_HASH_FILE) == 0) {
+    // We might have restarted during installation and be depending
+    // on these to be there.
+    return 1;
+  }
+  for (i = 0; i < cache.in_use_count; ++i) {
+    if (strcmp(path, cache.in_use[i]) == 0) return 1;
+  }
+  return 0;
+}
+
+static int EliminateOpenFiles(CacheFile* files, int file_count) {
   DIR* d;
   struct dirent* de;
+  const char* root = CacheRoot();
+  size_t root_len = strlen(root);
+
   d = opendir("/proc");
   if (d == NULL) {
     printf("error opening /proc: %s\n", strerror(errno));
@@ -49,16 +134,12 @@ static int EliminateOpenFiles(char** files, int file_count) {
       if (count >= 0) {
         link[count] = '\0';
 
-        // This is inefficient, but it should only matter if there are
-        // lots of files in /cache, and lots of them are open (neither
-        // of which should be true, especially in recovery).
-        if (strncmp(link, "/cache/", 7) == 0) {
+        if (strncmp(link, root, root_len) == 0 && link[root_len] == '/') {
           int j;
           for (j = 0; j < file_count; ++j) {
-            if (files[j] && strcmp(files[j], link) == 0) {
+            if (!files[j].gone && strcmp(files[j].path, link) == 0) {
               printf("%s is open by %s\n", link, de->d_name);
-              free(files[j]);
-              files[j] = NULL;
+              files[j].gone = 1;
             }
           }
         }
@@ -71,22 +152,53 @@ static int EliminateOpenFiles(char** files, int file_count) {
   return 0;
 }
 
-int FindExpendableFiles(char*** names, int* entries) {
-  DIR* d;
-  struct dirent* de;
+// Returns 1 if some other fd has 'path' open, 0 if not, or -1 if it
+// can't be told without looking through /proc (the filesystem doesn't
+// do leases).
+static int IsOpenElsewhere(const char* path) {
+  int fd = open(path, O_RDONLY | O_NONBLOCK | O_NOFOLLOW);
+  if (fd < 0) return errno == ENOENT ? 0 : -1;
+  // Breaking a lease signals its holder, with SIGIO unless told
+  // otherwise; that would kill us, so ask for a signal that's ignored.
+  int r = fcntl(fd, F_SETSIG, SIGURG);
+  if (r == 0) r = fcntl(fd, F_SETLEASE, F_WRLCK);
+  int saved_errno = errno;
+  if (r == 0) fcntl(fd, F_SETLEASE, F_UNLCK);
+  close(fd);
+  if (r == 0) return 0;
+  return (saved_errno == EAGAIN || saved_errno == EBUSY) ? 1 : -1;
+}
+
+static int CompareLargest(const void* a, const void* b) {
+  off_t sa = ((const CacheFile*)a)->bytes;
+  off_t sb = ((const CacheFile*)b)->bytes;
+  return sa > sb ? -1 : (sa < sb ? 1 : 0);
+}
+
+static int CompareOldest(const void* a, const void* b) {
+  time_t ta = ((const CacheFile*)a)->mtime;
+  time_t tb = ((const CacheFile*)b)->mtime;
+  return ta < tb ? -1 : (ta > tb ? 1 : 0);
+}
+
+// Build the index of files we're allowed to delete: unopened regular
+// files directly in the cache directory or its recovery/otatest
+// subdirectory.
+static int IndexCache() {
+  ClearIndex();
+
   int size = 32;
-  *entries = 0;
-  *names = malloc(size * sizeof(char*));
+  cache.files = malloc(size * sizeof(CacheFile));
 
   char path[FILENAME_MAX];
-
-  // We're allowed to delete unopened regular files in any of these
-  // directories.
-  const char* dirs[2] = {"/cache", "/cache/recovery/otatest"};
+  char dirs[2][FILENAME_MAX];
+  snprintf(dirs[0], sizeof(dirs[0]), "%s", CacheRoot());
+  snprintf(dirs[1], sizeof(dirs[1]), "%s/recovery/otatest", CacheRoot());
 
   unsigned int i;
   for (i = 0; i < sizeof(dirs)/sizeof(dirs[0]); ++i) {
-    d = opendir(dirs[i]);
+    DIR* d = opendir(dirs[i]);
+    struct dirent* de;
     if (d == NULL) {
       printf("error opening %s: %s\n", dirs[i], strerror(errno));
       continue;
@@ -94,79 +206,173 @@ int FindExpendableFiles(char*** names, int* entries) {
 
     // Look for regular files in the directory (not in any subdirectories).
     while ((de = readdir(d)) != 0) {
-      strcpy(path, dirs[i]);
-      strcat(path, "/");
-      strcat(path, de->d_name);
-
-      // We can't delete CACHE_TEMP_SOURCE; if it's there we might have
-      // restarted during installation and could be depending on it to
-      // be there.
-      if (strcmp(path, CACHE_TEMP_SOURCE) == 0) continue;
+      int len = snprintf(path, sizeof(path), "%s/%s", dirs[i], de->d_name);
+      if (len < 0 || len >= (int)sizeof(path)) {
+        printf("skipping %s/%s: path too long\n", dirs[i], de->d_name);
+        continue;
+      }
+      if (IsInUse(path)) continue;
 
       struct stat st;
       if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
-        if (*entries >= size) {
+        if (cache.count >= size) {
           size *= 2;
-          *names = realloc(*names, size * sizeof(char*));
+          cache.files = realloc(cache.files, size * sizeof(CacheFile));
         }
-        (*names)[(*entries)++] = strdup(path);
+        CacheFile* cf = cache.files + cache.count++;
+        cf->path = strdup(path);
+        cf->bytes = (off_t)st.st_blocks * 512;
+        cf->mtime = st.st_mtime;
+        cf->gone = 0;
       }
     }
 
     closedir(d);
   }
 
-  printf("%d regular files in deletable directories\n", *entries);
+  printf("%d regular files in deletable directories\n", cache.count);
 
-  if (EliminateOpenFiles(*names, *entries) < 0) {
+  if (EliminateOpenFiles(cache.files, cache.count) < 0) {
+    ClearIndex();
     return -1;
   }
 
+  qsort(cache.files, cache.count, sizeof(CacheFile),
+        cache.policy == CACHE_EVICT_OLDEST ? CompareOldest : CompareLargest);
+  cache.indexed = 1;
   return 0;
 }
 
+// Delete indexed files, in policy order, until bytes_needed are free.
+// Returns the number of bytes free afterwards.
+static size_t EvictFromIndex(size_t bytes_needed) {
+  size_t free_now = FreeSpaceForFile(CacheRoot());
+  int i;
+  for (i = 0; i < cache.count && free_now < bytes_needed; ++i) {
+    CacheFile* cf = cache.files + i;
+    if (cf->gone) continue;
+    // The index may be older than the file's last open.
+    if (IsInUse(cf->path)) {
+      cf->gone = 1;
+      continue;
+    }
+    int open_elsewhere = IsOpenElsewhere(cf->path);
+    if (open_elsewhere < 0) {
+      open_elsewhere = EliminateOpenFiles(cf, 1) < 0 || cf->gone;
+    } else if (open_elsewhere) {
+      printf("%s is open\n", cf->path);
+    }
+    if (open_elsewhere) {
+      cf->gone = 1;
+      continue;
+    }
+    cf->gone = 1;
+    if (unlink(cf->path) != 0) {
+      if (errno != ENOENT) {
+        printf("failed to delete %s: %s\n", cf->path, strerror(errno));
+      }
+      continue;
+    }
+    free_now = FreeSpaceForFile(CacheRoot());
+    printf("deleted %s; now %ld bytes free\n", cf->path, (long)free_now);
+  }
+  return free_now;
+}
+
 int MakeFreeSpaceOnCache(size_t bytes_needed) {
-  size_t free_now = FreeSpaceForFile("/cache");
-  printf("%ld bytes free on /cache (%ld needed)\n",
-         (long)free_now, (long)bytes_needed);
+  size_t free_now = FreeSpaceForFile(CacheRoot());
+  printf("%ld bytes free on %s (%ld needed)\n",
+         (long)free_now, CacheRoot(), (long)bytes_needed);
 
   if (free_now >= bytes_needed) {
     return 0;
   }
 
-  char** names;
-  int entries;
+  int fresh = 0;
+  if (!cache.indexed) {
+    if (IndexCache() < 0) return -1;
+    fresh = 1;
+  }
+  free_now = EvictFromIndex(bytes_needed);
 
-  if (FindExpendableFiles(&names, &entries) < 0) {
-    return -1;
+  if (free_now < bytes_needed && !fresh) {
+    // Files may have been closed or created since the index was built.
+    if (IndexCache() < 0) return -1;
+    free_now = EvictFromIndex(bytes_needed);
   }
 
-  if (entries == 0) {
-    // nothing we can delete to free up space!
-    printf("no files can be deleted to free space on /cache\n");
-    return -1;
+  if (free_now < bytes_needed) {
+    printf("no more files can be deleted to free space on %s\n",
+           CacheRoot());
   }
 
-  // We could try to be smarter about which files to delete:  the
-  // biggest ones?  the smallest ones that will free up enough space?
-  // the oldest?  the newest?
-  //
-  // Instead, we'll be dumb.
+  return (free_now >= bytes_needed) ? 0 : -1;
+}
 
-  int i;
-  for (i = 0; i < entries && free_now < bytes_needed; ++i) {
-    if (names[i]) {
-      unlink(names[i]);
-      free_now = FreeSpaceForFile("/cache");
-      printf("deleted %s; now %ld bytes free\n", names[i], (long)free_now);
-      free(names[i]);
-    }
+// Bionic has no fallocate() wrapper, so make the system call
+// directly; 64-bit arguments are passed as two registers on 32-bit
+// ARM.
+static int AllocateFileSpace(int fd, off64_t len) {
+#if defined(__arm__)
+  return syscall(__NR_fallocate, fd, 0, 0, 0,
+                 (uint32_t)len, (uint32_t)(len >> 32));
+#else
+  return syscall(__NR_fallocate, fd, 0, (off64_t)0, len);
+#endif
+}
+
+// Make room on the cache for 'filename' (which should be in the cache
+// directory) to hold 'bytes', and allocate that space to it now, so
+// that writing the file can't run out of space partway.  Existing
+// contents are left in place.  The file is marked in use, so it won't
+// be deleted to free space, until ReleaseCacheFile() is called.
+// Returns 0 on success.
+int ReserveCacheFile(const char* filename, size_t bytes) {
+  if (!IsInUse(filename)) {
+    cache.in_use = realloc(cache.in_use,
+                           (cache.in_use_count+1) * sizeof(char*));
+    cache.in_use[cache.in_use_count++] = strdup(filename);
   }
 
-  for (; i < entries; ++i) {
-    free(names[i]);
+  // Space the file already has doesn't need to be freed.
+  struct stat st;
+  size_t have = 0;
+  if (stat(filename, &st) == 0) {
+    have = (size_t)st.st_blocks * 512;
+  }
+  if (bytes > have && MakeFreeSpaceOnCache(bytes - have) < 0) {
+    return -1;
   }
-  free(names);
 
-  return (free_now >= bytes_needed) ? 0 : -1;
+  int fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    printf("failed to open \"%s\" for write: %s\n", filename, strerror(errno));
+    return -1;
+  }
+  if (bytes > 0 && AllocateFileSpace(fd, bytes) != 0) {
+    if (errno == ENOSPC) {
+      printf("failed to reserve %ld bytes for \"%s\": %s\n",
+             (long)bytes, filename, strerror(errno));
+      close(fd);
+      return -1;
+    }
+    // The filesystem can't preallocate; the writer will find out
+    // about any shortage the usual way.
+    printf("can't preallocate \"%s\" (%s)\n", filename, strerror(errno));
+  }
+  close(fd);
+  return 0;
+}
+
+// Forget a reservation made by ReserveCacheFile() (typically after
+// the file has been deleted).
+void ReleaseCacheFile(const char* filename) {
+  int i;
+  for (i = 0; i < cache.in_use_count; ++i) {
+    if (strcmp(cache.in_use[i], filename) == 0) {
+      free(cache.in_use[i]);
+      cache.in_use[i] = cache.in_use[--cache.in_use_count];
+      return;
+    }
+  }
 }
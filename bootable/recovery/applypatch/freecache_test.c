@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests for the cache space manager in freecache.c.  Each test mounts
+// a small tmpfs to stand in for /cache, so it must be run as root.
+//
+// usage: freecache_test [<scratch-dir>]
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "applypatch.h"
+#include "testutil/testutil.h"
+
+#define CACHE_SIZE (1024 << 10)
+
+static const char* cache_dir;
+
+static const char* CachePath(const char* name) {
+    static char path[4][FILENAME_MAX];
+    static int next = 0;
+    char* p = path[next++ % 4];
+    snprintf(p, FILENAME_MAX, "%s/%s", cache_dir, name);
+    return p;
+}
+
+static int Exists(const char* name) {
+    struct stat st;
+    return stat(CachePath(name), &st) == 0;
+}
+
+// Create a file of 'kb' kilobytes in the fake cache, last modified
+// 'age' seconds ago.
+static void MakeFile(const char* name, int kb, int age) {
+    const char* path = CachePath(name);
+    FILE* f = fopen(path, "wb");
+    char block[1024];
+    int i;
+    memset(block, 0x5a, sizeof(block));
+    for (i = 0; i < kb; ++i) {
+        fwrite(block, 1, sizeof(block), f);
+    }
+    fclose(f);
+
+    struct timeval tv[2];
+    gettimeofday(&tv[0], NULL);
+    tv[0].tv_sec -= age;
+    tv[1] = tv[0];
+    utimes(path, tv);
+}
+
+static size_t FreeKB() {
+    return FreeSpaceForFile(cache_dir) >> 10;
+}
+
+// Mount a fresh tmpfs of CACHE_SIZE on the cache directory and point
+// the cache space manager at it.
+static int SetUp(const char* name, CacheEvictPolicy policy) {
+    printf("%s\n", name);
+    char options[64];
+    snprintf(options, sizeof(options), "size=%d", CACHE_SIZE);
+    if (mount("tmpfs", cache_dir, "tmpfs", 0, options) != 0) {
+        printf("failed to mount tmpfs on %s: %s\n", cache_dir, strerror(errno));
+        return -1;
+    }
+    CacheSpaceInit(cache_dir, policy);
+    return 0;
+}
+
+static void TearDown() {
+    CacheSpaceInit(NULL, CACHE_EVICT_LARGEST);
+    if (umount(cache_dir) != 0) {
+        printf("failed to unmount %s: %s\n", cache_dir, strerror(errno));
+    }
+}
+
+// a 100k, b 300k, c 200k, oldest to newest: a, c, b.
+static void MakeStandardFiles() {
+    MakeFile("a", 100, 300);
+    MakeFile("b", 300, 100);
+    MakeFile("c", 200, 200);
+}
+
+static void TestLargestFirst() {
+    if (SetUp("largest file is deleted first", CACHE_EVICT_LARGEST)) return;
+    MakeStandardFiles();
+    EXPECT(MakeFreeSpaceOnCache(600 << 10) == 0);
+    EXPECT(Exists("a"));
+    EXPECT(!Exists("b"));
+    EXPECT(Exists("c"));
+    TearDown();
+}
+
+static void TestOldestFirst() {
+    if (SetUp("oldest file is deleted first", CACHE_EVICT_OLDEST)) return;
+    MakeStandardFiles();
+    EXPECT(MakeFreeSpaceOnCache(600 << 10) == 0);
+    EXPECT(!Exists("a"));
+    EXPECT(Exists("b"));
+    EXPECT(!Exists("c"));
+    TearDown();
+}
+
+static void TestNoSpaceNeeded() {
+    if (SetUp("nothing is deleted when there's room", CACHE_EVICT_LARGEST)) {
+        return;
+    }
+    MakeStandardFiles();
+    EXPECT(MakeFreeSpaceOnCache(100 << 10) == 0);
+    EXPECT(Exists("a") && Exists("b") && Exists("c"));
+    TearDown();
+}
+
+static void TestOpenFilesKept() {
+    if (SetUp("open files are kept", CACHE_EVICT_LARGEST)) return;
+    MakeStandardFiles();
+    int fd = open(CachePath("b"), O_RDONLY);
+    EXPECT(MakeFreeSpaceOnCache(600 << 10) == 0);
+    EXPECT(Exists("a"));
+    EXPECT(Exists("b"));
+    EXPECT(!Exists("c"));
+    close(fd);
+    TearDown();
+}
+
+static void TestOpenedAfterIndexKept() {
+    if (SetUp("files opened after indexing are kept", CACHE_EVICT_LARGEST)) {
+        return;
+    }
+    MakeStandardFiles();
+    EXPECT(MakeFreeSpaceOnCache(500 << 10) == 0);
+    EXPECT(!Exists("b"));
+
+    // "c" is still in the index, but mustn't be deleted now.
+    int fd = open(CachePath("c"), O_RDONLY);
+    EXPECT(MakeFreeSpaceOnCache(850 << 10) != 0);
+    EXPECT(!Exists("a"));
+    EXPECT(Exists("c"));
+    close(fd);
+    TearDown();
+}
+
+static void TestSubdirectoriesKept() {
+    if (SetUp("files in subdirectories are kept", CACHE_EVICT_LARGEST)) {
+        return;
+    }
+    mkdir(CachePath("recovery"), 0700);
+    MakeFile("recovery/log", 300, 0);
+    MakeFile("a", 100, 0);
+    EXPECT(MakeFreeSpaceOnCache(CACHE_SIZE) != 0);
+    EXPECT(Exists("recovery/log"));
+    EXPECT(!Exists("a"));
+    TearDown();
+}
+
+static void TestReserve() {
+    if (SetUp("reserved files are allocated and kept", CACHE_EVICT_LARGEST)) {
+        return;
+    }
+    MakeStandardFiles();
+    size_t before = FreeKB();
+    EXPECT(ReserveCacheFile(CachePath("backup"), 300 << 10) == 0);
+    EXPECT(before - FreeKB() >= 300);
+    struct stat st;
+    EXPECT(stat(CachePath("backup"), &st) == 0 &&
+           st.st_blocks * 512 >= (300 << 10));
+
+    // Even deleting everything else isn't enough, but the reserved
+    // file must survive.
+    EXPECT(MakeFreeSpaceOnCache(900 << 10) != 0);
+    EXPECT(Exists("backup"));
+    EXPECT(!Exists("a") && !Exists("b") && !Exists("c"));
+
+    // Once released it can go.
+    ReleaseCacheFile(CachePath("backup"));
+    EXPECT(MakeFreeSpaceOnCache(900 << 10) == 0);
+    EXPECT(!Exists("backup"));
+    TearDown();
+}
+
+static void TestReserveNeedsSpace() {
+    if (SetUp("reserving space evicts other files", CACHE_EVICT_LARGEST)) {
+        return;
+    }
+    MakeStandardFiles();
+    EXPECT(ReserveCacheFile(CachePath("backup"), 600 << 10) == 0);
+    EXPECT(!Exists("b"));
+    EXPECT(Exists("backup"));
+    TearDown();
+}
+
+static void TestStaleIndex() {
+    if (SetUp("index is rebuilt when it runs out", CACHE_EVICT_LARGEST)) {
+        return;
+    }
+    MakeFile("a", 100, 0);
+    EXPECT(MakeFreeSpaceOnCache(CACHE_SIZE - (50 << 10)) == 0);
+    EXPECT(!Exists("a"));
+
+    // "d" isn't in the index built above.
+    MakeFile("d", 500, 0);
+    EXPECT(MakeFreeSpaceOnCache(800 << 10) == 0);
+    EXPECT(!Exists("d"));
+    TearDown();
+}
+
+int main(int argc, char** argv) {
+    if ((cache_dir = TestScratchDir(argc, argv, "freecache_test")) == NULL) {
+        return 2;
+    }
+
+    TestLargestFirst();
+    TestOldestFirst();
+    TestNoSpaceNeeded();
+    TestOpenFilesKept();
+    TestOpenedAfterIndexKept();
+    TestSubdirectoriesKept();
+    TestReserve();
+    TestReserveNeedsSpace();
+    TestStaleIndex();
+
+    return TestFinish();
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2008 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A cache of the SHA-1 of each file that has been loaded, so that a
+// source file is hashed once per install rather than once by
+// apply_patch_check() and again by apply_patch().  Entries are keyed
+// by the file's identity and everything that changes when it is
+// written -- device, inode, size, mtime and ctime -- plus the retouch
+// flag it was loaded with, since masking changes the hash.
+//
+// Times are only kept to the second, so a file is not cached if its
+// ctime is the current second: it could still be rewritten (or its
+// inode reused for another file of the same size) without the key
+// changing.  Any write after the hash is stored gives the file a
+// later ctime than the one in the key.
+//
+// The cache can also be backed by a file, normally CACHE_HASH_FILE,
+// so that an install that is interrupted and retried doesn't have to
+// hash everything again.  The file is an append-only sequence of
+// HashRecords; the newest record for a key wins, and records for
+// files that have since changed simply never match again.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "applypatch.h"
+
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;
+    int64_t ctime;
+    int32_t retouch_flag;
+    uint8_t sha1[SHA_DIGEST_SIZE];
+} HashRecord;
+
+typedef struct HashEntry {
+    HashRecord rec;
+    struct HashEntry* next;
+} HashEntry;
+
+#define HASH_BUCKETS 1024
+
+static HashEntry* buckets[HASH_BUCKETS];
+static int backing_fd = -1;
+static char* backing_path = NULL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void MakeKey(const struct stat* st, int retouch_flag, HashRecord* rec) {
+    memset(rec, 0, sizeof(*rec));
+    rec->dev = st->st_dev;
+    rec->ino = st->st_ino;
+    rec->size = st->st_size;
+    rec->mtime = st->st_mtime;
+    rec->ctime = st->st_ctime;
+    rec->retouch_flag = retouch_flag;
+}
+
+static int SameKey(const HashRecord* a, const HashRecord* b) {
+    return memcmp(a, b, offsetof(HashRecord, sha1)) == 0;
+}
+
+static HashEntry** Bucket(const HashRecord* rec) {
+    return &buckets[(rec->ino ^ (rec->dev << 7)) % HASH_BUCKETS];
+}
+
+// Add rec to the table, replacing any entry with the same key.  Must
+// be called with cache_lock held.
+static void Insert(const HashRecord* rec) {
+    HashEntry** b = Bucket(rec);
+    HashEntry* e;
+    for (e = *b; e != NULL; e = e->next) {
+        if (SameKey(&e->rec, rec)) {
+            memcpy(e->rec.sha1, rec->sha1, SHA_DIGEST_SIZE);
+            return;
+        }
+    }
+    e = malloc(sizeof(HashEntry));
+    if (e == NULL) return;
+    e->rec = *rec;
+    e->next = *b;
+    *b = e;
+}
+
+// Look up the file described by st.  Returns 0 and fills in sha1 if
+// it's in the cache, -1 otherwise.
+int HashCacheLookup(const struct stat* st, int retouch_flag,
+                    uint8_t sha1[SHA_DIGEST_SIZE]) {
+    if (!S_ISREG(st->st_mode)) return -1;
+
+    HashRecord key;
+    MakeKey(st, retouch_flag, &key);
+
+    int result = -1;
+    pthread_mutex_lock(&cache_lock);
+    HashEntry* e;
+    for (e = *Bucket(&key); e != NULL; e = e->next) {
+        if (SameKey(&e->rec, &key)) {
+            memcpy(sha1, e->rec.sha1, SHA_DIGEST_SIZE);
+            result = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return result;
+}
+
+// Record the hash of the file described by st (as loaded with
+// retouch_flag), and append it to the backing file if there is one.
+void HashCacheStore(const struct stat* st, int retouch_flag,
+                    const uint8_t sha1[SHA_DIGEST_SIZE]) {
+    if (!S_ISREG(st->st_mode) || st->st_ctime >= time(NULL)) return;
+
+    HashRecord rec;
+    MakeKey(st, retouch_flag, &rec);
+    memcpy(rec.sha1, sha1, SHA_DIGEST_SIZE);
+
+    pthread_mutex_lock(&cache_lock);
+    Insert(&rec);
+    if (backing_fd >= 0) {
+        // A single write() of a whole record, so a crash can at worst
+        // leave a truncated record at the end, which is ignored.
+        if (write(backing_fd, &rec, sizeof(rec)) != sizeof(rec)) {
+            printf("failed to write hash cache %s: %s\n",
+                   backing_path, strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+// Load any hashes saved in 'path' by an earlier attempt at this
+// install, and save new ones there from now on.  Returns 0 on
+// success, -1 if the file can't be opened (the in-memory cache still
+// works).
+int HashCacheOpen(const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) {
+        printf("failed to open hash cache %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    if (backing_fd >= 0) {
+        close(backing_fd);
+    }
+    free(backing_path);
+    backing_fd = fd;
+    backing_path = strdup(path);
+
+    int loaded = 0;
+    HashRecord rec;
+    ssize_t r;
+    while ((r = read(fd, &rec, sizeof(rec))) == sizeof(rec)) {
+        Insert(&rec);
+        ++loaded;
+    }
+    if (r > 0) {
+        // Drop a record cut short by a crash, so that the ones
+        // appended after it line up.
+        if (ftruncate(fd, loaded * sizeof(rec)) != 0) {
+            printf("failed to truncate %s: %s\n", path, strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (loaded > 0) {
+        printf("loaded %d saved hashes from %s\n", loaded, path);
+    }
+    return 0;
+}
+
+// Stop saving hashes and delete the backing file; called once the
+// install has finished and the saved hashes can't be needed again.
+void HashCacheDiscard() {
+    pthread_mutex_lock(&cache_lock);
+    if (backing_fd >= 0) {
+        close(backing_fd);
+        backing_fd = -1;
+        if (unlink(backing_path) != 0 && errno != ENOENT) {
+            printf("failed to remove %s: %s\n", backing_path, strerror(errno));
+        }
+    }
+    free(backing_path);
+    backing_path = NULL;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -36,7 +36,11 @@
  * is available in applypatch, namely, the one in the zlib library.
  * In practice this means that images should be compressed using the
  * "minigzip" tool included in the zlib distribution, not the GNU gzip
- * program.
+ * program.  Any zlib level from 1 to 9, window size, memLevel and
+ * strategy can be matched; the parameters found are recorded in the
+ * patch for each chunk.  By default only the standard 32k window is
+ * searched, which is what zlib-based tools use; "-t 0" searches them
+ * all, at a cost for chunks that match none.
  *
  * An "imgdiff" patch consists of a header describing the chunk structure
  * of the file and any encoding parameters needed for the gzipped
@@ -119,9 +123,22 @@
  * patch.  This is used to reduce the size of recovery-from-boot
  * patches by combining the boot image with recovery ramdisk
  * information that is stored on the system partition.
+ *
+ * With -Z, the bsdiff patches are written in the BSDIFF41 format with
+ * zstd-compressed streams instead of BSDIFF40 with bzip2, trading a
+ * little patch size for much faster patch application.  -L does the
+ * same and also lets the extra stream of each patch reference its
+ * source data as a zstd prefix.  Both need imgdiff and applypatch to
+ * be built with RECOVERY_PATCH_USE_ZSTD.
+ *
+ * -S picks the suffix sort used to index each source chunk: "sais"
+ * (the default), "parallel" (which uses all CPUs on large chunks) or
+ * "qsufsort" (the original bsdiff algorithm).  They all build the same
+ * suffix array, so the patch does not depend on the choice.
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -131,6 +148,7 @@
 
 #include "zlib.h"
 #include "imgdiff.h"
+#include "sufsort.h"
 #include "utils.h"
 
 typedef struct {
@@ -144,6 +162,7 @@ typedef struct {
   size_t source_len;
 
   off_t* I;             // used by bsdiff
+  int index_users;      // patch jobs yet to finish with I
 
   // --- for CHUNK_DEFLATE chunks only: ---
 
@@ -180,7 +199,11 @@ static int fileentry_compare(const void* a, const void* b) {
 
 // from bsdiff.c
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
-           const char* patch_filename);
+           u_char** patch, off_t* patch_size, int compression);
+void bsdiff_index(u_char* old, off_t oldsize, off_t** IP);
+
+// Compression used for the streams of each bsdiff patch (BSDIFF_*).
+static int bsdiff_compression = BSDIFF_BZIP2;
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -518,7 +541,10 @@ unsigned char* ReadImage(const char* filename,
   return img;
 }
 
-#define BUFFER_SIZE 32768
+// TryReconstruction() compares the output in pieces of this size, so
+// that a mismatch is caught soon after zlib emits the first block
+// rather than after the first 32k.
+#define BUFFER_SIZE 4096
 
 /*
  * Takes the uncompressed data stored in the chunk, compresses it
@@ -544,6 +570,9 @@ int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
   int ret;
   ret = deflateInit2(&strm, chunk->level, chunk->method, chunk->windowBits,
                      chunk->memLevel, chunk->strategy);
+  if (ret != Z_OK) {
+    return -1;
+  }
   do {
     strm.avail_out = BUFFER_SIZE;
     strm.next_out = out;
@@ -565,11 +594,230 @@ int TryReconstruction(ImageChunk* chunk, unsigned char* out) {
   return 0;
 }
 
+// Upper bound on the number of threads used for the chunk
+// reconstruction search and for computing chunk patches.
+#define IMGDIFF_MAX_THREADS 8
+
+typedef void (*JobFn)(void* cookie, int job);
+
+typedef struct {
+  JobFn fn;
+  void* cookie;
+  int num_jobs;
+
+  pthread_mutex_t lock;
+  int next_job;
+} JobPool;
+
+static void* JobWorker(void* cookie) {
+  JobPool* pool = (JobPool*)cookie;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    int i = pool->next_job++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->num_jobs) break;
+
+    pool->fn(pool->cookie, i);
+  }
+  return NULL;
+}
+
+/*
+ * Call fn(cookie, i) for each i in [0, num_jobs), in order of i but
+ * several at once, on up to one thread per CPU.
+ */
+static void RunJobs(int num_jobs, JobFn fn, void* cookie) {
+  JobPool pool;
+  pool.fn = fn;
+  pool.cookie = cookie;
+  pool.num_jobs = num_jobs;
+  pool.next_job = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+
+  int threads = 1;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 1) threads = cpus;
+  if (threads > IMGDIFF_MAX_THREADS) threads = IMGDIFF_MAX_THREADS;
+  if (threads > num_jobs) threads = num_jobs;
+
+  pthread_t thread[IMGDIFF_MAX_THREADS];
+  int started = 0, i;
+  while (started < threads - 1 &&
+         pthread_create(&thread[started], NULL, JobWorker, &pool) == 0) {
+    ++started;
+  }
+  JobWorker(&pool);
+  for (i = 0; i < started; ++i) {
+    pthread_join(thread[i], NULL);
+  }
+  pthread_mutex_destroy(&pool.lock);
+}
+
+typedef struct {
+  int level, windowBits, memLevel, strategy;
+} DeflateParams;
+
+// The combinations of encoder parameters that zlib accepts for a raw
+// stream (bar level 0; see AddCandidate()), most likely first: levels
+// 6 and 9 with the default window, memLevel and strategy (the only
+// ones this tool used to try), then the other levels, then the other
+// memLevels and strategies, and finally the smaller windows.  Built
+// once by BuildCandidates().
+static DeflateParams* candidates = NULL;
+static int num_candidates = 0;
+
+// Most chunks match one of the first few candidates, but one made by
+// some other encoder is tried against every candidate, and there are
+// over 1600.  A wrong candidate's output can agree with the chunk for
+// a long way, so there's no telling early that the search is hopeless;
+// instead it stops after this many trials.  The default covers every
+// candidate with the 32k window; -t sets another limit (0 for none).
+#define DEFAULT_MAX_TRIALS 234
+static int max_trials = DEFAULT_MAX_TRIALS;
+
+static void AddCandidate(int level, int windowBits, int memLevel,
+                         int strategy, unsigned char* seen) {
+  // At level 0 the size of the stored blocks depends on how much
+  // output space the caller gives deflate(), which differs between
+  // here and applypatch, so a match couldn't be trusted.
+  if (level == 0) return;
+  // zlib ignores the level with these strategies, so only one level
+  // needs to be tried.
+  if (strategy == Z_HUFFMAN_ONLY || strategy == Z_RLE) {
+    level = 6;
+  }
+  // Z_FILTERED only changes anything at the levels that use lazy
+  // matching.
+  if (strategy == Z_FILTERED && level < 4) {
+    strategy = Z_DEFAULT_STRATEGY;
+  }
+
+  int index = ((level * 8 + (windowBits - 8)) * 10 + memLevel) * 5 + strategy;
+  if (seen[index]) return;
+  seen[index] = 1;
+
+  DeflateParams* p = candidates + num_candidates++;
+  p->level = level;
+  p->windowBits = -windowBits;  // negative to indicate a raw stream.
+  p->memLevel = memLevel;
+  p->strategy = strategy;
+}
+
+static void BuildCandidates() {
+  static const int strategies[] = {
+    Z_DEFAULT_STRATEGY, Z_FILTERED, Z_FIXED, Z_HUFFMAN_ONLY, Z_RLE
+  };
+  unsigned char seen[10 * 8 * 10 * 5];
+  int level, windowBits, memLevel, s;
+
+  memset(seen, 0, sizeof(seen));
+  candidates = malloc(sizeof(seen) * sizeof(DeflateParams));
+  num_candidates = 0;
+
+  AddCandidate(6, 15, 8, Z_DEFAULT_STRATEGY, seen);
+  AddCandidate(9, 15, 8, Z_DEFAULT_STRATEGY, seen);
+  for (level = 1; level <= 9; ++level) {
+    AddCandidate(level, 15, 8, Z_DEFAULT_STRATEGY, seen);
+  }
+  for (windowBits = 15; windowBits >= 9; --windowBits) {
+    for (s = 0; s < sizeof(strategies) / sizeof(strategies[0]); ++s) {
+      for (memLevel = 8; memLevel >= 1; --memLevel) {
+        for (level = 9; level >= 1; --level) {
+          AddCandidate(level, windowBits, memLevel, strategies[s], seen);
+        }
+      }
+      for (level = 9; level >= 1; --level) {
+        AddCandidate(level, windowBits, 9, strategies[s], seen);
+      }
+    }
+  }
+}
+
+/*
+ * Return nonzero if there's no point trying p on the chunk, because
+ * it's bound to produce either the wrong output or the same output as
+ * a candidate that was already tried.
+ */
+static int SkipCandidate(const ImageChunk* chunk, const DeflateParams* p) {
+  // A window bigger than the input (less the lookahead zlib keeps)
+  // never comes into play, so all such windows produce the same
+  // output as the 32k one, which comes first.
+  if (-p->windowBits < 15 &&
+      chunk->len + 262 <= ((size_t)1 << -p->windowBits)) {
+    return 1;
+  }
+
+  // Z_FIXED never produces a block with dynamic Huffman codes.
+  if (chunk->deflate_len > 0 && p->strategy == Z_FIXED &&
+      ((chunk->deflate_data[0] >> 1) & 3) == 2) {
+    return 1;
+  }
+  return 0;
+}
+
+// The parameters that reconstructed the first chunk, tried before
+// the candidates on every other.  Most images and zips are compressed
+// with a single setting, so once it's been found every other chunk
+// usually matches on the first try.  The seed is found before the
+// other chunks are started and doesn't change after, so the
+// parameters found for a chunk (and so the patch) never depend on
+// which thread got to which chunk first.
+static DeflateParams seed_params;
+static int have_seed_params = 0;
+
+// How many chunks, in input order, are tried one at a time for a
+// seed before the rest are started without one.
+#define SEED_CHUNKS 4
+
+// Results of earlier searches, keyed by a hash of the compressed data
+// so that identical entries (which zips often contain many of) are
+// only searched once.
+#define RECONSTRUCT_CACHE_SIZE 1024
+
+typedef struct ReconstructResult {
+  uLong crc;
+  const ImageChunk* chunk;  // a chunk with this compressed data
+  int result;               // 0 if it could be reconstructed
+  DeflateParams params;
+  struct ReconstructResult* next;
+} ReconstructResult;
+
+static ReconstructResult* reconstruct_cache[RECONSTRUCT_CACHE_SIZE];
+static pthread_mutex_t reconstruct_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static ReconstructResult* FindResult(const ImageChunk* chunk, uLong crc) {
+  ReconstructResult* r;
+  for (r = reconstruct_cache[crc % RECONSTRUCT_CACHE_SIZE]; r; r = r->next) {
+    if (r->crc == crc && r->chunk->deflate_len == chunk->deflate_len &&
+        memcmp(r->chunk->deflate_data, chunk->deflate_data,
+               chunk->deflate_len) == 0) {
+      return r;
+    }
+  }
+  return NULL;
+}
+
+static void SetParams(ImageChunk* chunk, const DeflateParams* p) {
+  chunk->level = p->level;
+  chunk->method = Z_DEFLATED;
+  chunk->windowBits = p->windowBits;
+  chunk->memLevel = p->memLevel;
+  chunk->strategy = p->strategy;
+}
+
+static int TryParams(ImageChunk* chunk, const DeflateParams* p,
+                     unsigned char* out) {
+  SetParams(chunk, p);
+  return TryReconstruction(chunk, out);
+}
+
 /*
  * Verify that we can reproduce exactly the same compressed data that
  * we started with.  Sets the level, method, windowBits, memLevel, and
  * strategy fields in the chunk to the encoding parameters needed to
- * produce the right output.  Returns 0 on success.
+ * produce the right output.  Returns 0 on success.  Safe to call for
+ * different chunks at once.
  */
 int ReconstructDeflateChunk(ImageChunk* chunk) {
   if (chunk->type != CHUNK_DEFLATE) {
@@ -577,32 +825,91 @@ int ReconstructDeflateChunk(ImageChunk* chunk) {
     return -1;
   }
 
-  size_t p = 0;
-  unsigned char* out = malloc(BUFFER_SIZE);
+  uLong crc = crc32(0, chunk->deflate_data, chunk->deflate_len);
+  int i;
 
-  // We only check two combinations of encoder parameters:  level 6
-  // (the default) and level 9 (the maximum).
-  for (chunk->level = 6; chunk->level <= 9; chunk->level += 3) {
-    chunk->windowBits = -15;  // 32kb window; negative to indicate a raw stream.
-    chunk->memLevel = 8;      // the default value.
-    chunk->method = Z_DEFLATED;
-    chunk->strategy = Z_DEFAULT_STRATEGY;
-
-    if (TryReconstruction(chunk, out) == 0) {
-      free(out);
-      return 0;
+  pthread_mutex_lock(&reconstruct_lock);
+  if (candidates == NULL) {
+    BuildCandidates();
+  }
+  ReconstructResult* r = FindResult(chunk, crc);
+  if (r != NULL) {
+    DeflateParams params = r->params;
+    int result = r->result;
+    pthread_mutex_unlock(&reconstruct_lock);
+    if (result == 0) {
+      SetParams(chunk, &params);
     }
+    return result;
   }
+  pthread_mutex_unlock(&reconstruct_lock);
+
+  unsigned char* out = malloc(BUFFER_SIZE);
+  const DeflateParams* found = NULL;
 
+  if (have_seed_params && TryParams(chunk, &seed_params, out) == 0) {
+    found = &seed_params;
+  }
+  int trials = 0;
+  for (i = 0; i < num_candidates && found == NULL; ++i) {
+    if (max_trials > 0 && trials >= max_trials) break;
+    if (SkipCandidate(chunk, candidates+i)) continue;
+    ++trials;
+    if (TryParams(chunk, candidates+i, out) == 0) {
+      found = candidates+i;
+    }
+  }
   free(out);
-  return -1;
+
+  r = malloc(sizeof(ReconstructResult));
+  r->crc = crc;
+  r->chunk = chunk;
+  r->result = found ? 0 : -1;
+  if (found) {
+    r->params = *found;
+  }
+
+  pthread_mutex_lock(&reconstruct_lock);
+  r->next = reconstruct_cache[crc % RECONSTRUCT_CACHE_SIZE];
+  reconstruct_cache[crc % RECONSTRUCT_CACHE_SIZE] = r;
+  pthread_mutex_unlock(&reconstruct_lock);
+
+  return r->result;
+}
+
+static void ReconstructJob(void* cookie, int i) {
+  ImageChunk** chunks = (ImageChunk**)cookie;
+  if (ReconstructDeflateChunk(chunks[i]) != 0) {
+    chunks[i] = NULL;
+  }
+}
+
+/*
+ * Run ReconstructDeflateChunk() on each of the chunks, several at a
+ * time once a seed has been found.  On return, chunks[i] is NULL for
+ * each chunk that could not be reconstructed.
+ */
+void ReconstructDeflateChunks(ImageChunk** chunks, int num_chunks) {
+  int i;
+  for (i = 0; i < num_chunks && i < SEED_CHUNKS && !have_seed_params; ++i) {
+    ReconstructJob(chunks, i);
+    if (chunks[i] != NULL) {
+      seed_params.level = chunks[i]->level;
+      seed_params.windowBits = chunks[i]->windowBits;
+      seed_params.memLevel = chunks[i]->memLevel;
+      seed_params.strategy = chunks[i]->strategy;
+      have_seed_params = 1;
+    }
+  }
+  RunJobs(num_chunks - i, ReconstructJob, chunks + i);
 }
 
 /*
- * Given source and target chunks, compute a bsdiff patch between them
- * by running bsdiff in a subprocess.  Return the patch data, placing
- * its length in *size.  Return NULL on failure.  We expect the bsdiff
- * program to be in the path.
+ * Given source and target chunks, compute a bsdiff patch between them.
+ * Return the patch data, placing its length in *size.  Return NULL on
+ * failure.  Calls for different target chunks may run concurrently,
+ * provided that no two of them share a source chunk whose suffix
+ * array has not been built yet.
  */
 unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   if (tgt->type == CHUNK_NORMAL) {
@@ -613,46 +920,24 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
     }
   }
 
-  char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-  mkstemp(ptemp);
-
-  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
+  unsigned char* data;
+  off_t data_size;
+  int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len,
+                 &data, &data_size, bsdiff_compression);
   if (r != 0) {
     printf("bsdiff() failed: %d\n", r);
     return NULL;
   }
 
-  struct stat st;
-  if (stat(ptemp, &st) != 0) {
-    printf("failed to stat patch file %s: %s\n",
-            ptemp, strerror(errno));
-    return NULL;
-  }
-
-  unsigned char* data = malloc(st.st_size);
-
-  if (tgt->type == CHUNK_NORMAL && tgt->len <= st.st_size) {
-    unlink(ptemp);
+  if (tgt->type == CHUNK_NORMAL && tgt->len <= data_size) {
+    free(data);
 
     tgt->type = CHUNK_RAW;
     *size = tgt->len;
     return tgt->data;
   }
 
-  *size = st.st_size;
-
-  FILE* f = fopen(ptemp, "rb");
-  if (f == NULL) {
-    printf("failed to open patch %s: %s\n", ptemp, strerror(errno));
-    return NULL;
-  }
-  if (fread(data, 1, st.st_size, f) != st.st_size) {
-    printf("failed to read patch %s: %s\n", ptemp, strerror(errno));
-    return NULL;
-  }
-  fclose(f);
-
-  unlink(ptemp);
+  *size = data_size;
 
   tgt->source_start = src->start;
   switch (tgt->type) {
@@ -779,6 +1064,88 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
     }
 }
 
+typedef struct {
+  ImageChunk* src;
+  ImageChunk* tgt;
+  int shared;            // src is the source for other jobs too
+
+  unsigned char* patch_data;
+  size_t patch_size;
+} PatchJob;
+
+typedef struct {
+  PatchJob** order;      // jobs, biggest target first
+
+  // Held while building the suffix array of a shared source, so
+  // that it is only built once, and while counting down its users,
+  // so that it is freed once, by the last.
+  pthread_mutex_t index_lock;
+} PatchPool;
+
+static int job_size_compare(const void* a, const void* b) {
+  size_t as = (*(PatchJob**)a)->tgt->len;
+  size_t bs = (*(PatchJob**)b)->tgt->len;
+  return as > bs ? -1 : (as < bs ? 1 : 0);
+}
+
+static void PatchJobFn(void* cookie, int i) {
+  PatchPool* pool = (PatchPool*)cookie;
+  PatchJob* job = pool->order[i];
+
+  if (job->shared) {
+    pthread_mutex_lock(&pool->index_lock);
+    bsdiff_index(job->src->data, job->src->len, &(job->src->I));
+    pthread_mutex_unlock(&pool->index_lock);
+  }
+  job->patch_data = MakePatch(job->src, job->tgt, &job->patch_size);
+  if (job->shared) {
+    pthread_mutex_lock(&pool->index_lock);
+    if (--job->src->index_users == 0) {
+      free(job->src->I);
+      job->src->I = NULL;
+    }
+    pthread_mutex_unlock(&pool->index_lock);
+  } else {
+    // Nothing else will use this source's suffix array.
+    free(job->src->I);
+    job->src->I = NULL;
+  }
+}
+
+/*
+ * Compute the patch for each job, several at once.  Each chunk patch
+ * in flight holds a suffix array of 8 bytes per source byte, so on
+ * big images memory is as much a limit as CPUs.  Jobs are started
+ * biggest first so that one large chunk doesn't run on alone at the
+ * end.
+ */
+static void MakePatches(PatchJob* jobs, int num_jobs) {
+  PatchPool pool;
+  int i;
+
+  pool.order = malloc(num_jobs * sizeof(PatchJob*));
+  for (i = 0; i < num_jobs; ++i) {
+    pool.order[i] = jobs + i;
+    jobs[i].src->index_users = 0;
+  }
+  // Any source chunk can be shared: all normal chunks of a zip use
+  // the whole source file, and two entries with the same name match
+  // the same source entry.
+  for (i = 0; i < num_jobs; ++i) {
+    ++jobs[i].src->index_users;
+  }
+  for (i = 0; i < num_jobs; ++i) {
+    jobs[i].shared = jobs[i].src->index_users > 1;
+  }
+  qsort(pool.order, num_jobs, sizeof(PatchJob*), job_size_compare);
+  pthread_mutex_init(&pool.index_lock, NULL);
+
+  RunJobs(num_jobs, PatchJobFn, &pool);
+
+  pthread_mutex_destroy(&pool.index_lock);
+  free(pool.order);
+}
+
 int main(int argc, char** argv) {
   int zip_mode = 0;
 
@@ -788,6 +1155,38 @@ int main(int argc, char** argv) {
     ++argv;
   }
 
+  if (argc >= 2 && (strcmp(argv[1], "-Z") == 0 ||
+                    strcmp(argv[1], "-L") == 0)) {
+#ifdef USE_ZSTD
+    bsdiff_compression = argv[1][1] == 'Z' ? BSDIFF_ZSTD : BSDIFF_ZSTD_SRC;
+#else
+    printf("%s requires imgdiff built with zstd support\n", argv[1]);
+    return 1;
+#endif
+    --argc;
+    ++argv;
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "-S") == 0) {
+    if (bsdiff_set_suffix_sort(argv[2]) != 0) {
+      printf("unknown suffix sort \"%s\"\n", argv[2]);
+      return 1;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+
+  if (argc >= 3 && strcmp(argv[1], "-t") == 0) {
+    char* end;
+    max_trials = strtol(argv[2], &end, 10);
+    if (*end != '\0' || max_trials < 0) {
+      printf("invalid trial limit \"%s\"\n", argv[2]);
+      return 1;
+    }
+    argc -= 2;
+    argv += 2;
+  }
+
   size_t bonus_size = 0;
   unsigned char* bonus_data = NULL;
   if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
@@ -815,7 +1214,7 @@ int main(int argc, char** argv) {
 
   if (argc != 4) {
     usage:
-    printf("usage: %s [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
+    printf("usage: %s [-z] [-Z|-L] [-S <sort>] [-t <max-trials>] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
             argv[0]);
     return 2;
   }
@@ -878,31 +1277,14 @@ int main(int argc, char** argv) {
 
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (tgt_chunks[i].type == CHUNK_DEFLATE) {
-      // Confirm that given the uncompressed chunk data in the target, we
-      // can recompress it and get exactly the same bits as are in the
-      // input target image.  If this fails, treat the chunk as a normal
-      // non-deflated chunk.
-      if (ReconstructDeflateChunk(tgt_chunks+i) < 0) {
-        printf("failed to reconstruct target deflate chunk %d [%s]; "
-               "treating as normal\n", i, tgt_chunks[i].filename);
-        ChangeDeflateChunkToNormal(tgt_chunks+i);
-        if (zip_mode) {
-          ImageChunk* src = FindChunkByName(tgt_chunks[i].filename, src_chunks, num_src_chunks);
-          if (src) {
-            ChangeDeflateChunkToNormal(src);
-          }
-        } else {
-          ChangeDeflateChunkToNormal(src_chunks+i);
-        }
-        continue;
-      }
-
       // If two deflate chunks are identical (eg, the kernel has not
       // changed between two builds), treat them as normal chunks.
       // This makes applypatch much faster -- it can apply a trivial
       // patch to the compressed data, rather than uncompressing and
       // recompressing to apply the trivial patch to the uncompressed
-      // data.
+      // data.  Target chunks with no source are patched as normal
+      // chunks too.  Either way there's no need to search for their
+      // encoder parameters.
       ImageChunk* src;
       if (zip_mode) {
         src = FindChunkByName(tgt_chunks[i].filename, src_chunks, num_src_chunks);
@@ -919,6 +1301,46 @@ int main(int argc, char** argv) {
     }
   }
 
+  // Confirm that given the uncompressed chunk data in the target, we
+  // can recompress it and get exactly the same bits as are in the
+  // input target image.  If this fails, treat the chunk as a normal
+  // non-deflated chunk.
+  ImageChunk** deflate_chunks = malloc(num_tgt_chunks * sizeof(ImageChunk*));
+  int num_deflate_chunks = 0;
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (tgt_chunks[i].type == CHUNK_DEFLATE) {
+      deflate_chunks[num_deflate_chunks++] = tgt_chunks+i;
+    }
+  }
+  ReconstructDeflateChunks(deflate_chunks, num_deflate_chunks);
+  int j = 0;
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (tgt_chunks[i].type != CHUNK_DEFLATE) continue;
+    if (deflate_chunks[j++] == NULL) {
+      printf("failed to reconstruct target deflate chunk %d [%s]; "
+             "treating as normal\n", i, tgt_chunks[i].filename);
+      ChangeDeflateChunkToNormal(tgt_chunks+i);
+      if (zip_mode) {
+        ImageChunk* src = FindChunkByName(tgt_chunks[i].filename, src_chunks, num_src_chunks);
+        if (src) {
+          ChangeDeflateChunkToNormal(src);
+        }
+      } else {
+        ChangeDeflateChunkToNormal(src_chunks+i);
+      }
+    } else if ((tgt_chunks[i].level != 6 && tgt_chunks[i].level != 9) ||
+               tgt_chunks[i].windowBits != -15 ||
+               tgt_chunks[i].memLevel != 8 ||
+               tgt_chunks[i].strategy != Z_DEFAULT_STRATEGY) {
+      printf("reconstructed deflate chunk %d [%s] with level %d, "
+             "windowBits %d, memLevel %d, strategy %d\n",
+             i, tgt_chunks[i].filename, tgt_chunks[i].level,
+             tgt_chunks[i].windowBits, tgt_chunks[i].memLevel,
+             tgt_chunks[i].strategy);
+    }
+  }
+  free(deflate_chunks);
+
   // Merging neighboring normal chunks.
   if (zip_mode) {
     // For zips, we only need to do this to the target:  deflated
@@ -944,17 +1366,18 @@ int main(int argc, char** argv) {
   DumpChunks(src_chunks, num_src_chunks);
 
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
-  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
-  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  PatchJob* jobs = calloc(num_tgt_chunks, sizeof(PatchJob));
   for (i = 0; i < num_tgt_chunks; ++i) {
+    jobs[i].tgt = tgt_chunks+i;
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        jobs[i].src = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        // Normal chunks are all patched against the whole source file.
+        jobs[i].src = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -964,11 +1387,25 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      jobs[i].src = src_chunks+i;
+    }
+  }
+
+  MakePatches(jobs, num_tgt_chunks);
+
+  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
+  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (jobs[i].patch_data == NULL) {
+      printf("failed to compute patch for chunk %d\n", i);
+      return 1;
     }
+    patch_data[i] = jobs[i].patch_data;
+    patch_size[i] = jobs[i].patch_size;
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
   }
+  free(jobs);
 
   // Figure out how big the imgdiff file header is going to be, so
   // that we can correctly compute the offset of each bsdiff patch
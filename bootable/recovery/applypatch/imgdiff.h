@@ -20,6 +20,19 @@
 #define CHUNK_DEFLATE  2   // version 2 only
 #define CHUNK_RAW      3   // version 2 only
 
+// Compression of the control, diff and extra streams of a bsdiff
+// patch.  BSDIFF40 patches always use bzip2 for all three; BSDIFF41
+// patches record the method for each stream in their header (see
+// bsdiff.c).
+#define BSDIFF_BZIP2      0
+#define BSDIFF_ZSTD       1
+#define BSDIFF_ZSTD_SRC   2   // zstd, with the source as a prefix dictionary
+
+// Largest zstd window (as a power of two) a patch may require.  This
+// bounds the decoder's memory use when the source is referenced as a
+// prefix.
+#define BSDIFF_ZSTD_MAX_WINDOW_LOG  27
+
 // The gzip header size is actually variable, but we currently don't
 // support gzipped data with any of the optional fields, so for now it
 // will always be ten bytes.  See RFC 1952 for the definition of the
@@ -18,8 +18,10 @@
 // format.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -29,16 +31,49 @@
 #include "imgdiff.h"
 #include "utils.h"
 
-/*
- * Apply the patch given in 'patch_filename' to the source data given
- * by (old_data, old_size).  Write the patched output to the 'output'
- * file, and update the SHA context with the output data as well.
- * Return 0 on success.
- */
-int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
-                    const Value* patch,
-                    SinkFn sink, void* token, SHA_CTX* ctx,
-                    const Value* bonus_data) {
+// Deflate chunks are reconstructed by up to this many worker threads
+// while the calling thread writes finished chunks to the sink in
+// order.
+#define IMGPATCH_MAX_THREADS 8
+
+typedef struct {
+    int type;
+    size_t src_start;
+    size_t src_len;
+    size_t patch_offset;        // normal and deflate chunks
+    size_t expanded_len;        // deflate chunks only
+    size_t target_len;
+    int level, method, windowBits, memLevel, strategy;
+    size_t raw_offset;          // raw chunks only
+    size_t raw_len;
+
+    // Reconstructed (compressed) output of a deflate chunk.
+    int state;
+    unsigned char* output;
+    size_t output_len;
+} PatchChunk;
+
+enum { CHUNK_PENDING, CHUNK_CLAIMED, CHUNK_DONE, CHUNK_FAILED };
+
+typedef struct {
+    const unsigned char* old_data;
+    const Value* patch;
+    const Value* bonus_data;
+    PatchChunk* chunks;
+    int num_chunks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int next;           // next chunk workers should consider
+    int emitted;        // chunks [0, emitted) have gone to the sink
+    int max_ahead;      // how far past 'emitted' workers may run
+    int abort;
+} ImagePatchJob;
+
+// Read the header records for all chunks.  Returns the number of
+// chunks (with *chunks allocated), or -1 on error.
+static int ReadChunkHeaders(const Value* patch, ssize_t old_size,
+                            PatchChunk** chunks) {
     ssize_t pos = 12;
     char* header = patch->data;
     if (patch->size < 12) {
@@ -55,178 +90,372 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
     }
 
     int num_chunks = Read4(header+8);
+    if (num_chunks < 0 || num_chunks > (patch->size - 12) / 4) {
+        printf("corrupt patch file header (chunk count %d)\n", num_chunks);
+        return -1;
+    }
+    PatchChunk* c = calloc(num_chunks > 0 ? num_chunks : 1,
+                           sizeof(PatchChunk));
 
     int i;
     for (i = 0; i < num_chunks; ++i) {
         // each chunk's header record starts with 4 bytes.
         if (pos + 4 > patch->size) {
             printf("failed to read chunk %d record\n", i);
-            return -1;
+            goto fail;
         }
-        int type = Read4(patch->data + pos);
+        c[i].type = Read4(patch->data + pos);
         pos += 4;
 
-        if (type == CHUNK_NORMAL) {
+        if (c[i].type == CHUNK_NORMAL) {
             char* normal_header = patch->data + pos;
             pos += 24;
             if (pos > patch->size) {
                 printf("failed to read chunk %d normal header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(normal_header);
-            size_t src_len = Read8(normal_header+8);
-            size_t patch_offset = Read8(normal_header+16);
-
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
-        } else if (type == CHUNK_RAW) {
+            c[i].src_start = Read8(normal_header);
+            c[i].src_len = Read8(normal_header+8);
+            c[i].patch_offset = Read8(normal_header+16);
+        } else if (c[i].type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
             if (pos > patch->size) {
                 printf("failed to read chunk %d raw header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            ssize_t data_len = Read4(raw_header);
+            c[i].raw_len = Read4(raw_header);
+            c[i].raw_offset = pos;
 
-            if (pos + data_len > patch->size) {
+            if (pos + c[i].raw_len > patch->size) {
                 printf("failed to read chunk %d raw data\n", i);
-                return -1;
+                goto fail;
             }
-            SHA_update(ctx, patch->data + pos, data_len);
-            if (sink((unsigned char*)patch->data + pos,
-                     data_len, token) != data_len) {
-                printf("failed to write chunk %d raw data\n", i);
-                return -1;
-            }
-            pos += data_len;
-        } else if (type == CHUNK_DEFLATE) {
+            pos += c[i].raw_len;
+        } else if (c[i].type == CHUNK_DEFLATE) {
             // deflate chunks have an additional 60 bytes in their chunk header.
             char* deflate_header = patch->data + pos;
             pos += 60;
             if (pos > patch->size) {
                 printf("failed to read chunk %d deflate header data\n", i);
-                return -1;
+                goto fail;
             }
 
-            size_t src_start = Read8(deflate_header);
-            size_t src_len = Read8(deflate_header+8);
-            size_t patch_offset = Read8(deflate_header+16);
-            size_t expanded_len = Read8(deflate_header+24);
-            size_t target_len = Read8(deflate_header+32);
-            int level = Read4(deflate_header+40);
-            int method = Read4(deflate_header+44);
-            int windowBits = Read4(deflate_header+48);
-            int memLevel = Read4(deflate_header+52);
-            int strategy = Read4(deflate_header+56);
-
-            // Decompress the source data; the chunk header tells us exactly
-            // how big we expect it to be when decompressed.
-
-            // Note: expanded_len will include the bonus data size if
-            // the patch was constructed with bonus data.  The
-            // deflation will come up 'bonus_size' bytes short; these
-            // must be appended from the bonus_data value.
-            size_t bonus_size = (i == 1 && bonus_data != NULL) ? bonus_data->size : 0;
-
-            unsigned char* expanded_source = malloc(expanded_len);
-            if (expanded_source == NULL) {
-                printf("failed to allocate %d bytes for expanded_source\n",
-                       expanded_len);
-                return -1;
-            }
+            c[i].src_start = Read8(deflate_header);
+            c[i].src_len = Read8(deflate_header+8);
+            c[i].patch_offset = Read8(deflate_header+16);
+            c[i].expanded_len = Read8(deflate_header+24);
+            c[i].target_len = Read8(deflate_header+32);
+            c[i].level = Read4(deflate_header+40);
+            c[i].method = Read4(deflate_header+44);
+            c[i].windowBits = Read4(deflate_header+48);
+            c[i].memLevel = Read4(deflate_header+52);
+            c[i].strategy = Read4(deflate_header+56);
+        } else {
+            printf("patch chunk %d is unknown type %d\n", i, c[i].type);
+            goto fail;
+        }
 
-            z_stream strm;
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = src_len;
-            strm.next_in = (unsigned char*)(old_data + src_start);
-            strm.avail_out = expanded_len;
-            strm.next_out = expanded_source;
-
-            int ret;
-            ret = inflateInit2(&strm, -15);
-            if (ret != Z_OK) {
-                printf("failed to init source inflation: %d\n", ret);
-                return -1;
-            }
+        if (c[i].type != CHUNK_RAW &&
+            (c[i].src_start > (size_t)old_size ||
+             c[i].src_len > (size_t)old_size - c[i].src_start)) {
+            printf("chunk %d source range is outside the source file\n", i);
+            goto fail;
+        }
+    }
 
-            // Because we've provided enough room to accommodate the output
-            // data, we expect one call to inflate() to suffice.
-            ret = inflate(&strm, Z_SYNC_FLUSH);
-            if (ret != Z_STREAM_END) {
-                printf("source inflation returned %d\n", ret);
-                return -1;
-            }
-            // We should have filled the output buffer exactly, except
-            // for the bonus_size.
-            if (strm.avail_out != bonus_size) {
-                printf("source inflation short by %d bytes\n", strm.avail_out-bonus_size);
-                return -1;
-            }
-            inflateEnd(&strm);
+    *chunks = c;
+    return num_chunks;
 
-            if (bonus_size) {
-                memcpy(expanded_source + (expanded_len - bonus_size),
-                       bonus_data->data, bonus_size);
-            }
+  fail:
+    free(c);
+    return -1;
+}
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
-                return -1;
-            }
+// Reconstruct deflate chunk i of the patch into chunk->output:
+// inflate the source, apply the bsdiff patch to it, and deflate the
+// result with the chunk's original parameters.  Touches nothing but
+// its own chunk, so any number of these may run at once.  Returns 0
+// on success.
+static int ApplyDeflateChunk(ImagePatchJob* job, int i) {
+    PatchChunk* chunk = job->chunks + i;
 
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
-            }
+    // Decompress the source data; the chunk header tells us exactly
+    // how big we expect it to be when decompressed.
+
+    // Note: expanded_len will include the bonus data size if
+    // the patch was constructed with bonus data.  The
+    // deflation will come up 'bonus_size' bytes short; these
+    // must be appended from the bonus_data value.
+    size_t bonus_size = (i == 1 && job->bonus_data != NULL) ?
+        job->bonus_data->size : 0;
+
+    unsigned char* expanded_source = malloc(chunk->expanded_len);
+    if (expanded_source == NULL) {
+        printf("failed to allocate %d bytes for expanded_source\n",
+               chunk->expanded_len);
+        return -1;
+    }
+
+    z_stream strm;
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    strm.avail_in = chunk->src_len;
+    strm.next_in = (unsigned char*)(job->old_data + chunk->src_start);
+    strm.avail_out = chunk->expanded_len;
+    strm.next_out = expanded_source;
+
+    int ret;
+    ret = inflateInit2(&strm, -15);
+    if (ret != Z_OK) {
+        printf("failed to init source inflation: %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+
+    // Because we've provided enough room to accommodate the output
+    // data, we expect one call to inflate() to suffice.
+    ret = inflate(&strm, Z_SYNC_FLUSH);
+    inflateEnd(&strm);
+    if (ret != Z_STREAM_END) {
+        printf("source inflation returned %d\n", ret);
+        free(expanded_source);
+        return -1;
+    }
+    // We should have filled the output buffer exactly, except
+    // for the bonus_size.
+    if (strm.avail_out != bonus_size) {
+        printf("source inflation short by %d bytes\n", strm.avail_out-bonus_size);
+        free(expanded_source);
+        return -1;
+    }
+
+    if (bonus_size) {
+        memcpy(expanded_source + (chunk->expanded_len - bonus_size),
+               job->bonus_data->data, bonus_size);
+    }
+
+    // Next, apply the bsdiff patch (in memory) to the uncompressed
+    // data.
+    unsigned char* uncompressed_target_data;
+    ssize_t uncompressed_target_size;
+    ret = ApplyBSDiffPatchMem(expanded_source, chunk->expanded_len,
+                              job->patch, chunk->patch_offset,
+                              &uncompressed_target_data,
+                              &uncompressed_target_size);
+    free(expanded_source);
+    if (ret != 0) {
+        return -1;
+    }
+
+    // Now compress the target data into a buffer big enough to hold
+    // all of it, so the whole chunk is deflated in one call.
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    ret = deflateInit2(&strm, chunk->level, chunk->method, chunk->windowBits,
+                       chunk->memLevel, chunk->strategy);
+    if (ret != Z_OK) {
+        printf("failed to init target deflation: %d\n", ret);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    size_t bound = deflateBound(&strm, uncompressed_target_size);
+    chunk->output = malloc(bound);
+    if (chunk->output == NULL) {
+        printf("failed to allocate %ld bytes for deflated output\n",
+               (long)bound);
+        deflateEnd(&strm);
+        free(uncompressed_target_data);
+        return -1;
+    }
+    strm.avail_in = uncompressed_target_size;
+    strm.next_in = uncompressed_target_data;
+    strm.avail_out = bound;
+    strm.next_out = chunk->output;
+    ret = deflate(&strm, Z_FINISH);
+    chunk->output_len = bound - strm.avail_out;
+    deflateEnd(&strm);
+    free(uncompressed_target_data);
+
+    if (ret != Z_STREAM_END) {
+        printf("target deflation returned %d\n", ret);
+        return -1;
+    }
+    return 0;
+}
+
+static void* DeflateChunkWorker(void* cookie) {
+    ImagePatchJob* job = (ImagePatchJob*)cookie;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->abort) {
+        while (job->next < job->num_chunks &&
+               job->chunks[job->next].type != CHUNK_DEFLATE) {
+            ++job->next;
+        }
+        if (job->next >= job->num_chunks) break;
+        if (job->next >= job->emitted + job->max_ahead) {
+            // Don't get too far ahead of the writer; every finished
+            // chunk is held in memory until it's written.
+            pthread_cond_wait(&job->cond, &job->lock);
+            continue;
+        }
+
+        int i = job->next++;
+        job->chunks[i].state = CHUNK_CLAIMED;
+        pthread_mutex_unlock(&job->lock);
+
+        int result = ApplyDeflateChunk(job, i);
+
+        pthread_mutex_lock(&job->lock);
+        job->chunks[i].state = result == 0 ? CHUNK_DONE : CHUNK_FAILED;
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+// Wait for deflate chunk i to be reconstructed, doing the work on
+// this thread if no worker has picked it up yet.  Returns 0 on
+// success.
+static int FinishDeflateChunk(ImagePatchJob* job, int i) {
+    pthread_mutex_lock(&job->lock);
+    if (job->chunks[i].state == CHUNK_PENDING) {
+        if (job->next <= i) job->next = i+1;
+        job->chunks[i].state = CHUNK_CLAIMED;
+        pthread_mutex_unlock(&job->lock);
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
+        int result = ApplyDeflateChunk(job, i);
+
+        pthread_mutex_lock(&job->lock);
+        job->chunks[i].state = result == 0 ? CHUNK_DONE : CHUNK_FAILED;
+    }
+    while (job->chunks[i].state == CHUNK_CLAIMED) {
+        pthread_cond_wait(&job->cond, &job->lock);
+    }
+    int state = job->chunks[i].state;
+    pthread_mutex_unlock(&job->lock);
+    return state == CHUNK_DONE ? 0 : -1;
+}
+
+/*
+ * Apply the patch given in 'patch_filename' to the source data given
+ * by (old_data, old_size).  Write the patched output to the 'output'
+ * file, and update the SHA context (if not NULL) with the output data
+ * as well.  Return 0 on success.
+ *
+ * Deflate chunks are independent of each other, so they are
+ * reconstructed by a pool of worker threads; normal and raw chunks
+ * are streamed straight to the sink by the calling thread, which also
+ * writes out the deflate chunks in order as they complete.
+ */
+int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size,
+                    const Value* patch,
+                    SinkFn sink, void* token, SHA_CTX* ctx,
+                    const Value* bonus_data) {
+    PatchChunk* chunks;
+    int num_chunks = ReadChunkHeaders(patch, old_size, &chunks);
+    if (num_chunks < 0) {
+        return -1;
+    }
+
+    ImagePatchJob job;
+    job.old_data = old_data;
+    job.patch = patch;
+    job.bonus_data = bonus_data;
+    job.chunks = chunks;
+    job.num_chunks = num_chunks;
+    job.next = 0;
+    job.emitted = 0;
+    job.abort = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    int i;
+    int num_deflate = 0;
+    for (i = 0; i < num_chunks; ++i) {
+        if (chunks[i].type == CHUNK_DEFLATE) ++num_deflate;
+    }
+
+    // With a single deflate chunk (or CPU) there's nothing to overlap;
+    // the calling thread will reconstruct each chunk as it gets to it.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = cpus > 1 ? cpus : 0;
+    if (num_threads > IMGPATCH_MAX_THREADS) num_threads = IMGPATCH_MAX_THREADS;
+    if (num_threads > num_deflate - 1) num_threads = num_deflate - 1;
+    if (num_threads < 0) num_threads = 0;
+    job.max_ahead = 2 * (num_threads + 1);
+
+    pthread_t threads[IMGPATCH_MAX_THREADS];
+    int started = 0;
+    for (; started < num_threads; ++started) {
+        if (pthread_create(&threads[started], NULL,
+                           DeflateChunkWorker, &job) != 0) {
+            break;
+        }
+    }
+
+    int result = 0;
+    for (i = 0; i < num_chunks && result == 0; ++i) {
+        PatchChunk* chunk = chunks + i;
+
+        if (chunk->type == CHUNK_NORMAL) {
+            if (ApplyBSDiffPatch(old_data + chunk->src_start, chunk->src_len,
+                                 patch, chunk->patch_offset,
+                                 sink, token, ctx) != 0) {
+                printf("failed to apply chunk %d normal patch\n", i);
+                result = -1;
+            }
+        } else if (chunk->type == CHUNK_RAW) {
+            if (ctx) {
+                SHA_update(ctx, patch->data + chunk->raw_offset, chunk->raw_len);
+            }
+            if (sink((unsigned char*)patch->data + chunk->raw_offset,
+                     chunk->raw_len, token) != (ssize_t)chunk->raw_len) {
+                printf("failed to write chunk %d raw data\n", i);
+                result = -1;
+            }
+        } else if (chunk->type == CHUNK_DEFLATE) {
+            if (FinishDeflateChunk(&job, i) != 0) {
+                result = -1;
+            } else {
+                ssize_t have = chunk->output_len;
+                if (sink(chunk->output, have, token) != have) {
                     printf("failed to write %ld compressed bytes to output\n",
                            (long)have);
-                    return -1;
+                    result = -1;
+                } else if (ctx) {
+                    SHA_update(ctx, chunk->output, have);
                 }
-                SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
-        } else {
-            printf("patch chunk %d is unknown type %d\n", i, type);
-            return -1;
+            }
+            free(chunk->output);
+            chunk->output = NULL;
         }
+
+        pthread_mutex_lock(&job.lock);
+        job.emitted = i+1;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.lock);
     }
 
-    return 0;
+    pthread_mutex_lock(&job.lock);
+    job.abort = 1;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+    pthread_cond_destroy(&job.cond);
+
+    for (i = 0; i < num_chunks; ++i) {
+        free(chunks[i].output);
+    }
+    free(chunks);
+
+    return result;
 }
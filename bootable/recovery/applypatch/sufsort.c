@@ -0,0 +1,526 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Alternative suffix array backends for bsdiff; see sufsort.h.
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "sufsort.h"
+
+// ---------------------------------------------------------------------
+// SA-IS
+//
+// This follows the reference implementation in "Two Efficient
+// Algorithms for Linear Time Suffix Array Construction" (Nong, Zhang
+// & Chan, 2011).  The top level works on the bytes of the input with
+// a virtual sentinel appended: character i is buf[i]+1, and the
+// sentinel (at index size) is 0.  Recursive levels work on the
+// reduced string of LMS-substring names, stored as off_ts in the upper
+// part of SA.
+
+typedef struct {
+    const u_char* bytes;    // top level only
+    const off_t* names;     // recursive levels only
+    off_t n;                // length including the sentinel
+    unsigned char* t;       // type bits: 1 = S-type, 0 = L-type
+} SaisString;
+
+static inline off_t chr(const SaisString* s, off_t i) {
+    if (s->bytes) {
+        return i == s->n - 1 ? 0 : s->bytes[i] + 1;
+    }
+    return s->names[i];
+}
+
+static inline int tget(const SaisString* s, off_t i) {
+    return (s->t[i >> 3] >> (i & 7)) & 1;
+}
+
+static inline void tset(SaisString* s, off_t i, int b) {
+    if (b) {
+        s->t[i >> 3] |= 1 << (i & 7);
+    } else {
+        s->t[i >> 3] &= ~(1 << (i & 7));
+    }
+}
+
+static inline int is_lms(const SaisString* s, off_t i) {
+    return i > 0 && tget(s, i) && !tget(s, i-1);
+}
+
+static void get_buckets(const SaisString* s, off_t* bkt, off_t k, int end) {
+    off_t i, sum = 0;
+    for (i = 0; i <= k; ++i) bkt[i] = 0;
+    for (i = 0; i < s->n; ++i) bkt[chr(s, i)]++;
+    for (i = 0; i <= k; ++i) {
+        sum += bkt[i];
+        bkt[i] = end ? sum : sum - bkt[i];
+    }
+}
+
+static void induce_l(const SaisString* s, off_t* SA, off_t* bkt, off_t k) {
+    off_t i, j;
+    get_buckets(s, bkt, k, 0);
+    for (i = 0; i < s->n; ++i) {
+        j = SA[i] - 1;
+        if (j >= 0 && !tget(s, j)) SA[bkt[chr(s, j)]++] = j;
+    }
+}
+
+static void induce_s(const SaisString* s, off_t* SA, off_t* bkt, off_t k) {
+    off_t i, j;
+    get_buckets(s, bkt, k, 1);
+    for (i = s->n - 1; i >= 0; --i) {
+        j = SA[i] - 1;
+        if (j >= 0 && tget(s, j)) SA[--bkt[chr(s, j)]] = j;
+    }
+}
+
+// Build the suffix array of s (whose last character is a unique
+// sentinel smaller than the others) in SA[0..n); characters are in
+// [0, k].
+static int sais(SaisString* s, off_t* SA, off_t k) {
+    off_t n = s->n;
+    off_t i, j;
+
+    s->t = calloc(n/8 + 1, 1);
+    off_t* bkt = malloc((k+1) * sizeof(off_t));
+    if (s->t == NULL || bkt == NULL) {
+        free(s->t);
+        free(bkt);
+        return -1;
+    }
+
+    // Classify each suffix as S- or L-type.
+    tset(s, n-1, 1);
+    if (n >= 2) tset(s, n-2, 0);
+    for (i = n-3; i >= 0; --i) {
+        off_t a = chr(s, i), b = chr(s, i+1);
+        tset(s, i, a < b || (a == b && tget(s, i+1)));
+    }
+
+    // Stage 1: sort the LMS-substrings by induced sorting.
+    get_buckets(s, bkt, k, 1);
+    for (i = 0; i < n; ++i) SA[i] = -1;
+    for (i = 1; i < n; ++i) {
+        if (is_lms(s, i)) SA[--bkt[chr(s, i)]] = i;
+    }
+    induce_l(s, SA, bkt, k);
+    induce_s(s, SA, bkt, k);
+
+    // Compact the sorted LMS-substrings into the first n1 slots.
+    off_t n1 = 0;
+    for (i = 0; i < n; ++i) {
+        if (is_lms(s, SA[i])) SA[n1++] = SA[i];
+    }
+
+    // Name the LMS-substrings; equal substrings get equal names.
+    for (i = n1; i < n; ++i) SA[i] = -1;
+    off_t name = 0, prev = -1;
+    for (i = 0; i < n1; ++i) {
+        off_t pos = SA[i];
+        int diff = 0;
+        off_t d;
+        for (d = 0; d < n; ++d) {
+            if (prev == -1 || chr(s, pos+d) != chr(s, prev+d) ||
+                tget(s, pos+d) != tget(s, prev+d)) {
+                diff = 1;
+                break;
+            } else if (d > 0 && (is_lms(s, pos+d) || is_lms(s, prev+d))) {
+                break;
+            }
+        }
+        if (diff) {
+            ++name;
+            prev = pos;
+        }
+        SA[n1 + pos/2] = name - 1;
+    }
+    for (i = n-1, j = n-1; i >= n1; --i) {
+        if (SA[i] >= 0) SA[j--] = SA[i];
+    }
+
+    // Stage 2: sort the reduced string, recursing if names aren't
+    // yet unique.
+    off_t* SA1 = SA;
+    off_t* s1 = SA + n - n1;
+    if (name < n1) {
+        SaisString r;
+        r.bytes = NULL;
+        r.names = s1;
+        r.n = n1;
+        r.t = NULL;
+        if (sais(&r, SA1, name-1) != 0) {
+            free(s->t);
+            free(bkt);
+            return -1;
+        }
+    } else {
+        for (i = 0; i < n1; ++i) SA1[s1[i]] = i;
+    }
+
+    // Stage 3: induce the full suffix array from the sorted LMS
+    // suffixes.
+    get_buckets(s, bkt, k, 1);
+    for (i = 1, j = 0; i < n; ++i) {
+        if (is_lms(s, i)) s1[j++] = i;
+    }
+    for (i = 0; i < n1; ++i) SA1[i] = s1[SA1[i]];
+    for (i = n1; i < n; ++i) SA[i] = -1;
+    for (i = n1-1; i >= 0; --i) {
+        j = SA[i];
+        SA[i] = -1;
+        SA[--bkt[chr(s, j)]] = j;
+    }
+    induce_l(s, SA, bkt, k);
+    induce_s(s, SA, bkt, k);
+
+    free(bkt);
+    free(s->t);
+    return 0;
+}
+
+int sais_suffix_sort(off_t* I, const u_char* buf, off_t size) {
+    if (size == 0) {
+        I[0] = 0;
+        return 0;
+    }
+
+    SaisString s;
+    s.bytes = buf;
+    s.names = NULL;
+    s.n = size + 1;
+    s.t = NULL;
+    // The sentinel sorts first, so I[0] == size as bsdiff expects.
+    return sais(&s, I, 256);
+}
+
+// ---------------------------------------------------------------------
+// Parallel prefix doubling
+//
+// After the pass for h, the suffixes in I are sorted by their first h
+// bytes, and V[i] holds the index in I of the last member of suffix
+// i's group of suffixes sharing those bytes.  A pass doubles h by
+// sorting each unsorted group on V[i+h].  Unlike qsufsort, which
+// refines V in place as it goes, a pass reads only the previous
+// pass's V and writes the new group numbers to W, then copies them
+// back for just the suffixes that were in unsorted groups.  So the
+// groups of one pass are independent and can be handed out to
+// threads.
+
+#define SUFSORT_MAX_THREADS 8
+
+// Below this size the thread start-up costs more than it saves.
+#define SUFSORT_PARALLEL_MIN_SIZE (1 << 20)
+
+// Number of groups a thread claims at a time.
+#define SUFSORT_GROUP_BATCH 1024
+
+typedef struct {
+    off_t key;
+    off_t index;
+} KeyedSuffix;
+
+typedef struct {
+    off_t* I;
+    off_t* V;
+    off_t* W;
+    off_t h;
+    const off_t* groups;    // (start, end) pairs
+    off_t num_groups;
+    int commit;             // 0: sort groups into W; 1: copy W to V
+
+    pthread_mutex_t lock;
+    off_t next_group;
+    int failed;
+} DoublingPass;
+
+static void sort_keyed(KeyedSuffix* a, off_t len) {
+    KeyedSuffix t;
+    off_t i, j;
+
+    while (len > 16) {
+        // Three-way partition around the median of three, so that
+        // the long runs of equal keys in repetitive data cost only
+        // one pass.
+        off_t x = a[0].key, y = a[len/2].key, z = a[len-1].key;
+        off_t pivot = x < y ? (y < z ? y : (x < z ? z : x))
+                            : (x < z ? x : (y < z ? z : y));
+        off_t lt = 0, gt = len;
+        i = 0;
+        while (i < gt) {
+            if (a[i].key < pivot) {
+                t = a[i]; a[i] = a[lt]; a[lt] = t;
+                ++lt; ++i;
+            } else if (a[i].key > pivot) {
+                --gt;
+                t = a[i]; a[i] = a[gt]; a[gt] = t;
+            } else {
+                ++i;
+            }
+        }
+        // Recurse on the smaller side to bound the stack depth.
+        if (lt < len - gt) {
+            sort_keyed(a, lt);
+            a += gt;
+            len -= gt;
+        } else {
+            sort_keyed(a + gt, len - gt);
+            len = lt;
+        }
+    }
+
+    for (i = 1; i < len; ++i) {
+        t = a[i];
+        for (j = i; j > 0 && a[j-1].key > t.key; --j) a[j] = a[j-1];
+        a[j] = t;
+    }
+}
+
+static int sort_group(DoublingPass* p, off_t start, off_t end,
+                      KeyedSuffix** scratch, off_t* scratch_size) {
+    off_t len = end - start + 1;
+    off_t j;
+
+    if (len > *scratch_size) {
+        free(*scratch);
+        *scratch_size = len * 2;
+        *scratch = malloc(*scratch_size * sizeof(KeyedSuffix));
+        if (*scratch == NULL) return -1;
+    }
+    KeyedSuffix* k = *scratch;
+
+    // Members of an unsorted group are at least h bytes from the end
+    // (the end would otherwise have separated them), so I[j]+h is
+    // always a valid index.
+    for (j = 0; j < len; ++j) {
+        k[j].index = p->I[start+j];
+        k[j].key = p->V[k[j].index + p->h];
+    }
+    sort_keyed(k, len);
+
+    off_t run = 0;
+    for (j = 0; j < len; ++j) {
+        p->I[start+j] = k[j].index;
+        if (j+1 == len || k[j+1].key != k[j].key) {
+            for (; run <= j; ++run) p->W[k[run].index] = start + j;
+        }
+    }
+    return 0;
+}
+
+static void* doubling_worker(void* cookie) {
+    DoublingPass* p = (DoublingPass*)cookie;
+    KeyedSuffix* scratch = NULL;
+    off_t scratch_size = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        off_t first = p->next_group;
+        p->next_group += SUFSORT_GROUP_BATCH;
+        pthread_mutex_unlock(&p->lock);
+        if (first >= p->num_groups) break;
+
+        off_t g, last = first + SUFSORT_GROUP_BATCH;
+        if (last > p->num_groups) last = p->num_groups;
+        for (g = first; g < last; ++g) {
+            off_t start = p->groups[2*g];
+            off_t end = p->groups[2*g+1];
+            if (p->commit) {
+                off_t j;
+                for (j = start; j <= end; ++j) {
+                    p->V[p->I[j]] = p->W[p->I[j]];
+                }
+            } else if (sort_group(p, start, end,
+                                  &scratch, &scratch_size) != 0) {
+                pthread_mutex_lock(&p->lock);
+                p->failed = 1;
+                p->next_group = p->num_groups;
+                pthread_mutex_unlock(&p->lock);
+                break;
+            }
+        }
+    }
+
+    free(scratch);
+    return NULL;
+}
+
+static void run_pass(DoublingPass* p, int num_threads) {
+    pthread_t threads[SUFSORT_MAX_THREADS];
+    int started = 0;
+    int t;
+
+    p->next_group = 0;
+    while (started < num_threads - 1 &&
+           p->num_groups > (started+1) * SUFSORT_GROUP_BATCH &&
+           pthread_create(&threads[started], NULL,
+                          doubling_worker, p) == 0) {
+        ++started;
+    }
+    doubling_worker(p);
+    for (t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+// Append the group (start, end) to the list, growing it as needed.
+static int add_group(off_t** groups, off_t* groups_size, off_t* num_groups,
+                     off_t start, off_t end) {
+    if (2 * *num_groups + 2 > *groups_size) {
+        off_t n = *groups_size ? *groups_size * 2 : 4096;
+        off_t* g = realloc(*groups, n * sizeof(off_t));
+        if (g == NULL) return -1;
+        *groups = g;
+        *groups_size = n;
+    }
+    (*groups)[2 * *num_groups] = start;
+    (*groups)[2 * *num_groups + 1] = end;
+    ++*num_groups;
+    return 0;
+}
+
+int parallel_suffix_sort(off_t* I, const u_char* buf, off_t size) {
+    off_t* V = malloc((size+1) * sizeof(off_t));
+    off_t* W = malloc((size+1) * sizeof(off_t));
+    off_t* buckets = calloc(256*257 + 1, sizeof(off_t));
+    off_t* groups = NULL;
+    off_t* next_groups = NULL;
+    off_t groups_size = 0, next_groups_size = 0;
+    int result = -1;
+    off_t i;
+
+    if (V == NULL || W == NULL || buckets == NULL) goto done;
+
+    // Bucket by the first two bytes.  The one-byte suffix at the end
+    // sorts before every two-byte suffix that starts with the same
+    // byte, so it gets key buf[i]*257 and the others
+    // buf[i]*257 + buf[i+1] + 1.
+#define KEY2(i) ((i)+1 < size ? buf[i]*257 + buf[(i)+1] + 1 : buf[i]*257)
+    for (i = 0; i < size; ++i) buckets[KEY2(i) + 1]++;
+    for (i = 1; i <= 256*257; ++i) buckets[i] += buckets[i-1];
+    // buckets[key] is now the number of suffixes with smaller keys; I[0]
+    // is the empty suffix, so the bucket for key starts at
+    // buckets[key] + 1.
+    I[0] = size;
+    V[size] = 0;
+    for (i = 0; i < size; ++i) I[++buckets[KEY2(i)]] = i;
+    // buckets[key] is now the index of the last member of each bucket.
+    for (i = 0; i < size; ++i) V[i] = buckets[KEY2(i)];
+#undef KEY2
+    free(buckets);
+    buckets = NULL;
+
+    int num_threads = 1;
+    if (size >= SUFSORT_PARALLEL_MIN_SIZE) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus > 1) num_threads = cpus;
+        if (num_threads > SUFSORT_MAX_THREADS) {
+            num_threads = SUFSORT_MAX_THREADS;
+        }
+    }
+
+    // The unsorted groups of each pass are sub-runs of the previous
+    // pass's, so after the first scan only their members are visited
+    // again, not the suffixes already in place.
+    off_t num_groups = 0;
+    off_t unsorted = 0;
+    for (i = 0; i <= size; i = V[I[i]] + 1) {
+        if (V[I[i]] > i) {
+            if (add_group(&groups, &groups_size, &num_groups,
+                          i, V[I[i]]) != 0) {
+                goto done;
+            }
+            unsorted += V[I[i]] - i + 1;
+        }
+    }
+
+    off_t h;
+    for (h = 2; num_groups > 0; h += h) {
+        DoublingPass pass;
+        pass.I = I;
+        pass.V = V;
+        pass.W = W;
+        pass.h = h;
+        pass.groups = groups;
+        pass.num_groups = num_groups;
+        pass.failed = 0;
+        pthread_mutex_init(&pass.lock, NULL);
+
+        pass.commit = 0;
+        run_pass(&pass, num_threads);
+        if (!pass.failed) {
+            pass.commit = 1;
+            run_pass(&pass, num_threads);
+        }
+        pthread_mutex_destroy(&pass.lock);
+        if (pass.failed) goto done;
+
+        off_t g, old_groups = num_groups, old_unsorted = unsorted;
+        num_groups = 0;
+        unsorted = 0;
+        for (g = 0; g < old_groups; ++g) {
+            off_t end = groups[2*g+1];
+            for (i = groups[2*g]; i <= end; i = V[I[i]] + 1) {
+                if (V[I[i]] > i) {
+                    if (add_group(&next_groups, &next_groups_size,
+                                  &num_groups, i, V[I[i]]) != 0) {
+                        goto done;
+                    }
+                    unsorted += V[I[i]] - i + 1;
+                }
+            }
+        }
+
+        // Long runs of a byte or of a short pattern give suffixes that
+        // differ only in their length, so each pass sorts just a few
+        // more of them, and ~log2(size) passes go over nearly the whole
+        // input.  Once a pass makes that little progress on much of
+        // the input, SA-IS (linear, with no passes) is far quicker.
+        if (unsorted > size / 8 && unsorted > old_unsorted - old_unsorted / 8) {
+            result = sais_suffix_sort(I, buf, size);
+            goto done;
+        }
+        off_t* tmp = groups;
+        groups = next_groups;
+        next_groups = tmp;
+        off_t tmp_size = groups_size;
+        groups_size = next_groups_size;
+        next_groups_size = tmp_size;
+    }
+    result = 0;
+
+  done:
+    free(V);
+    free(W);
+    free(buckets);
+    free(groups);
+    free(next_groups);
+    return result;
+}
+
+// ---------------------------------------------------------------------
+
+SuffixSortFn FindSuffixSort(const char* name) {
+    if (strcmp(name, "qsufsort") == 0) return qsufsort_suffix_sort;
+    if (strcmp(name, "sais") == 0) return sais_suffix_sort;
+    if (strcmp(name, "parallel") == 0) return parallel_suffix_sort;
+    return NULL;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BUILD_TOOLS_APPLYPATCH_SUFSORT_H
+#define _BUILD_TOOLS_APPLYPATCH_SUFSORT_H
+
+#include <sys/types.h>
+
+// Suffix array construction for bsdiff.  Every backend fills
+// I[0..size] with the sorted suffixes of buf[0..size), including the
+// empty suffix (so I[0] == size), which is the layout bsdiff's search()
+// expects.  The suffix array is unique, so all backends produce
+// identical output.  Each returns 0 on success, -1 if out of memory.
+
+typedef int (*SuffixSortFn)(off_t* I, const u_char* buf, off_t size);
+
+// Larsson-Sadakane, from bsdiff-4.3 (in bsdiff.c).
+int qsufsort_suffix_sort(off_t* I, const u_char* buf, off_t size);
+
+// SA-IS (Nong, Zhang & Chan): linear time, single-threaded.
+int sais_suffix_sort(off_t* I, const u_char* buf, off_t size);
+
+// Prefix doubling in which each pass refines all unsorted groups in
+// parallel, one thread per CPU.  Input so repetitive that the passes
+// stop making progress is finished with SA-IS instead.
+int parallel_suffix_sort(off_t* I, const u_char* buf, off_t size);
+
+// Look up a backend by name ("qsufsort", "sais" or "parallel").
+// Returns NULL for unknown names.
+SuffixSortFn FindSuffixSort(const char* name);
+
+// Select the backend used by bsdiff() (bsdiff.c) when it has to build
+// a suffix array; the default is "sais".  Returns -1 for unknown
+// names.
+int bsdiff_set_suffix_sort(const char* name);
+
+#endif //  _BUILD_TOOLS_APPLYPATCH_SUFSORT_H
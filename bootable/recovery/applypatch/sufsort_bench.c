@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times each suffix sort backend on the given files (typically source
+// images or APKs from a build), and checks that they all produce the
+// same suffix array.
+//
+// usage: sufsort_bench <file> [<file> ...]
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "sufsort.h"
+
+static const char* kBackends[] = { "qsufsort", "sais", "parallel" };
+#define NUM_BACKENDS (sizeof(kBackends) / sizeof(kBackends[0]))
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <file> [<file> ...]\n", argv[0]);
+        return 2;
+    }
+
+    int i, mismatch = 0;
+    for (i = 1; i < argc; ++i) {
+        struct stat st;
+        if (stat(argv[i], &st) != 0) {
+            printf("failed to stat \"%s\": %s\n", argv[i], strerror(errno));
+            return 1;
+        }
+        off_t size = st.st_size;
+        u_char* data = malloc(size > 0 ? size : 1);
+        FILE* f = fopen(argv[i], "rb");
+        if (f == NULL || fread(data, 1, size, f) != (size_t)size) {
+            printf("failed to read \"%s\"\n", argv[i]);
+            return 1;
+        }
+        fclose(f);
+
+        off_t* reference = NULL;
+        size_t b;
+        for (b = 0; b < NUM_BACKENDS; ++b) {
+            off_t* I = malloc((size+1) * sizeof(off_t));
+            double start = Now();
+            if (FindSuffixSort(kBackends[b])(I, data, size) != 0) {
+                printf("%s: %s failed\n", argv[i], kBackends[b]);
+                return 1;
+            }
+            double elapsed = Now() - start;
+
+            int same = 1;
+            if (reference == NULL) {
+                reference = I;
+            } else {
+                same = memcmp(reference, I, (size+1) * sizeof(off_t)) == 0;
+                free(I);
+            }
+            if (!same) mismatch = 1;
+
+            printf("%s: %-8s %ld bytes in %.3f s (%.1f MB/s)%s\n",
+                   argv[i], kBackends[b], (long)size, elapsed,
+                   elapsed > 0 ? size / elapsed / 1e6 : 0.0,
+                   same ? "" : "  MISMATCH");
+        }
+
+        free(reference);
+        free(data);
+    }
+
+    return mismatch;
+}
@@ -5,7 +5,9 @@ LOCAL_PATH := $(call my-dir)
 edify_src_files := \
 	lexer.l \
 	parser.y \
-	expr.c
+	expr.c \
+	optimize.c \
+	trace.c
 
 # "-x c" forces the lex/yacc files to be compiled as c;
 # the build system otherwise forces them to be c++.
@@ -21,11 +23,28 @@ LOCAL_SRC_FILES := \
 		main.c
 
 LOCAL_CFLAGS := $(edify_cflags) -g -O0
+LOCAL_LDLIBS += -lpthread
 LOCAL_MODULE := edify
 LOCAL_YACCFLAGS := -v
 
 include $(BUILD_HOST_EXECUTABLE)
 
+#
+# Build the host-side interpreter benchmark
+#
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+		$(edify_src_files) \
+		expr_bench.c
+
+LOCAL_CFLAGS := $(edify_cflags) -O2
+LOCAL_LDLIBS += -lpthread
+LOCAL_MODULE := edify_bench
+LOCAL_MODULE_TAGS := optional
+
+include $(BUILD_HOST_EXECUTABLE)
+
 #
 # Build the device-side library
 #
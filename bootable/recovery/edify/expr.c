@@ -28,12 +28,19 @@
 //    - return a malloc()'d string
 //    - if Evaluate() on any argument returns NULL, return NULL.
 
+// Size of the blocks the parse tree is carved out of.
+#define PARSE_BLOCK_SIZE 65536
+
 int BooleanString(const char* s) {
     return s[0] != '\0';
 }
 
 char* Evaluate(State* state, Expr* expr) {
-    Value* v = expr->fn(expr->name, state, expr->argc, expr->argv);
+    if (expr->fn == Literal) {
+        // Skip the Value that Literal() would wrap this in.
+        return strdup(expr->name);
+    }
+    Value* v = TraceCall(state, expr);
     if (v == NULL) return NULL;
     if (v->type != VAL_STRING) {
         ErrorAbort(state, "expecting string, got value type %d", v->type);
@@ -46,7 +53,16 @@ char* Evaluate(State* state, Expr* expr) {
 }
 
 Value* EvaluateValue(State* state, Expr* expr) {
-    return expr->fn(expr->name, state, expr->argc, expr->argv);
+    return TraceCall(state, expr);
+}
+
+const char* EvaluateBorrowed(State* state, Expr* expr, char** to_free) {
+    if (expr->fn == Literal) {
+        *to_free = NULL;
+        return expr->name;
+    }
+    *to_free = Evaluate(state, expr);
+    return *to_free;
 }
 
 Value* StringValue(char* str) {
@@ -68,34 +84,51 @@ Value* ConcatFn(const char* name, State* state, int argc, Expr* argv[]) {
     if (argc == 0) {
         return StringValue(strdup(""));
     }
-    char** strings = malloc(argc * sizeof(char*));
+    // Most concatenations are of a few pieces; only allocate the
+    // bookkeeping for long ones.
+    const char* local_strings[8];
+    char* local_owned[8];
+    size_t local_lengths[8];
+    const char** strings = local_strings;
+    char** owned = local_owned;
+    size_t* lengths = local_lengths;
+    if (argc > 8) {
+        strings = malloc(argc * sizeof(char*));
+        owned = malloc(argc * sizeof(char*));
+        lengths = malloc(argc * sizeof(size_t));
+    }
     int i;
     for (i = 0; i < argc; ++i) {
-        strings[i] = NULL;
+        owned[i] = NULL;
     }
     char* result = NULL;
-    int length = 0;
+    size_t length = 0;
     for (i = 0; i < argc; ++i) {
-        strings[i] = Evaluate(state, argv[i]);
+        strings[i] = EvaluateBorrowed(state, argv[i], &owned[i]);
         if (strings[i] == NULL) {
             goto done;
         }
-        length += strlen(strings[i]);
+        lengths[i] = strlen(strings[i]);
+        length += lengths[i];
     }
 
     result = malloc(length+1);
-    int p = 0;
+    size_t p = 0;
     for (i = 0; i < argc; ++i) {
-        strcpy(result+p, strings[i]);
-        p += strlen(strings[i]);
+        memcpy(result+p, strings[i], lengths[i]);
+        p += lengths[i];
     }
     result[p] = '\0';
 
   done:
     for (i = 0; i < argc; ++i) {
-        free(strings[i]);
+        free(owned[i]);
+    }
+    if (strings != local_strings) {
+        free(strings);
+        free(owned);
+        free(lengths);
     }
-    free(strings);
     return StringValue(result);
 }
 
@@ -105,20 +138,21 @@ Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]) {
         state->errmsg = strdup("ifelse expects 2 or 3 arguments");
         return NULL;
     }
-    char* cond = Evaluate(state, argv[0]);
+    char* owned;
+    const char* cond = EvaluateBorrowed(state, argv[0], &owned);
     if (cond == NULL) {
         return NULL;
     }
 
     if (BooleanString(cond) == true) {
-        free(cond);
+        free(owned);
         return EvaluateValue(state, argv[1]);
     } else {
         if (argc == 3) {
-            free(cond);
+            free(owned);
             return EvaluateValue(state, argv[2]);
         } else {
-            return StringValue(cond);
+            return StringValue(owned ? owned : strdup(cond));
         }
     }
 }
@@ -140,12 +174,13 @@ Value* AbortFn(const char* name, State* state, int argc, Expr* argv[]) {
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]) {
     int i;
     for (i = 0; i < argc; ++i) {
-        char* v = Evaluate(state, argv[i]);
+        char* owned;
+        const char* v = EvaluateBorrowed(state, argv[i], &owned);
         if (v == NULL) {
             return NULL;
         }
         int b = BooleanString(v);
-        free(v);
+        free(owned);
         if (!b) {
             int prefix_len;
             int len = argv[i]->end - argv[i]->start;
@@ -187,88 +222,103 @@ Value* StdoutFn(const char* name, State* state, int argc, Expr* argv[]) {
 
 Value* LogicalAndFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    char* owned;
+    const char* left = EvaluateBorrowed(state, argv[0], &owned);
     if (left == NULL) return NULL;
     if (BooleanString(left) == true) {
-        free(left);
+        free(owned);
         return EvaluateValue(state, argv[1]);
     } else {
-        return StringValue(left);
+        return StringValue(owned ? owned : strdup(left));
     }
 }
 
 Value* LogicalOrFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    char* owned;
+    const char* left = EvaluateBorrowed(state, argv[0], &owned);
     if (left == NULL) return NULL;
     if (BooleanString(left) == false) {
-        free(left);
+        free(owned);
         return EvaluateValue(state, argv[1]);
     } else {
-        return StringValue(left);
+        return StringValue(owned ? owned : strdup(left));
     }
 }
 
 Value* LogicalNotFn(const char* name, State* state,
                     int argc, Expr* argv[]) {
-    char* val = Evaluate(state, argv[0]);
+    char* owned;
+    const char* val = EvaluateBorrowed(state, argv[0], &owned);
     if (val == NULL) return NULL;
     bool bv = BooleanString(val);
-    free(val);
+    free(owned);
     return StringValue(strdup(bv ? "" : "t"));
 }
 
 Value* SubstringFn(const char* name, State* state,
                    int argc, Expr* argv[]) {
-    char* needle = Evaluate(state, argv[0]);
+    char* owned_needle;
+    char* owned_haystack;
+    const char* needle = EvaluateBorrowed(state, argv[0], &owned_needle);
     if (needle == NULL) return NULL;
-    char* haystack = Evaluate(state, argv[1]);
+    const char* haystack = EvaluateBorrowed(state, argv[1], &owned_haystack);
     if (haystack == NULL) {
-        free(needle);
+        free(owned_needle);
         return NULL;
     }
 
     char* result = strdup(strstr(haystack, needle) ? "t" : "");
-    free(needle);
-    free(haystack);
+    free(owned_needle);
+    free(owned_haystack);
     return StringValue(result);
 }
 
 Value* EqualityFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    char* owned_left;
+    char* owned_right;
+    const char* left = EvaluateBorrowed(state, argv[0], &owned_left);
     if (left == NULL) return NULL;
-    char* right = Evaluate(state, argv[1]);
+    const char* right = EvaluateBorrowed(state, argv[1], &owned_right);
     if (right == NULL) {
-        free(left);
+        free(owned_left);
         return NULL;
     }
 
     char* result = strdup(strcmp(left, right) == 0 ? "t" : "");
-    free(left);
-    free(right);
+    free(owned_left);
+    free(owned_right);
     return StringValue(result);
 }
 
 Value* InequalityFn(const char* name, State* state, int argc, Expr* argv[]) {
-    char* left = Evaluate(state, argv[0]);
+    char* owned_left;
+    char* owned_right;
+    const char* left = EvaluateBorrowed(state, argv[0], &owned_left);
     if (left == NULL) return NULL;
-    char* right = Evaluate(state, argv[1]);
+    const char* right = EvaluateBorrowed(state, argv[1], &owned_right);
     if (right == NULL) {
-        free(left);
+        free(owned_left);
         return NULL;
     }
 
     char* result = strdup(strcmp(left, right) != 0 ? "t" : "");
-    free(left);
-    free(right);
+    free(owned_left);
+    free(owned_right);
     return StringValue(result);
 }
 
+// Evaluate each statement in turn, giving the value of the last.  The
+// parser makes these with two arguments; OptimizeExpr() flattens a
+// script's worth of them into one.
 Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]) {
-    Value* left = EvaluateValue(state, argv[0]);
-    if (left == NULL) return NULL;
-    FreeValue(left);
-    return EvaluateValue(state, argv[1]);
+    int i;
+    for (i = 0; i < argc - 1; ++i) {
+        Value* v = EvaluateValue(state, argv[i]);
+        if (v == NULL) return NULL;
+        FreeValue(v);
+    }
+    return EvaluateValue(state, argv[argc-1]);
 }
 
 Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -278,9 +328,15 @@ Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
         return NULL;
     }
 
-    char* left;
-    char* right;
-    if (ReadArgs(state, argv, 2, &left, &right) < 0) return NULL;
+    char* owned_left;
+    char* owned_right;
+    const char* left = EvaluateBorrowed(state, argv[0], &owned_left);
+    if (left == NULL) return NULL;
+    const char* right = EvaluateBorrowed(state, argv[1], &owned_right);
+    if (right == NULL) {
+        free(owned_left);
+        return NULL;
+    }
 
     bool result = false;
     char* end;
@@ -300,8 +356,8 @@ Value* LessThanIntFn(const char* name, State* state, int argc, Expr* argv[]) {
     result = l_int < r_int;
 
   done:
-    free(left);
-    free(right);
+    free(owned_left);
+    free(owned_right);
     return StringValue(strdup(result ? "t" : ""));
 }
 
@@ -355,11 +411,11 @@ Value* Literal(const char* name, State* state, int argc, Expr* argv[]) {
 Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     va_list v;
     va_start(v, count);
-    Expr* e = malloc(sizeof(Expr));
+    Expr* e = ParseAlloc(sizeof(Expr));
     e->fn = fn;
     e->name = "(operator)";
     e->argc = count;
-    e->argv = malloc(count * sizeof(Expr*));
+    e->argv = ParseAlloc(count * sizeof(Expr*));
     int i;
     for (i = 0; i < count; ++i) {
         e->argv[i] = va_arg(v, Expr*);
@@ -370,6 +426,31 @@ Expr* Build(Function fn, YYLTYPE loc, int count, ...) {
     return e;
 }
 
+// The parse tree is built once and kept until the process exits, so
+// its nodes are carved out of large blocks instead of being allocated
+// one by one.  Not thread-safe; it's only used while parsing.
+void* ParseAlloc(size_t size) {
+    static char* block = NULL;
+    static size_t left = 0;
+
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    if (size > PARSE_BLOCK_SIZE / 4) {
+        return malloc(size);
+    }
+    if (size > left) {
+        block = malloc(PARSE_BLOCK_SIZE);
+        if (block == NULL) {
+            left = 0;
+            return NULL;
+        }
+        left = PARSE_BLOCK_SIZE;
+    }
+    void* p = block;
+    block += size;
+    left -= size;
+    return p;
+}
+
 // -----------------------------------------------------------------
 //   the function table
 // -----------------------------------------------------------------
@@ -432,25 +513,25 @@ void RegisterBuiltins() {
 // zero or more char** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadArgs(State* state, Expr* argv[], int count, ...) {
-    char** args = malloc(count * sizeof(char*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = Evaluate(state, argv[i]);
-        if (args[i] == NULL) {
+        char** arg = va_arg(v, char**);
+        *arg = Evaluate(state, argv[i]);
+        if (*arg == NULL) {
             va_end(v);
+            // Go back over the ones already filled in.
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                free(args[j]);
+                free(*(va_arg(v, char**)));
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, char**)) = args[i];
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -458,25 +539,25 @@ int ReadArgs(State* state, Expr* argv[], int count, ...) {
 // zero or more Value** to put them in).  If any expression evaluates
 // to NULL, free the rest and return -1.  Return 0 on success.
 int ReadValueArgs(State* state, Expr* argv[], int count, ...) {
-    Value** args = malloc(count * sizeof(Value*));
     va_list v;
     va_start(v, count);
     int i;
     for (i = 0; i < count; ++i) {
-        args[i] = EvaluateValue(state, argv[i]);
-        if (args[i] == NULL) {
+        Value** arg = va_arg(v, Value**);
+        *arg = EvaluateValue(state, argv[i]);
+        if (*arg == NULL) {
             va_end(v);
+            // Go back over the ones already filled in.
+            va_start(v, count);
             int j;
             for (j = 0; j < i; ++j) {
-                FreeValue(args[j]);
+                FreeValue(*(va_arg(v, Value**)));
             }
-            free(args);
+            va_end(v);
             return -1;
         }
-        *(va_arg(v, Value**)) = args[i];
     }
     va_end(v);
-    free(args);
     return 0;
 }
 
@@ -77,6 +77,15 @@ Value* EvaluateValue(State* state, Expr* expr);
 // with strings.
 char* Evaluate(State* state, Expr* expr);
 
+// Like Evaluate(), but a literal's string is returned as it is in the
+// tree instead of being copied.  *to_free is set to what the caller
+// must free() when it's done with the result: NULL for a literal,
+// otherwise the result itself.
+const char* EvaluateBorrowed(State* state, Expr* expr, char** to_free);
+
+// Is this string "true" as a condition?  (Any nonempty string is.)
+int BooleanString(const char* s);
+
 // Glue to make an Expr out of a literal.
 Value* Literal(const char* name, State* state, int argc, Expr* argv[]);
 
@@ -96,6 +105,9 @@ Value* SequenceFn(const char* name, State* state, int argc, Expr* argv[]);
 // of arguments.
 Expr* Build(Function fn, YYLTYPE loc, int count, ...);
 
+// Allocate memory for part of a parse tree.  It's never freed.
+void* ParseAlloc(size_t size);
+
 // Global builtins, registered by RegisterBuiltins().
 Value* IfElseFn(const char* name, State* state, int argc, Expr* argv[]);
 Value* AssertFn(const char* name, State* state, int argc, Expr* argv[]);
@@ -130,6 +142,23 @@ void FinishRegistration();
 Function FindFunction(const char* name);
 
 
+// Write a Chrome trace-event file recording the time taken by, and
+// the I/O done by, each function call from now until TraceClose().
+// Returns 0 on success.
+int TraceOpen(const char* path);
+void TraceClose();
+
+// Evaluate expr, adding it to the trace if one is open.  Evaluate()
+// and EvaluateValue() go through this.
+Value* TraceCall(State* state, Expr* expr);
+
+// Rewrite a parsed script so it evaluates faster: statement sequences
+// and concatenations are flattened, and operators on literals are
+// evaluated ahead of time.  Returns the new root; the result is the
+// same as evaluating the original tree.
+Expr* OptimizeExpr(Expr* root);
+
+
 // --- convenience functions for use in functions ---
 
 // Evaluate the expressions in argv, giving 'count' char* (the ... is
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Times parsing and evaluating a large generated script, to measure
+// the cost of the interpreter itself rather than of the functions it
+// calls.  The script is made of the builtins only, in the shape of a
+// full OTA script: assertions, comparisons and concatenations of path
+// literals, one group per file.
+//
+// usage: edify_bench [-n <files>] [-i <iterations>]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "expr.h"
+#include "parser.h"
+
+extern int yyparse(Expr** root, int* error_count);
+
+static const char* kGroup =
+    "assert(less_than_int(\"%d\", \"1000000000\"));\n"
+    "ifelse(is_substring(\"system/app\", \"/system/app/App%d.apk\"),\n"
+    "       \"/system/app/\" + \"App%d\" + \".apk\", abort(\"no app\"));\n"
+    "\"/system/lib/lib%d.so\" == concat(\"/system/\", \"lib/lib%d.so\") || abort();\n"
+    "if \"/data/app\" != \"\" then greater_than_int(\"%d\", \"-1\") endif;\n";
+
+static double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char* MakeScript(int files) {
+    size_t size = (strlen(kGroup) + 6 * 10) * files + 16;
+    char* script = malloc(size);
+    size_t len = 0;
+    int i;
+    for (i = 0; i < files; ++i) {
+        len += snprintf(script + len, size - len, kGroup, i, i, i, i, i, i);
+    }
+    strcpy(script + len, "\"done\"\n");
+    return script;
+}
+
+static Expr* Parse(char* script) {
+    Expr* root;
+    int error_count = 0;
+    yy_scan_string(script);
+    int error = yyparse(&root, &error_count);
+    if (error != 0 || error_count > 0) {
+        fprintf(stderr, "%d parse errors\n", error_count);
+        return NULL;
+    }
+    return root;
+}
+
+static int Run(const char* label, Expr* root, char* script, int iterations) {
+    double start = Now();
+    int i;
+    for (i = 0; i < iterations; ++i) {
+        State state;
+        state.cookie = NULL;
+        state.script = script;
+        state.errmsg = NULL;
+        char* result = Evaluate(&state, root);
+        if (result == NULL) {
+            fprintf(stderr, "%s: script failed: %s\n", label,
+                    state.errmsg ? state.errmsg : "(no error message)");
+            free(state.errmsg);
+            return -1;
+        }
+        free(result);
+    }
+    printf("%-10s %.3f ms per evaluation\n", label,
+           (Now() - start) * 1000 / iterations);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int files = 10000;
+    int iterations = 20;
+    int i;
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i+1 < argc) {
+            files = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0 && i+1 < argc) {
+            iterations = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [-n <files>] [-i <iterations>]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (files < 1 || iterations < 1) {
+        fprintf(stderr, "-n and -i must be positive\n");
+        return 2;
+    }
+
+    RegisterBuiltins();
+    FinishRegistration();
+
+    char* script = MakeScript(files);
+    printf("%d files, %zu byte script\n", files, strlen(script));
+
+    double start = Now();
+    Expr* root = Parse(script);
+    if (root == NULL) return 1;
+    printf("%-10s %.3f ms\n", "parse", (Now() - start) * 1000);
+    if (Run("evaluate", root, script, iterations) < 0) return 1;
+
+    // Parse again, since OptimizeExpr() rewrites the tree it's given.
+    root = Parse(script);
+    if (root == NULL) return 1;
+    start = Now();
+    root = OptimizeExpr(root);
+    printf("%-10s %.3f ms\n", "optimize", (Now() - start) * 1000);
+    if (Run("optimized", root, script, iterations) < 0) return 1;
+
+    free(script);
+    return 0;
+}
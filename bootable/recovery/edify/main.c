@@ -23,50 +23,57 @@
 
 extern int yyparse(Expr** root, int* error_count);
 
+// Evaluate expr_str both as parsed and after OptimizeExpr().
 int expect(const char* expr_str, const char* expected, int* errors) {
     Expr* e;
     int error;
     char* result;
+    int optimize;
 
     printf(".");
 
-    yy_scan_string(expr_str);
-    int error_count = 0;
-    error = yyparse(&e, &error_count);
-    if (error > 0 || error_count > 0) {
-        fprintf(stderr, "error parsing \"%s\" (%d errors)\n",
-                expr_str, error_count);
-        ++*errors;
-        return 0;
-    }
+    for (optimize = 0; optimize <= 1; ++optimize) {
+        const char* how = optimize ? " (optimized)" : "";
+
+        yy_scan_string(expr_str);
+        int error_count = 0;
+        error = yyparse(&e, &error_count);
+        if (error > 0 || error_count > 0) {
+            fprintf(stderr, "error parsing \"%s\" (%d errors)\n",
+                    expr_str, error_count);
+            ++*errors;
+            return 0;
+        }
+        if (optimize) e = OptimizeExpr(e);
 
-    State state;
-    state.cookie = NULL;
-    state.script = strdup(expr_str);
-    state.errmsg = NULL;
-
-    result = Evaluate(&state, e);
-    free(state.errmsg);
-    free(state.script);
-    if (result == NULL && expected != NULL) {
-        fprintf(stderr, "error evaluating \"%s\"\n", expr_str);
-        ++*errors;
-        return 0;
-    }
+        State state;
+        state.cookie = NULL;
+        state.script = strdup(expr_str);
+        state.errmsg = NULL;
 
-    if (result == NULL && expected == NULL) {
-        return 1;
-    }
+        result = Evaluate(&state, e);
+        free(state.errmsg);
+        free(state.script);
+        if (result == NULL && expected != NULL) {
+            fprintf(stderr, "error evaluating \"%s\"%s\n", expr_str, how);
+            ++*errors;
+            return 0;
+        }
+
+        if (result == NULL && expected == NULL) {
+            continue;
+        }
+
+        if (expected == NULL || strcmp(result, expected) != 0) {
+            fprintf(stderr, "evaluating \"%s\"%s: expected \"%s\", got \"%s\"\n",
+                    expr_str, how, expected ? expected : "(NULL)", result);
+            ++*errors;
+            free(result);
+            return 0;
+        }
 
-    if (strcmp(result, expected) != 0) {
-        fprintf(stderr, "evaluating \"%s\": expected \"%s\", got \"%s\"\n",
-                expr_str, expected, result);
-        ++*errors;
         free(result);
-        return 0;
     }
-
-    free(result);
     return 1;
 }
 
@@ -91,6 +98,8 @@ int test() {
     expect("a + b +\nc\n", "abc", &errors);
 
     // string concat function
+    expect("concat()", "", &errors);
+    expect("concat(a, concat(), b)", "ab", &errors);
     expect("concat(a, b)", "ab", &errors);
     expect("concat(a,\n \"b\")", "ab", &errors);
     expect("concat(a + b,\nc,\"d\")", "abcd", &errors);
@@ -154,6 +163,16 @@ int test() {
     expect("greater_than_int(x, 3)", "", &errors);
     expect("greater_than_int(3, x)", "", &errors);
 
+    // mixing literals with calls OptimizeExpr() can't fold
+    expect("a + b + less_than_int(1, 2) + c + d", "abtcd", &errors);
+    expect("a; b; less_than_int(1, 2); c", "c", &errors);
+    expect("a; b; less_than_int(2, 1)", "", &errors);
+    expect("(a; b) + (c; less_than_int(1, 2))", "bt", &errors);
+    expect("if a == a then less_than_int(1, 2) else abort() endif", "t", &errors);
+    expect("t && (a; \"\") || less_than_int(2, 1) || z", "z", &errors);
+    expect("assert(a + b == ab); x", "x", &errors);
+    expect("a; assert(a == b); x", NULL, &errors);
+
     printf("\n");
 
     return errors;
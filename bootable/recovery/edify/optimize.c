@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A pass over a parsed script that makes it cheaper to evaluate,
+// without changing what it does:
+//
+//   - A run of statements "a; b; c; ..." parses as a chain of binary
+//     sequence operators as deep as the script is long.  It becomes a
+//     single sequence node that evaluates its statements in a loop,
+//     and statements that are just literals (which have no effect) are
+//     dropped.
+//
+//   - Chains of '+' and concat() become a single concat, with adjacent
+//     literals joined.
+//
+//   - The operators and pure builtins are evaluated now when their
+//     arguments are all literals, and &&, ||, if and ';' with a
+//     literal on the left are reduced to the branch they'd take.
+//
+// Functions still get their arguments as unevaluated Exprs, so the
+// result is an ordinary tree that Evaluate() runs as before.  A node
+// that replaces another takes over its place in the script, so
+// assert() still quotes the original text.
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "expr.h"
+
+// Functions with no side effects, which can be evaluated ahead of time
+// when their arguments are all literals, with the argument count each
+// needs (-1 for any).
+static const struct {
+    Function fn;
+    int argc;
+} pure_functions[] = {
+    { ConcatFn, -1 },
+    { EqualityFn, 2 },
+    { InequalityFn, 2 },
+    { LogicalAndFn, 2 },
+    { LogicalOrFn, 2 },
+    { LogicalNotFn, 1 },
+    { SubstringFn, 2 },
+    { IfElseFn, -1 },
+};
+
+static bool IsLiteral(const Expr* e) {
+    return e->fn == Literal;
+}
+
+static bool IsOperator(const Expr* e, Function fn) {
+    return e->fn == fn;
+}
+
+// Put 'with' where 'old' was in the script.
+static Expr* Replace(Expr* old, Expr* with) {
+    with->start = old->start;
+    with->end = old->end;
+    return with;
+}
+
+static Expr* MakeLiteral(Expr* old, char* value) {
+    Expr* e = ParseAlloc(sizeof(Expr));
+    e->fn = Literal;
+    e->name = value;
+    e->argc = 0;
+    e->argv = NULL;
+    return Replace(old, e);
+}
+
+static Expr* MakeNode(Expr* old, Function fn, int argc, Expr** argv) {
+    Expr* e = ParseAlloc(sizeof(Expr));
+    e->fn = fn;
+    e->name = "(operator)";
+    e->argc = argc;
+    e->argv = argv;
+    return Replace(old, e);
+}
+
+// Evaluate e now if it's a call to a pure function with all-literal
+// arguments.  Returns the literal, or e if it can't be folded.
+static Expr* FoldPure(Expr* e) {
+    unsigned int i;
+    int j;
+    for (i = 0; i < sizeof(pure_functions) / sizeof(pure_functions[0]); ++i) {
+        if (pure_functions[i].fn == e->fn) break;
+    }
+    if (i == sizeof(pure_functions) / sizeof(pure_functions[0])) return e;
+    if (pure_functions[i].argc >= 0 && pure_functions[i].argc != e->argc) {
+        return e;
+    }
+    for (j = 0; j < e->argc; ++j) {
+        if (!IsLiteral(e->argv[j])) return e;
+    }
+
+    State state;
+    state.cookie = NULL;
+    state.script = "";
+    state.errmsg = NULL;
+    Value* v = e->fn(e->name, &state, e->argc, e->argv);
+    free(state.errmsg);
+    if (v == NULL) return e;   // leave the error for run time
+    if (v->type != VAL_STRING) {
+        FreeValue(v);
+        return e;
+    }
+    char* value = v->data;
+    free(v);
+    return MakeLiteral(e, value);
+}
+
+// Growable list of Exprs.
+typedef struct {
+    Expr** items;
+    int count;
+    int alloc;
+} ExprList;
+
+static void Append(ExprList* list, Expr* e) {
+    if (list->count >= list->alloc) {
+        list->alloc = list->alloc ? list->alloc * 2 : 8;
+        list->items = realloc(list->items, list->alloc * sizeof(Expr*));
+    }
+    list->items[list->count++] = e;
+}
+
+// Collect the operands of a tree of 'fn' nodes in order, without
+// recursing (sequences are as deep as the script is long).
+static void Collect(Expr* e, Function fn, ExprList* out) {
+    ExprList stack = { NULL, 0, 0 };
+    Append(&stack, e);
+    while (stack.count > 0) {
+        Expr* n = stack.items[--stack.count];
+        if (n->fn == fn && n->argc > 0) {
+            int i;
+            for (i = n->argc - 1; i >= 0; --i) {
+                Append(&stack, n->argv[i]);
+            }
+        } else {
+            Append(out, n);
+        }
+    }
+    free(stack.items);
+}
+
+static Expr* Optimize(Expr* e);
+
+static Expr* OptimizeSequence(Expr* e) {
+    ExprList stmts = { NULL, 0, 0 };
+    ExprList kept = { NULL, 0, 0 };
+    int i, j;
+
+    Collect(e, SequenceFn, &stmts);
+    for (i = 0; i < stmts.count; ++i) {
+        Expr* s = Optimize(stmts.items[i]);
+        bool last = (i == stmts.count - 1);
+        if (IsOperator(s, SequenceFn)) {
+            // Already flat; splice it in.
+            for (j = 0; j < s->argc; ++j) {
+                if (!IsLiteral(s->argv[j]) || (last && j == s->argc - 1)) {
+                    Append(&kept, s->argv[j]);
+                }
+            }
+        } else if (!IsLiteral(s) || last) {
+            Append(&kept, s);
+        }
+    }
+    free(stmts.items);
+
+    if (kept.count == 1) {
+        Expr* only = kept.items[0];
+        free(kept.items);
+        return Replace(e, only);
+    }
+    return MakeNode(e, SequenceFn, kept.count, kept.items);
+}
+
+static Expr* OptimizeConcat(Expr* e) {
+    ExprList parts = { NULL, 0, 0 };
+    ExprList kept = { NULL, 0, 0 };
+    int i;
+
+    Collect(e, ConcatFn, &parts);
+    for (i = 0; i < parts.count; ++i) {
+        Expr* p = Optimize(parts.items[i]);
+        Expr* prev = kept.count ? kept.items[kept.count-1] : NULL;
+        if (prev != NULL && IsLiteral(prev) && IsLiteral(p)) {
+            // Join adjacent literals.
+            size_t a = strlen(prev->name), b = strlen(p->name);
+            char* joined = malloc(a + b + 1);
+            memcpy(joined, prev->name, a);
+            memcpy(joined + a, p->name, b + 1);
+            Expr* lit = MakeLiteral(prev, joined);
+            lit->end = p->end;
+            kept.items[kept.count-1] = lit;
+        } else {
+            Append(&kept, p);
+        }
+    }
+    free(parts.items);
+
+    if (kept.count == 1 && IsLiteral(kept.items[0])) {
+        Expr* only = kept.items[0];
+        free(kept.items);
+        return Replace(e, only);
+    }
+    return MakeNode(e, ConcatFn, kept.count, kept.items);
+}
+
+static Expr* Optimize(Expr* e) {
+    int i;
+    if (IsLiteral(e)) return e;
+    if (IsOperator(e, SequenceFn)) return OptimizeSequence(e);
+    // An empty concat() is left for FoldPure(); Collect() would hand it
+    // back as its own operand.
+    if (IsOperator(e, ConcatFn) && e->argc > 0) return OptimizeConcat(e);
+
+    for (i = 0; i < e->argc; ++i) {
+        e->argv[i] = Optimize(e->argv[i]);
+    }
+
+    // Short-circuiting operators whose outcome is already decided by a
+    // literal on the left.
+    if (e->argc >= 1 && IsLiteral(e->argv[0])) {
+        bool cond = BooleanString(e->argv[0]->name);
+        if (IsOperator(e, LogicalAndFn) && e->argc == 2) {
+            return Replace(e, cond ? e->argv[1] : e->argv[0]);
+        }
+        if (IsOperator(e, LogicalOrFn) && e->argc == 2) {
+            return Replace(e, cond ? e->argv[0] : e->argv[1]);
+        }
+        if (IsOperator(e, IfElseFn) && (e->argc == 2 || e->argc == 3)) {
+            if (cond) return Replace(e, e->argv[1]);
+            return Replace(e, e->argc == 3 ? e->argv[2] : e->argv[0]);
+        }
+    }
+
+    return FoldPure(e);
+}
+
+Expr* OptimizeExpr(Expr* root) {
+    return Optimize(root);
+}
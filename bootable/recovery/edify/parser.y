@@ -66,7 +66,7 @@ input:  expr           { *root = $1; }
 ;
 
 expr:  STRING {
-    $$ = malloc(sizeof(Expr));
+    $$ = ParseAlloc(sizeof(Expr));
     $$->fn = Literal;
     $$->name = $1;
     $$->argc = 0;
@@ -87,7 +87,7 @@ expr:  STRING {
 |  IF expr THEN expr ENDIF           { $$ = Build(IfElseFn, @$, 2, $2, $4); }
 |  IF expr THEN expr ELSE expr ENDIF { $$ = Build(IfElseFn, @$, 3, $2, $4, $6); }
 | STRING '(' arglist ')' {
-    $$ = malloc(sizeof(Expr));
+    $$ = ParseAlloc(sizeof(Expr));
     $$->fn = FindFunction($1);
     if ($$->fn == NULL) {
         char buffer[256];
@@ -0,0 +1,170 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// A timing trace of the function calls made while evaluating a
+// script, in the Chrome trace-event format (load it in
+// chrome://tracing).  Each call is a begin/end pair of events on the
+// calling thread; the begin event carries the call's literal
+// arguments, the end event the bytes the process read and wrote
+// during the call (from /proc/self/io, so they include any threads
+// the function started, and the trace's own small reads and writes)
+// and whether it failed.
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "expr.h"
+
+// Literal arguments longer than this are cut short in the trace.
+#define TRACE_MAX_ARG 200
+
+typedef struct {
+    long long rchar;
+    long long wchar;
+} IoCounts;
+
+static FILE* trace_file = NULL;
+static int trace_events = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void ReadIoCounts(IoCounts* io) {
+    char buf[512];
+    io->rchar = io->wchar = -1;
+    int fd = open("/proc/self/io", O_RDONLY);
+    if (fd < 0) return;
+    ssize_t len = read(fd, buf, sizeof(buf)-1);
+    close(fd);
+    if (len <= 0) return;
+    buf[len] = '\0';
+
+    char* p;
+    if ((p = strstr(buf, "rchar: ")) != NULL) io->rchar = atoll(p + 7);
+    if ((p = strstr(buf, "wchar: ")) != NULL) io->wchar = atoll(p + 7);
+}
+
+static void WriteString(const char* s, size_t max) {
+    size_t i;
+    fputc('"', trace_file);
+    for (i = 0; s[i] != '\0' && i < max; ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            fprintf(trace_file, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(trace_file, "\\u%04x", c);
+        } else {
+            fputc(c, trace_file);
+        }
+    }
+    if (s[i] != '\0') fputs("...", trace_file);
+    fputc('"', trace_file);
+}
+
+// Start an event; the caller finishes the args object and the event.
+// Called with trace_lock held.
+static void StartEvent(const char* name, char phase, long long ts) {
+    fputs(trace_events++ ? ",\n" : "[\n", trace_file);
+    fputs("{\"name\":", trace_file);
+    WriteString(name, TRACE_MAX_ARG);
+    fprintf(trace_file, ",\"cat\":\"edify\",\"ph\":\"%c\",\"ts\":%lld,"
+            "\"pid\":%d,\"tid\":%d,\"args\":{",
+            phase, ts, (int)getpid(), (int)syscall(__NR_gettid));
+}
+
+// Begin writing a trace of every function call to 'path'.  Returns 0
+// on success.
+int TraceOpen(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "failed to open trace file %s\n", path);
+        return -1;
+    }
+    pthread_mutex_lock(&trace_lock);
+    trace_file = f;
+    trace_events = 0;
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+void TraceClose() {
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        fputs(trace_events ? "\n]\n" : "[]\n", trace_file);
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Evaluate expr, tracing the call if it's to a named function.
+Value* TraceCall(State* state, Expr* expr) {
+    if (trace_file == NULL || expr->fn == Literal ||
+        strcmp(expr->name, "(operator)") == 0) {
+        return expr->fn(expr->name, state, expr->argc, expr->argv);
+    }
+
+    int i;
+    IoCounts before, after;
+    ReadIoCounts(&before);
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        StartEvent(expr->name, 'B', Now());
+        fputs("\"args\":[", trace_file);
+        for (i = 0; i < expr->argc; ++i) {
+            Expr* arg = expr->argv[i];
+            if (i > 0) fputc(',', trace_file);
+            if (arg->fn == Literal) {
+                WriteString(arg->name, TRACE_MAX_ARG);
+            } else if (strcmp(arg->name, "(operator)") == 0) {
+                fputs("\"(expr)\"", trace_file);
+            } else {
+                fprintf(trace_file, "\"%s(...)\"", arg->name);
+            }
+        }
+        fputs("]}}", trace_file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    Value* result = expr->fn(expr->name, state, expr->argc, expr->argv);
+
+    ReadIoCounts(&after);
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file != NULL) {
+        StartEvent(expr->name, 'E', Now());
+        fprintf(trace_file, "\"failed\":%s", result == NULL ? "true" : "false");
+        if (before.rchar >= 0 && after.rchar >= 0) {
+            fprintf(trace_file, ",\"bytes_read\":%lld,\"bytes_written\":%lld",
+                    after.rchar - before.rchar, after.wchar - before.wchar);
+        }
+        fputs("}}", trace_file);
+        fflush(trace_file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    return result;
+}
@@ -2,7 +2,8 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
-	rk_emmcutils.c
+	rk_emmcutils.c \
+	emmc_write.c
 
 LOCAL_MODULE := librk_emmcutils
 LOCAL_STATIC_LIBRARIES = libcutils
@@ -0,0 +1,269 @@
+/*
+ * emmc_write.c
+ *
+ * Writing whole images to eMMC partitions.  Data is gathered into
+ * large aligned buffers and written with O_DIRECT, so gigabytes of
+ * image don't pass through (and then have to be flushed from) the
+ * page cache.  There are two buffers: one is written by a thread
+ * while the caller fills the other.  The device is flushed once, when
+ * the write is closed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "rk_emmcutils.h"
+
+#define EMMC_WRITE_BUFFER_SIZE (8 << 20)
+
+// O_DIRECT transfers must start at, and be a multiple of, the logical
+// block size in length, in memory aligned to it; 4k satisfies every
+// eMMC part.
+#define EMMC_WRITE_ALIGN 4096
+
+struct EmmcWriteContext {
+    int fd;
+    int direct;            // fd was opened with O_DIRECT
+    char* device;
+
+    char* buffer[2];
+    int cur;               // buffer being filled by the caller
+    size_t fill;           // bytes in buffer[cur]
+    off64_t offset;        // device offset for buffer[cur]
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int pending;           // buffer queued for the thread, or -1
+    size_t pending_len;
+    off64_t pending_offset;
+    int stop;
+    int error;             // errno of the first failed write
+};
+
+static int write_fully(int fd, const char* data, size_t len, off64_t offset) {
+    while (len > 0) {
+        ssize_t wrote = pwrite64(fd, data, len, offset);
+        if (wrote < 0 && errno == EINTR) continue;
+        if (wrote <= 0) {
+            return wrote < 0 ? errno : EIO;
+        }
+        data += wrote;
+        len -= wrote;
+        offset += wrote;
+    }
+    return 0;
+}
+
+static void* writer_thread(void* cookie) {
+    EmmcWriteContext* ctx = (EmmcWriteContext*)cookie;
+
+    pthread_mutex_lock(&ctx->lock);
+    for (;;) {
+        while (ctx->pending < 0 && !ctx->stop) {
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        }
+        if (ctx->pending < 0) break;
+
+        const char* data = ctx->buffer[ctx->pending];
+        size_t len = ctx->pending_len;
+        off64_t offset = ctx->pending_offset;
+        int failed = ctx->error;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (!failed) {
+            failed = write_fully(ctx->fd, data, len, offset);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (failed && !ctx->error) ctx->error = failed;
+        ctx->pending = -1;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+// Wait for the thread to finish with the buffer it has.  Returns the
+// error so far (0 if none).  Called with ctx->lock held.
+static int wait_idle(EmmcWriteContext* ctx) {
+    while (ctx->pending >= 0) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    }
+    return ctx->error;
+}
+
+// Hand the full current buffer to the thread and start on the other.
+static int submit_buffer(EmmcWriteContext* ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    int error = wait_idle(ctx);
+    if (!error) {
+        ctx->pending = ctx->cur;
+        ctx->pending_len = ctx->fill;
+        ctx->pending_offset = ctx->offset;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    ctx->offset += ctx->fill;
+    ctx->cur ^= 1;
+    ctx->fill = 0;
+    return error;
+}
+
+static void free_context(EmmcWriteContext* ctx) {
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    free(ctx->buffer[0]);
+    free(ctx->buffer[1]);
+    free(ctx->device);
+    free(ctx);
+}
+
+// Discard the first 'len' bytes of the device (all of it if len < 0),
+// so the controller knows their old contents needn't be preserved.
+// Only whole logical blocks are discarded: a partial last block holds
+// data past the end of the image that must survive.
+static void discard_range(int fd, const char* device, off64_t len) {
+    uint64_t range[2];
+    if (len < 0) {
+        uint64_t size;
+        if (ioctl(fd, BLKGETSIZE64, &size) != 0) {
+            printf("can't get size of %s: %s\n", device, strerror(errno));
+            return;
+        }
+        len = size;
+    }
+    int block_size;
+    if (ioctl(fd, BLKSSZGET, &block_size) != 0 || block_size <= 0) {
+        printf("can't get block size of %s: %s\n", device, strerror(errno));
+        return;
+    }
+    range[0] = 0;
+    range[1] = len - len % block_size;
+    if (range[1] == 0) return;
+    if (ioctl(fd, BLKDISCARD, &range) != 0) {
+        // Only a hint; the write goes ahead regardless.
+        printf("discard of %s failed: %s\n", device, strerror(errno));
+    }
+}
+
+// Open 'device' for writing an image from its start.  If discard_len
+// is nonzero, that many bytes (or the whole device, if negative) are
+// discarded first.  Returns NULL on failure.
+EmmcWriteContext* emmc_write_partition(const char* device, off64_t discard_len) {
+    EmmcWriteContext* ctx = calloc(1, sizeof(EmmcWriteContext));
+    if (ctx == NULL) return NULL;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    ctx->pending = -1;
+    ctx->device = strdup(device);
+
+    ctx->fd = open(device, O_WRONLY | O_DIRECT);
+    ctx->direct = 1;
+    if (ctx->fd < 0 && errno == EINVAL) {
+        // Not supported by this device (or filesystem, for images).
+        ctx->fd = open(device, O_WRONLY);
+        ctx->direct = 0;
+    }
+    if (ctx->fd < 0) {
+        printf("failed to open %s: %s\n", device, strerror(errno));
+        free_context(ctx);
+        return NULL;
+    }
+
+    ctx->buffer[0] = memalign(EMMC_WRITE_ALIGN, EMMC_WRITE_BUFFER_SIZE);
+    ctx->buffer[1] = memalign(EMMC_WRITE_ALIGN, EMMC_WRITE_BUFFER_SIZE);
+    if (ctx->buffer[0] == NULL || ctx->buffer[1] == NULL) {
+        printf("failed to allocate write buffers for %s\n", device);
+        close(ctx->fd);
+        free_context(ctx);
+        return NULL;
+    }
+
+    if (discard_len != 0) {
+        discard_range(ctx->fd, device, discard_len);
+    }
+
+    if (pthread_create(&ctx->thread, NULL, writer_thread, ctx) != 0) {
+        printf("failed to start writer for %s\n", device);
+        close(ctx->fd);
+        free_context(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+// Append 'len' bytes to the image.  Returns len, or -1 (with errno
+// set) if this or an earlier write failed.
+ssize_t emmc_write_data(EmmcWriteContext* ctx, const char* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        size_t n = EMMC_WRITE_BUFFER_SIZE - ctx->fill;
+        if (n > len - done) n = len - done;
+        memcpy(ctx->buffer[ctx->cur] + ctx->fill, data + done, n);
+        ctx->fill += n;
+        done += n;
+
+        if (ctx->fill == EMMC_WRITE_BUFFER_SIZE) {
+            int error = submit_buffer(ctx);
+            if (error) {
+                errno = error;
+                return -1;
+            }
+        }
+    }
+    return len;
+}
+
+// Write out whatever is buffered, flush the device and close it.
+// Returns 0 if everything was written.
+int emmc_write_close(EmmcWriteContext* ctx) {
+    pthread_mutex_lock(&ctx->lock);
+    int error = wait_idle(ctx);
+    ctx->stop = 1;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+    pthread_join(ctx->thread, NULL);
+
+    // The last buffer is usually partial.  Its aligned part can still
+    // go directly; the tail has to go through the page cache.
+    const char* data = ctx->buffer[ctx->cur];
+    size_t aligned = ctx->direct ? ctx->fill & ~(size_t)(EMMC_WRITE_ALIGN - 1)
+                                 : ctx->fill;
+    if (!error && aligned > 0) {
+        error = write_fully(ctx->fd, data, aligned, ctx->offset);
+    }
+    if (!error && aligned < ctx->fill) {
+        int flags = fcntl(ctx->fd, F_GETFL);
+        if (flags == -1 || fcntl(ctx->fd, F_SETFL, flags & ~O_DIRECT) != 0) {
+            error = errno;
+        } else {
+            error = write_fully(ctx->fd, data + aligned, ctx->fill - aligned,
+                                ctx->offset + aligned);
+        }
+    }
+
+    if (fsync(ctx->fd) != 0 && !error) {
+        error = errno;
+    }
+    if (close(ctx->fd) != 0 && !error) {
+        error = errno;
+    }
+
+    if (error) {
+        printf("error writing %s: %s\n", ctx->device, strerror(error));
+    }
+    free_context(ctx);
+    return error ? -1 : 0;
+}
@@ -8,8 +8,17 @@
 #ifndef RK_EMMCUTILS_H_
 #define RK_EMMCUTILS_H_
 
+#include <sys/types.h>
 
 int getEmmcState();
 int transformPath(const char *in, char *out);
 
+// Write an image to an eMMC partition through large aligned buffers,
+// bypassing the page cache where the device allows it.
+typedef struct EmmcWriteContext EmmcWriteContext;
+
+EmmcWriteContext *emmc_write_partition(const char *device, off64_t discard_len);
+ssize_t emmc_write_data(EmmcWriteContext *ctx, const char *data, size_t len);
+int emmc_write_close(EmmcWriteContext *ctx);
+
 #endif /* EMMCUTILS_H_ */
@@ -523,12 +523,16 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
 }
 
 /* Call processFunction on the uncompressed data of a STORED entry.
+ *
+ * Entries are read with pread() rather than through the fd's offset,
+ * so that several threads can read one archive at the same time.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
     void *cookie)
 {
     size_t bytesLeft = pEntry->compLen;
+    off_t offset = pEntry->offset;
     while (bytesLeft > 0) {
         unsigned char buf[32 * 1024];
         ssize_t n;
@@ -539,7 +543,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
         if (count > sizeof(buf)) {
             count = sizeof(buf);
         }
-        n = read(pArchive->fd, buf, count);
+        n = pread(pArchive->fd, buf, count, offset);
         if (n < 0 || (size_t)n != count) {
             LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
             return false;
@@ -549,6 +553,7 @@ static bool processStoredEntry(const ZipArchive *pArchive,
             return false;
         }
         bytesLeft -= count;
+        offset += count;
     }
     return true;
 }
@@ -563,6 +568,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
     z_stream zstream;
     int zerr;
     long compRemaining;
+    off_t offset = pEntry->offset;
 
     compRemaining = pEntry->compLen;
 
@@ -605,13 +611,14 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
             LOGVV("+++ reading %ld bytes (%ld left)\n",
                 getSize, compRemaining);
 
-            int cc = read(pArchive->fd, readBuf, getSize);
+            int cc = pread(pArchive->fd, readBuf, getSize, offset);
             if (cc != (int) getSize) {
                 LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
                 goto z_bail;
             }
 
             compRemaining -= getSize;
+            offset += getSize;
 
             zstream.next_in = readBuf;
             zstream.avail_in = getSize;
@@ -674,13 +681,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
 
     switch (pEntry->compression) {
     case STORED:
@@ -695,8 +695,6 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
     return ret;
 }
 
@@ -8,7 +8,7 @@ ifeq ($(TARGET_ROCHCHIP_RECOVERY),true)
 # TARGET_BOARD_PLATFORM is change from rockchip to rk29xx or rk30xx
 # so force TARGET_BOARD_PLATFORM to be rockchip in recovery cpp file
 LOCAL_CFLAGS += -DTARGET_BOARD_PLATFORM=rockchip
-LOCAL_SRC_FILES += rk29.c
+LOCAL_SRC_FILES += rk29.c ext4_grow.c
 endif # TARGET_BOARD_PLATFORM == rockchip
 
 LOCAL_MODULE := libmtdutils
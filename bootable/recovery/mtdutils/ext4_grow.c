@@ -0,0 +1,389 @@
+/*
+ * Copyright (C) 2007 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Growing an ext2/3/4 filesystem to fill its device without running
+// e2fsck and resize2fs.
+//
+// A filesystem image is usually a little smaller than the partition
+// it's written to, by less than a block group.  Growing it then only
+// means lengthening the last group: the new blocks are free, nothing
+// moves, and no group descriptors are added.  So the superblock
+// counts, the last group's descriptor and its block bitmap are
+// updated in place (and in the backups), after checking that those
+// agree with each other.  Anything else -- a filesystem that wasn't
+// cleanly unmounted, growth that needs new groups, or features whose
+// metadata this doesn't know how to update -- is left to resize2fs.
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "rk29.h"
+
+#define SUPERBLOCK_OFFSET 1024
+#define SUPERBLOCK_SIZE 1024
+
+// Superblock fields.
+#define S_BLOCKS_COUNT       0x04
+#define S_R_BLOCKS_COUNT     0x08
+#define S_FREE_BLOCKS_COUNT  0x0C
+#define S_FIRST_DATA_BLOCK   0x14
+#define S_LOG_BLOCK_SIZE     0x18
+#define S_BLOCKS_PER_GROUP   0x20
+#define S_MAGIC              0x38
+#define S_STATE              0x3A
+#define S_REV_LEVEL          0x4C
+#define S_FEATURE_COMPAT     0x5C
+#define S_FEATURE_INCOMPAT   0x60
+#define S_FEATURE_RO_COMPAT  0x64
+#define S_UUID               0x68
+
+#define EXT4_MAGIC 0xEF53
+#define EXT4_VALID_FS 0x0001
+#define EXT4_ERROR_FS 0x0002
+
+#define COMPAT_SPARSE_SUPER2       0x0200
+#define INCOMPAT_SUPPORTED         (0x0002 |  /* filetype */        \
+                                    0x0040 |  /* extents */         \
+                                    0x0200 |  /* flex_bg */         \
+                                    0x4000 |  /* large_dir */       \
+                                    0x8000)   /* inline_data */
+#define RO_COMPAT_SPARSE_SUPER     0x0001
+#define RO_COMPAT_GDT_CSUM         0x0010
+#define RO_COMPAT_SUPPORTED        (0x007f | 0x0100)   /* up to extra_isize; quota */
+
+// Group descriptor fields (32-byte descriptors only).
+#define GROUP_DESC_SIZE      32
+#define BG_BLOCK_BITMAP      0x00
+#define BG_FREE_BLOCKS_COUNT 0x0C
+#define BG_FLAGS             0x12
+#define BG_CHECKSUM          0x1E
+
+#define BG_BLOCK_UNINIT 0x0002
+
+typedef struct {
+    int fd;
+    uint8_t sb[SUPERBLOCK_SIZE];
+    uint32_t block_size;
+    uint32_t first_data_block;
+    uint32_t blocks_per_group;
+    uint32_t blocks_count;
+    uint32_t group_count;
+} Fs;
+
+static uint32_t get16(const uint8_t* p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put16(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static int read_at(int fd, void* buf, size_t len, off64_t offset) {
+    if (pread64(fd, buf, len, offset) != (ssize_t)len) {
+        printf("ext4_grow: read at %lld failed: %s\n",
+               (long long)offset, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int write_at(int fd, const void* buf, size_t len, off64_t offset) {
+    if (pwrite64(fd, buf, len, offset) != (ssize_t)len) {
+        printf("ext4_grow: write at %lld failed: %s\n",
+               (long long)offset, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// The checksum of group descriptors with the gdt_csum feature (CRC16,
+// reflected polynomial 0x8005).
+static uint16_t crc16(uint16_t crc, const uint8_t* p, size_t len) {
+    int k;
+    while (len--) {
+        crc ^= *p++;
+        for (k = 0; k < 8; ++k) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+static uint16_t group_desc_csum(const Fs* fs, uint32_t group,
+                                const uint8_t* desc) {
+    uint8_t le_group[4];
+    put32(le_group, group);
+    uint16_t crc = crc16(0xffff, fs->sb + S_UUID, 16);
+    crc = crc16(crc, le_group, 4);
+    return crc16(crc, desc, BG_CHECKSUM);
+}
+
+// Does this group hold a backup of the superblock and descriptors?
+static int has_backup(const Fs* fs, uint32_t group) {
+    uint32_t bases[] = { 3, 5, 7 };
+    int i;
+    if (group <= 1) return 1;
+    if (!(get32(fs->sb + S_FEATURE_RO_COMPAT) & RO_COMPAT_SPARSE_SUPER)) {
+        return 1;
+    }
+    for (i = 0; i < 3; ++i) {
+        uint32_t n = bases[i];
+        while (n < group) n *= bases[i];
+        if (n == group) return 1;
+    }
+    return 0;
+}
+
+// Byte offset of the copy of the last group's descriptor in the
+// descriptor table that follows the superblock in 'group'.
+static off64_t last_desc_offset(const Fs* fs, uint32_t group) {
+    off64_t table = (off64_t)group * fs->blocks_per_group +
+                    fs->first_data_block + 1;
+    return table * fs->block_size +
+           (off64_t)(fs->group_count - 1) * GROUP_DESC_SIZE;
+}
+
+static int load_superblock(Fs* fs) {
+    uint8_t* sb = fs->sb;
+    if (read_at(fs->fd, sb, SUPERBLOCK_SIZE, SUPERBLOCK_OFFSET) < 0) {
+        return -1;
+    }
+    if (get16(sb + S_MAGIC) != EXT4_MAGIC) {
+        printf("ext4_grow: not an ext2/3/4 filesystem\n");
+        return -1;
+    }
+    uint32_t state = get16(sb + S_STATE);
+    if (!(state & EXT4_VALID_FS) || (state & EXT4_ERROR_FS)) {
+        printf("ext4_grow: filesystem needs checking\n");
+        return -1;
+    }
+    if (get32(sb + S_REV_LEVEL) < 1) {
+        printf("ext4_grow: old revision filesystem\n");
+        return -1;
+    }
+    uint32_t incompat = get32(sb + S_FEATURE_INCOMPAT);
+    uint32_t ro_compat = get32(sb + S_FEATURE_RO_COMPAT);
+    if ((incompat & ~INCOMPAT_SUPPORTED) ||
+        (ro_compat & ~RO_COMPAT_SUPPORTED) ||
+        (get32(sb + S_FEATURE_COMPAT) & COMPAT_SPARSE_SUPER2)) {
+        printf("ext4_grow: unsupported features (incompat 0x%x ro_compat 0x%x)\n",
+               incompat, ro_compat);
+        return -1;
+    }
+
+    uint32_t log_block_size = get32(sb + S_LOG_BLOCK_SIZE);
+    if (log_block_size > 6) {
+        printf("ext4_grow: bad block size\n");
+        return -1;
+    }
+    fs->block_size = 1024 << log_block_size;
+    fs->first_data_block = get32(sb + S_FIRST_DATA_BLOCK);
+    fs->blocks_per_group = get32(sb + S_BLOCKS_PER_GROUP);
+    fs->blocks_count = get32(sb + S_BLOCKS_COUNT);
+    if (fs->blocks_per_group == 0 ||
+        fs->blocks_per_group > fs->block_size * 8 ||
+        fs->blocks_count <= fs->first_data_block ||
+        fs->first_data_block != (fs->block_size == 1024 ? 1u : 0u)) {
+        printf("ext4_grow: bad superblock geometry\n");
+        return -1;
+    }
+    fs->group_count = (fs->blocks_count - fs->first_data_block +
+                       fs->blocks_per_group - 1) / fs->blocks_per_group;
+    return 0;
+}
+
+// Grow the ext2/3/4 filesystem on 'filename' to fill the device, if
+// that can be done within its last block group.  Returns 0 if the
+// filesystem now fills the device, or -1 (having changed nothing, or
+// at worst left the free counts behind the bitmap) if it couldn't;
+// the caller should then fall back to e2fsck and resize2fs.
+int rk_grow_ext4fs(const char *filename)
+{
+    Fs fs;
+    uint8_t desc[GROUP_DESC_SIZE];
+    uint8_t* bitmap = NULL;
+    uint8_t* table = NULL;
+    int result = -1;
+    uint32_t i;
+
+    // O_EXCL keeps us off a block device that's mounted.
+    fs.fd = open(filename, O_RDWR | O_EXCL);
+    if (fs.fd < 0) {
+        printf("ext4_grow: can't open %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (load_superblock(&fs) < 0) goto done;
+
+    off64_t device_size = lseek64(fs.fd, 0, SEEK_END);
+    if (device_size < 0) {
+        printf("ext4_grow: can't size %s: %s\n", filename, strerror(errno));
+        goto done;
+    }
+    uint64_t new_count = device_size / fs.block_size;
+    if (new_count > 0xffffffffULL) new_count = 0xffffffffULL;
+    if (new_count <= fs.blocks_count) {
+        printf("ext4_grow: %s already fills the device (%u blocks)\n",
+               filename, fs.blocks_count);
+        result = 0;
+        goto done;
+    }
+
+    uint32_t last = fs.group_count - 1;
+    uint32_t group_start = fs.first_data_block + last * fs.blocks_per_group;
+    uint32_t old_len = fs.blocks_count - group_start;
+    if (new_count - group_start > fs.blocks_per_group) {
+        printf("ext4_grow: growing %s from %u to %llu blocks needs new groups\n",
+               filename, fs.blocks_count, (unsigned long long)new_count);
+        goto done;
+    }
+    uint32_t new_len = new_count - group_start;
+    uint32_t added = new_len - old_len;
+    int gdt_csum = get32(fs.sb + S_FEATURE_RO_COMPAT) & RO_COMPAT_GDT_CSUM;
+
+    // Check the metadata about to change: the descriptor table (and
+    // its checksums), and the last group's bitmap against its free
+    // count, with the blocks beyond the old end marked as in use.
+    size_t table_size = fs.group_count * GROUP_DESC_SIZE;
+    table = malloc(table_size);
+    off64_t table_offset = (off64_t)(fs.first_data_block + 1) * fs.block_size;
+    if (table == NULL || read_at(fs.fd, table, table_size, table_offset) < 0) {
+        goto done;
+    }
+    uint64_t free_blocks = 0;
+    for (i = 0; i < fs.group_count; ++i) {
+        const uint8_t* d = table + i * GROUP_DESC_SIZE;
+        if (gdt_csum && get16(d + BG_CHECKSUM) != group_desc_csum(&fs, i, d)) {
+            printf("ext4_grow: bad checksum on group %u descriptor\n", i);
+            goto done;
+        }
+        free_blocks += get16(d + BG_FREE_BLOCKS_COUNT);
+    }
+    memcpy(desc, table + last * GROUP_DESC_SIZE, GROUP_DESC_SIZE);
+
+    int uninit = gdt_csum && (get16(desc + BG_FLAGS) & BG_BLOCK_UNINIT);
+    off64_t bitmap_offset = (off64_t)get32(desc + BG_BLOCK_BITMAP) * fs.block_size;
+    if (!uninit) {
+        if (get32(desc + BG_BLOCK_BITMAP) >= fs.blocks_count) {
+            printf("ext4_grow: last group's bitmap is outside the filesystem\n");
+            goto done;
+        }
+        bitmap = malloc(fs.block_size);
+        if (bitmap == NULL ||
+            read_at(fs.fd, bitmap, fs.block_size, bitmap_offset) < 0) {
+            goto done;
+        }
+        uint32_t unused = 0;
+        for (i = 0; i < old_len; ++i) {
+            if (!(bitmap[i / 8] & (1 << (i % 8)))) ++unused;
+        }
+        if (unused != get16(desc + BG_FREE_BLOCKS_COUNT)) {
+            printf("ext4_grow: last group has %u free blocks, descriptor says %u\n",
+                   unused, get16(desc + BG_FREE_BLOCKS_COUNT));
+            goto done;
+        }
+        for (i = old_len; i < new_len; ++i) {
+            if (!(bitmap[i / 8] & (1 << (i % 8)))) {
+                printf("ext4_grow: block %u past the end is marked free\n",
+                       group_start + i);
+                goto done;
+            }
+            bitmap[i / 8] &= ~(1 << (i % 8));
+        }
+    }
+
+    // The new descriptor and superblock.
+    if (get16(desc + BG_FREE_BLOCKS_COUNT) + added > 0xffff) {
+        printf("ext4_grow: last group's free count would overflow\n");
+        goto done;
+    }
+    put16(desc + BG_FREE_BLOCKS_COUNT, get16(desc + BG_FREE_BLOCKS_COUNT) + added);
+    if (gdt_csum) put16(desc + BG_CHECKSUM, group_desc_csum(&fs, last, desc));
+
+    uint32_t old_count = fs.blocks_count;
+    uint64_t reserved = (uint64_t)get32(fs.sb + S_R_BLOCKS_COUNT) * new_count /
+                        old_count;
+    put32(fs.sb + S_BLOCKS_COUNT, new_count);
+    put32(fs.sb + S_R_BLOCKS_COUNT, reserved);
+    put32(fs.sb + S_FREE_BLOCKS_COUNT, free_blocks + added);
+
+    // Primary copies first: until the bitmap is written the new blocks
+    // are merely unusable.
+    if (write_at(fs.fd, desc, GROUP_DESC_SIZE, last_desc_offset(&fs, 0)) < 0 ||
+        write_at(fs.fd, fs.sb, SUPERBLOCK_SIZE, SUPERBLOCK_OFFSET) < 0 ||
+        fsync(fs.fd) < 0) {
+        goto done;
+    }
+    if (!uninit &&
+        (write_at(fs.fd, bitmap, fs.block_size, bitmap_offset) < 0 ||
+         fsync(fs.fd) < 0)) {
+        goto done;
+    }
+
+    // The backups keep their own group number and so on; only the
+    // counts change.
+    for (i = 1; i < fs.group_count; ++i) {
+        if (!has_backup(&fs, i)) continue;
+        uint8_t backup[SUPERBLOCK_SIZE];
+        off64_t sb_offset = ((off64_t)i * fs.blocks_per_group +
+                             fs.first_data_block) * fs.block_size;
+        if (read_at(fs.fd, backup, SUPERBLOCK_SIZE, sb_offset) < 0) goto done;
+        if (get16(backup + S_MAGIC) != EXT4_MAGIC) {
+            printf("ext4_grow: no backup superblock in group %u\n", i);
+            continue;
+        }
+        memcpy(backup + S_BLOCKS_COUNT, fs.sb + S_BLOCKS_COUNT, 4);
+        memcpy(backup + S_R_BLOCKS_COUNT, fs.sb + S_R_BLOCKS_COUNT, 4);
+        memcpy(backup + S_FREE_BLOCKS_COUNT, fs.sb + S_FREE_BLOCKS_COUNT, 4);
+        if (write_at(fs.fd, backup, SUPERBLOCK_SIZE, sb_offset) < 0 ||
+            write_at(fs.fd, desc, GROUP_DESC_SIZE, last_desc_offset(&fs, i)) < 0) {
+            goto done;
+        }
+    }
+    if (fsync(fs.fd) < 0) {
+        printf("ext4_grow: fsync of %s failed: %s\n", filename, strerror(errno));
+        goto done;
+    }
+
+    printf("ext4_grow: grew %s from %u to %llu blocks\n",
+           filename, old_count, (unsigned long long)new_count);
+    result = 0;
+
+  done:
+    free(bitmap);
+    free(table);
+    close(fs.fd);
+    return result;
+}
@@ -10,11 +10,21 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <linux/fs.h>
 #include <errno.h>
 #include "mtdutils.h"
 #include "rk29.h"
 
-int run(const char *filename, char *const argv[])
+#ifndef BLKDISCARDZEROES
+#define BLKDISCARDZEROES _IO(0x12,124)
+#endif
+
+// Run a program and wait for it.  Returns its exit status, or -1 if it
+// couldn't be run.
+int run_status(const char *filename, char *const argv[])
 {
     struct stat s;
     int status;
@@ -53,7 +63,58 @@ int run(const char *filename, char *const argv[])
     }
 
     printf("executed '%s' return %d\n", filename, WEXITSTATUS(status));
-    return 0;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Like run_status(), but only fails if the program couldn't be run.
+int run(const char *filename, char *const argv[])
+{
+    return run_status(filename, argv) == -1 ? -1 : 0;
+}
+
+#define EXT4_BLOCK_SIZE 4096
+
+// Work out how much of a block device a filesystem should cover from
+// the fstab length: all of it if len is 0, the first len bytes if len
+// is positive, or all but the last -len bytes (a crypto footer, say)
+// if it's negative.  Returns the size in bytes, a whole number of
+// filesystem blocks, or 0 if there's no room.
+static uint64_t fs_size(int fd, const char *filename, long long len)
+{
+    uint64_t device_size;
+    if (ioctl(fd, BLKGETSIZE64, &device_size) != 0) {
+        printf("can't get size of '%s': %s\n", filename, strerror(errno));
+        return 0;
+    }
+    uint64_t size = device_size;
+    if (len > 0 && (uint64_t)len < device_size) {
+        size = len;
+    } else if (len < 0) {
+        size = (uint64_t)-len < device_size ? device_size + len : 0;
+    }
+    return size - size % EXT4_BLOCK_SIZE;
+}
+
+// Discard the first 'size' bytes of a block device before it's
+// formatted, so the controller can drop their old contents.  Returns
+// 1 if the discarded blocks are known to read back as zeros, 0 if
+// not, or -1 if they couldn't be discarded.
+static int discard_device(int fd, const char *filename, uint64_t size)
+{
+    uint64_t range[2];
+    unsigned int zeroes = 0;
+    range[0] = 0;
+    range[1] = size;
+    if (ioctl(fd, BLKDISCARD, &range) != 0) {
+        printf("discard of '%s' failed: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (ioctl(fd, BLKDISCARDZEROES, &zeroes) != 0) {
+        zeroes = 0;
+    }
+    printf("discarded %llu bytes of '%s'%s\n", (unsigned long long)size,
+           filename, zeroes ? " (reads back as zeros)" : "");
+    return zeroes ? 1 : 0;
 }
 
 //int rk_make_ext4fs(const char *filename, s64 len)
@@ -67,10 +128,45 @@ int rk_make_ext4fs(const char *filename,long long len, const char *mountpoint)
 {
 	int result;
 
-    const char *const mke2fs_argv[] = { "/sbin/mke2fs", "-t", "ext4", "-b", "4096", "-O", "^huge_file", "-m", "0", "-q", filename, NULL };
-    const char *const e2fsck_argv[] = { "/sbin/e2fsck", "-fy", filename, NULL };
     printf("format '%s' to ext4 filesystem\n", filename);
-    result = run(mke2fs_argv[0], (char **) mke2fs_argv);
+
+    // Only the part of the device the filesystem covers is discarded
+    // and formatted; anything reserved past it is left alone.
+    int fd = open(filename, O_WRONLY);
+    if (fd < 0) {
+        printf("can't open '%s': %s\n", filename, strerror(errno));
+        return -1;
+    }
+    uint64_t size = fs_size(fd, filename, len);
+    if (size == 0) {
+        printf("no room for a filesystem on '%s' (length %lld)\n",
+               filename, len);
+        close(fd);
+        return -1;
+    }
+    char blocks[32];
+    snprintf(blocks, sizeof(blocks), "%llu",
+             (unsigned long long)(size / EXT4_BLOCK_SIZE));
+
+    // Discard the device ourselves and have mke2fs leave the inode
+    // tables (and, if the discard zeroed them, the journal) for the
+    // kernel to initialize lazily, so it writes only the metadata it
+    // needs instead of zeroing most of the partition.
+    int zeroes = discard_device(fd, filename, size);
+    close(fd);
+
+    const char *const mke2fs_argv[] = { "/sbin/mke2fs", "-t", "ext4", "-b", "4096", "-O", "^huge_file", "-m", "0", "-q", filename, blocks, NULL };
+    const char *const e2fsck_argv[] = { "/sbin/e2fsck", "-fy", filename, NULL };
+    const char *lazy_opts = zeroes > 0 ?
+            "nodiscard,lazy_itable_init=1,lazy_journal_init=1" :
+            "nodiscard,lazy_itable_init=1";
+    const char *const fast_mke2fs_argv[] = { "/sbin/mke2fs", "-t", "ext4", "-b", "4096", "-O", "^huge_file,uninit_bg", "-E", lazy_opts, "-m", "0", "-q", filename, blocks, NULL };
+    result = run_status(fast_mke2fs_argv[0], (char **) fast_mke2fs_argv);
+    if(result > 0) {
+        // Older mke2fs doesn't know all of those options.
+        printf("fast format of '%s' failed; formatting in full\n", filename);
+        result = run(mke2fs_argv[0], (char **) mke2fs_argv);
+    }
     if(result) {
     	printf("format '%s' to ext4 error!\n", filename);
     	return result;
@@ -99,6 +195,12 @@ int rk_check_and_resizefs(const char *filename) {
 	const char *const e2fsck_argv[] = { "/sbin/e2fsck", "-fy", filename, NULL };
 	const char *const resizefs_argv[] = { "/sbin/resize2fs", filename, NULL  };
 
+	// Usually the filesystem only has to grow into the rest of its
+	// last block group, which doesn't need a full check.
+	if (rk_grow_ext4fs(filename) == 0) {
+		return 0;
+	}
+
 	result = run(e2fsck_argv[0], (char **) e2fsck_argv);
 	if(result) {
 		printf("e2fsck check '%s' failed!\n", filename);
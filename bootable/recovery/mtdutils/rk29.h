@@ -30,8 +30,10 @@ extern "C" {
 #define WRITE_MASK (WRITE_SIZE - 1)
 
 int run(const char *filename, char *const argv[]);
+int run_status(const char *filename, char *const argv[]);
 int rk_make_ext3fs(const char *filename);
 int rk_check_and_resizefs(const char *filename);
+int rk_grow_ext4fs(const char *filename);
 int rk_make_ext4fs(const char *filename, long long len, const char *mountpoint);
 size_t rk29_fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
 size_t rk29_fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
@@ -76,12 +76,14 @@ static const char *INTENT_FILE = "/cache/recovery/intent";
 static const char *LOG_FILE = "/cache/recovery/log";
 static const char *LAST_LOG_FILE = "/cache/recovery/last_log";
 static const char *LAST_INSTALL_FILE = "/cache/recovery/last_install";
+static const char *LAST_TRACE_FILE = "/cache/recovery/last_update_trace.json";
 static const char *LOCALE_FILE = "/cache/recovery/last_locale";
 static const char *CACHE_ROOT = "/cache";
 static const char *USB_ROOT = "/mnt/usb_storage";
 //static const char *SDCARD_ROOT = "/sdcard";
 static const char *TEMPORARY_LOG_FILE = "/tmp/recovery.log";
 static const char *TEMPORARY_INSTALL_FILE = "/tmp/last_install";
+static const char *TEMPORARY_TRACE_FILE = "/tmp/update_trace.json";
 static const char *SIDELOAD_TEMP_DIR = "/tmp/sideload";
 static const char *AUTO_FACTORY_UPDATE_TAG = "/FirmwareUpdate/auto_sd_update.tag";
 static const char *AUTO_FACTORY_UPDATE_PACKAGE = "/FirmwareUpdate/update.img";
@@ -525,6 +527,10 @@ finish_recovery(const char *send_intent) {
     copy_log_file(TEMPORARY_LOG_FILE, LOG_FILE, true);
     copy_log_file(TEMPORARY_LOG_FILE, LAST_LOG_FILE, false);
     copy_log_file(TEMPORARY_INSTALL_FILE, LAST_INSTALL_FILE, false);
+    if (access(TEMPORARY_TRACE_FILE, F_OK) == 0) {
+        copy_log_file(TEMPORARY_TRACE_FILE, LAST_TRACE_FILE, false);
+        chmod(LAST_TRACE_FILE, 0644);
+    }
     chmod(LOG_FILE, 0600);
     chown(LOG_FILE, 1000, 1000);   // system user
     chmod(LAST_LOG_FILE, 0640);
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "testutil.h"
+
+int test_failures = 0;
+
+static char scratch[FILENAME_MAX];
+static int made_scratch = 0;
+
+const char* TestScratchDir(int argc, char** argv, const char* name) {
+    if (argc > 1) return argv[1];
+    snprintf(scratch, sizeof(scratch), "/data/local/tmp/%s.XXXXXX", name);
+    if (mkdtemp(scratch) == NULL) {
+        printf("failed to make scratch directory: %s\n", strerror(errno));
+        return NULL;
+    }
+    made_scratch = 1;
+    return scratch;
+}
+
+int TestFinish() {
+    if (made_scratch) rmdir(scratch);
+    if (test_failures > 0) {
+        printf("FAILURE (%d)\n", test_failures);
+        return 1;
+    }
+    printf("SUCCESS\n");
+    return 0;
+}
+
+static void Put2(FILE* f, unsigned int v) {
+    fputc(v & 0xff, f);
+    fputc((v >> 8) & 0xff, f);
+}
+
+static void Put4(FILE* f, unsigned int v) {
+    Put2(f, v & 0xffff);
+    Put2(f, v >> 16);
+}
+
+int WriteStoredZip(const char* path, const TestZipEntry* entries, int count) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) return -1;
+    unsigned int* offsets = malloc(count * sizeof(unsigned int));
+    unsigned int* crcs = malloc(count * sizeof(unsigned int));
+    if (offsets == NULL || crcs == NULL) {
+        free(offsets);
+        free(crcs);
+        fclose(f);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        const TestZipEntry* e = entries + i;
+        offsets[i] = ftell(f);
+        crcs[i] = crc32(0, (const unsigned char*)e->data, e->len);
+        Put4(f, 0x04034b50);                    // local header
+        Put2(f, 10);                            // version needed
+        Put2(f, 0);                             // flags
+        Put2(f, 0);                             // stored
+        Put4(f, 0);                             // time and date
+        Put4(f, crcs[i]);
+        Put4(f, e->len);                        // compressed size
+        Put4(f, e->len);                        // size
+        Put2(f, strlen(e->name));
+        Put2(f, 0);                             // extra length
+        fputs(e->name, f);
+        fwrite(e->data, 1, e->len, f);
+    }
+
+    unsigned int cd_start = ftell(f);
+    for (i = 0; i < count; ++i) {
+        const TestZipEntry* e = entries + i;
+        Put4(f, 0x02014b50);                    // central directory entry
+        Put2(f, 10);                            // version made by
+        Put2(f, 10);                            // version needed
+        Put2(f, 0);                             // flags
+        Put2(f, 0);                             // stored
+        Put4(f, 0);                             // time and date
+        Put4(f, crcs[i]);
+        Put4(f, e->len);                        // compressed size
+        Put4(f, e->len);                        // size
+        Put2(f, strlen(e->name));
+        Put2(f, 0);                             // extra length
+        Put2(f, 0);                             // comment length
+        Put2(f, 0);                             // disk number
+        Put2(f, 0);                             // internal attributes
+        Put4(f, 0);                             // external attributes
+        Put4(f, offsets[i]);
+        fputs(e->name, f);
+    }
+    unsigned int cd_size = ftell(f) - cd_start;
+
+    Put4(f, 0x06054b50);                        // end of central directory
+    Put2(f, 0);                                 // this disk
+    Put2(f, 0);                                 // disk with the directory
+    Put2(f, count);                             // entries on this disk
+    Put2(f, count);                             // entries
+    Put4(f, cd_size);
+    Put4(f, cd_start);
+    Put2(f, 0);                                 // comment length
+
+    free(offsets);
+    free(crcs);
+    return fclose(f);
+}
@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_TESTUTIL_H
+#define _RECOVERY_TESTUTIL_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+// Shared by the standalone test executables (freecache_test,
+// blockimg_test, ...).  Each is run as
+//
+//   <name> [<scratch-dir>]
+//
+// and prints "SUCCESS" or "FAILURE (<count>)" at the end.
+
+extern int test_failures;
+
+#define EXPECT(cond) do {                                               \
+        if (!(cond)) {                                                  \
+            printf("  FAILED at line %d: %s\n", __LINE__, #cond);       \
+            ++test_failures;                                            \
+        }                                                               \
+    } while (0)
+
+// Return the scratch directory named on the command line, or make a
+// new one under /data/local/tmp if there isn't one.  Returns NULL if
+// it can't be made.
+const char* TestScratchDir(int argc, char** argv, const char* name);
+
+// Remove the scratch directory if TestScratchDir() made it, report
+// the result, and return the exit status for main().
+int TestFinish();
+
+typedef struct {
+    const char* name;
+    const void* data;
+    size_t len;
+} TestZipEntry;
+
+// Write a zip at 'path' holding the given entries, stored rather than
+// deflated.  Returns 0 on success.
+int WriteStoredZip(const char* path, const TestZipEntry* entries, int count);
+
+#endif
@@ -4,6 +4,10 @@ LOCAL_PATH := $(call my-dir)
 
 updater_src_files := \
 	install.c \
+	blockimg.c \
+	digest.c \
+	metadata.c \
+	parallel.c \
 	updater.c
 
 #
@@ -39,6 +43,7 @@ LOCAL_STATIC_LIBRARIES += libmincrypt libbz
 LOCAL_STATIC_LIBRARIES += libminelf
 LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc librk_emmcutils
 LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_C_INCLUDES += external/zlib
 
 # Each library in TARGET_RECOVERY_UPDATER_LIBS should have a function
 # named "Register_<libname>()".  Here we emit a little C function that
@@ -84,3 +89,44 @@ LOCAL_MODULE := updater
 LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := blockimg_test.c blockimg.c parallel.c
+LOCAL_MODULE := blockimg_test
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES += librecovery_testutil
+LOCAL_STATIC_LIBRARIES += libapplypatch libedify libmtdutils libminzip libz
+LOCAL_STATIC_LIBRARIES += libmincrypt libbz libminelf
+ifeq ($(RECOVERY_PATCH_USE_ZSTD), true)
+LOCAL_STATIC_LIBRARIES += libzstd
+endif
+LOCAL_STATIC_LIBRARIES += libcutils libstdc++ libc librk_emmcutils
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := metadata_test.c metadata.c
+LOCAL_MODULE := metadata_test
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES += librecovery_testutil
+LOCAL_STATIC_LIBRARIES += libedify libminzip libmincrypt libz libcutils libc
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := parallel_test.c parallel.c
+LOCAL_MODULE := parallel_test
+LOCAL_FORCE_STATIC_EXECUTABLE := true
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
+LOCAL_STATIC_LIBRARIES += librecovery_testutil
+LOCAL_STATIC_LIBRARIES += libedify libz libcutils libc
+
+include $(BUILD_EXECUTABLE)
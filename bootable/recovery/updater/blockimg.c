@@ -0,0 +1,876 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * block_image_update() updates a partition by applying a "transfer
+ * list" to its block device, instead of patching the files of a
+ * mounted filesystem one at a time.  Every command reads and writes
+ * whole 4k blocks, the target blocks are written more or less in
+ * order, and nothing is saved to /cache, so the time an update takes
+ * depends only on how much of the partition changes.
+ *
+ * The transfer list is text.  The first line is the format version (1
+ * or 2), the second the total number of blocks that will be written,
+ * which is used for progress.  Version 2 adds two more header lines:
+ * the most stash entries and the most stashed blocks needed at any one
+ * time; a list that tries to stash more than that is rejected.  Each
+ * remaining line is one command:
+ *
+ *   erase <tgt>          discard the blocks
+ *   zero <tgt>           fill the blocks with zeros
+ *   new <tgt>            fill the blocks with the next bytes of the
+ *                        package's new data entry
+ *   move <src> <tgt>     copy blocks
+ *   bsdiff <offset> <length> <src> <tgt>
+ *   imgdiff <offset> <length> <src> <tgt>
+ *                        apply the bsdiff or imgdiff patch found at
+ *                        <offset> in the package's patch data entry to
+ *                        the source blocks, giving the target blocks
+ *   stash <id> <ranges>  (version 2) keep a copy of the blocks in
+ *                        memory
+ *   free <id>            (version 2) drop a stash entry
+ *
+ * A range set is written "<n>,<a1>,<b1>,<a2>,<b2>,...", where n is the
+ * count of numbers after it and each pair covers blocks [a, b).
+ *
+ * In version 1, <src> is a range set.  In version 2, move, bsdiff and
+ * imgdiff take <tgt> first, followed by a source in one of the forms
+ *
+ *   <count> <ranges>
+ *   <count> <ranges> <locs> <id>:<ranges> ...
+ *   <count> - <id>:<ranges> ...
+ *
+ * <count> is the size of the source in blocks and <ranges> the blocks
+ * to read from the partition.  When part of the source comes from the
+ * stash, <locs> says where in the source the blocks read from the
+ * partition go, and each <id>:<ranges> says where the blocks of that
+ * stash entry go.  Stashing lets the generator break the cycles that
+ * arise when two commands each overwrite the other's source.
+ *
+ * These are versions 1 and 2 of the format written by the AOSP block
+ * image generator.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "applypatch/applypatch.h"
+#include "edify/expr.h"
+#include "mincrypt/sha.h"
+#include "minzip/Zip.h"
+#include "updater.h"
+#include "blockimg.h"
+#include "parallel.h"
+
+#define BLOCKSIZE 4096
+
+// The most blocks a range set or buffer can hold with its size in
+// bytes still fitting in a size_t.
+#define MAX_BLOCKS (SIZE_MAX / BLOCKSIZE)
+
+typedef struct {
+    int count;        // number of ranges
+    size_t size;      // total number of blocks
+    size_t pos[0];    // [start, end) of each range
+} RangeSet;
+
+static RangeSet* parse_range(char* text) {
+    char* save;
+    char* token;
+    char* end;
+    int i;
+
+    if (text == NULL || (token = strtok_r(text, ",", &save)) == NULL) {
+        return NULL;
+    }
+    long num = strtol(token, &end, 10);
+    if (*end != '\0' || num <= 0 || num % 2 != 0) {
+        return NULL;
+    }
+
+    RangeSet* out = malloc(sizeof(RangeSet) + num * sizeof(size_t));
+    if (out == NULL) {
+        return NULL;
+    }
+    out->count = num / 2;
+    out->size = 0;
+    for (i = 0; i < num; ++i) {
+        token = strtok_r(NULL, ",", &save);
+        if (token == NULL) {
+            free(out);
+            return NULL;
+        }
+        out->pos[i] = strtoul(token, &end, 10);
+        if (*end != '\0') {
+            free(out);
+            return NULL;
+        }
+    }
+    for (i = 0; i < out->count; ++i) {
+        if (out->pos[i*2] >= out->pos[i*2+1] ||
+            out->pos[i*2+1] - out->pos[i*2] > MAX_BLOCKS - out->size) {
+            free(out);
+            return NULL;
+        }
+        out->size += out->pos[i*2+1] - out->pos[i*2];
+    }
+    return out;
+}
+
+static int read_all(int fd, unsigned char* data, size_t size) {
+    size_t so_far = 0;
+    while (so_far < size) {
+        ssize_t r = read(fd, data+so_far, size-so_far);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            fprintf(stderr, "read failed: %s\n",
+                    r < 0 ? strerror(errno) : "unexpected end of device");
+            return -1;
+        }
+        so_far += r;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const unsigned char* data, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t w = write(fd, data+written, size-written);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) {
+            fprintf(stderr, "write failed: %s\n",
+                    w < 0 ? strerror(errno) : "no progress");
+            return -1;
+        }
+        written += w;
+    }
+    return 0;
+}
+
+static int seek_block(int fd, size_t block) {
+    if (lseek64(fd, (off64_t)block * BLOCKSIZE, SEEK_SET) == -1) {
+        fprintf(stderr, "failed to seek to block %zu: %s\n",
+                block, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int read_blocks(int fd, const RangeSet* rs, unsigned char* buffer) {
+    size_t p = 0;
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        size_t len = (rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (seek_block(fd, rs->pos[i*2]) != 0 ||
+            read_all(fd, buffer+p, len) != 0) {
+            return -1;
+        }
+        p += len;
+    }
+    return 0;
+}
+
+static int write_blocks(int fd, const RangeSet* rs,
+                        const unsigned char* buffer) {
+    size_t p = 0;
+    int i;
+    for (i = 0; i < rs->count; ++i) {
+        size_t len = (rs->pos[i*2+1] - rs->pos[i*2]) * BLOCKSIZE;
+        if (seek_block(fd, rs->pos[i*2]) != 0 ||
+            write_all(fd, buffer+p, len) != 0) {
+            return -1;
+        }
+        p += len;
+    }
+    return 0;
+}
+
+// Make *buffer at least 'size' bytes.
+static int allocate(size_t size, unsigned char** buffer, size_t* buffer_alloc) {
+    if (size <= *buffer_alloc) return 0;
+    free(*buffer);
+    *buffer = malloc(size);
+    if (*buffer == NULL) {
+        fprintf(stderr, "failed to allocate %zu bytes\n", size);
+        *buffer_alloc = 0;
+        return -1;
+    }
+    *buffer_alloc = size;
+    return 0;
+}
+
+// Spread the locs->size blocks packed at the start of 'source' out to
+// the block positions in 'dest' given by locs.  source and dest may
+// be the same buffer; working backwards means nothing is overwritten
+// before it's moved.
+static void move_range(unsigned char* dest, const RangeSet* locs,
+                       const unsigned char* source) {
+    size_t start = locs->size;
+    int i;
+    for (i = locs->count-1; i >= 0; --i) {
+        size_t blocks = locs->pos[i*2+1] - locs->pos[i*2];
+        start -= blocks;
+        memmove(dest + locs->pos[i*2] * BLOCKSIZE, source + start * BLOCKSIZE,
+                blocks * BLOCKSIZE);
+    }
+}
+
+// A SinkFn that writes the data it's given to the blocks of a range
+// set, in order.
+typedef struct {
+    int fd;
+    const RangeSet* tgt;
+    int range;           // index of the range being written
+    size_t remain;       // bytes left to write in that range
+    int failed;
+} RangeSinkState;
+
+static void init_range_sink(RangeSinkState* rss, int fd, const RangeSet* tgt) {
+    rss->fd = fd;
+    rss->tgt = tgt;
+    rss->range = 0;
+    rss->remain = (tgt->pos[1] - tgt->pos[0]) * BLOCKSIZE;
+    rss->failed = seek_block(fd, tgt->pos[0]);
+}
+
+static int range_sink_done(const RangeSinkState* rss) {
+    return rss->range == rss->tgt->count;
+}
+
+static ssize_t RangeSinkWrite(unsigned char* data, ssize_t size, void* token) {
+    RangeSinkState* rss = (RangeSinkState*)token;
+    ssize_t written = 0;
+
+    while (size > 0 && !rss->failed && !range_sink_done(rss)) {
+        size_t len = size < rss->remain ? size : rss->remain;
+        if (write_all(rss->fd, data, len) != 0) {
+            rss->failed = 1;
+            break;
+        }
+        data += len;
+        size -= len;
+        written += len;
+        rss->remain -= len;
+
+        if (rss->remain == 0 && ++rss->range < rss->tgt->count) {
+            const size_t* pos = rss->tgt->pos + rss->range*2;
+            rss->remain = (pos[1] - pos[0]) * BLOCKSIZE;
+            rss->failed = seek_block(rss->fd, pos[0]);
+        }
+    }
+    return written;
+}
+
+// The new data entry is decompressed by its own thread, which writes
+// the blocks of each "new" command straight to the partition.  The
+// main thread hands it a RangeSinkState and waits for it to be taken
+// back.
+typedef struct {
+    ZipArchive* za;
+    const ZipEntry* entry;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    RangeSinkState* rss;
+    int finished;        // the entry has been read to the end
+    int stop;            // the main thread is done with the entry
+} NewThreadInfo;
+
+static bool receive_new_data(const unsigned char* data, int size,
+                             void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*)cookie;
+
+    while (size > 0) {
+        pthread_mutex_lock(&nti->lock);
+        while (nti->rss == NULL && !nti->stop) {
+            pthread_cond_wait(&nti->cond, &nti->lock);
+        }
+        RangeSinkState* rss = nti->rss;
+        pthread_mutex_unlock(&nti->lock);
+        if (rss == NULL) {
+            return false;
+        }
+
+        ssize_t written = RangeSinkWrite((unsigned char*)data, size, rss);
+        data += written;
+        size -= written;
+
+        if (rss->failed || range_sink_done(rss)) {
+            pthread_mutex_lock(&nti->lock);
+            nti->rss = NULL;
+            pthread_cond_broadcast(&nti->cond);
+            pthread_mutex_unlock(&nti->lock);
+            if (rss->failed) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void* unzip_new_data(void* cookie) {
+    NewThreadInfo* nti = (NewThreadInfo*)cookie;
+    mzProcessZipEntryContents(nti->za, nti->entry, receive_new_data, nti);
+
+    pthread_mutex_lock(&nti->lock);
+    nti->finished = 1;
+    pthread_cond_broadcast(&nti->cond);
+    pthread_mutex_unlock(&nti->lock);
+    return NULL;
+}
+
+// Write the next tgt->size blocks of new data to tgt.
+static int write_new_data(NewThreadInfo* nti, int fd, const RangeSet* tgt) {
+    RangeSinkState rss;
+    init_range_sink(&rss, fd, tgt);
+    if (rss.failed) return -1;
+
+    pthread_mutex_lock(&nti->lock);
+    nti->rss = &rss;
+    pthread_cond_broadcast(&nti->cond);
+    while (nti->rss != NULL && !nti->finished) {
+        pthread_cond_wait(&nti->cond, &nti->lock);
+    }
+    int ok = nti->rss == NULL && !rss.failed;
+    nti->rss = NULL;
+    pthread_mutex_unlock(&nti->lock);
+
+    if (!ok && !rss.failed) {
+        fprintf(stderr, "new data ran out before block %zu\n",
+                rss.tgt->pos[rss.range*2]);
+    }
+    return ok ? 0 : -1;
+}
+
+typedef struct {
+    int version;
+    int fd;
+    unsigned char* buffer;
+    size_t buffer_alloc;
+
+    unsigned char** stash;
+    size_t* stash_blocks;
+    int max_stash_entries;
+    size_t max_stash_blocks;
+    size_t stashed_blocks;      // total held in the stash right now
+} TransferState;
+
+// Read the source of a move, bsdiff or imgdiff command into
+// ts->buffer, consuming its words from *save.  On success, returns
+// the target range set and puts the size of the source in blocks in
+// *src_blocks.
+static RangeSet* load_src_tgt(TransferState* ts, char** save,
+                              size_t* src_blocks) {
+    RangeSet* src = NULL;
+    RangeSet* tgt = NULL;
+    RangeSet* locs = NULL;
+    char* word;
+
+    if (ts->version == 1) {
+        src = parse_range(strtok_r(NULL, " ", save));
+        tgt = parse_range(strtok_r(NULL, " ", save));
+        if (src == NULL || tgt == NULL) {
+            fprintf(stderr, "invalid source or target range\n");
+            goto fail;
+        }
+        *src_blocks = src->size;
+        if (allocate(src->size * BLOCKSIZE, &ts->buffer,
+                     &ts->buffer_alloc) != 0 ||
+            read_blocks(ts->fd, src, ts->buffer) != 0) {
+            goto fail;
+        }
+        free(src);
+        return tgt;
+    }
+
+    tgt = parse_range(strtok_r(NULL, " ", save));
+    word = strtok_r(NULL, " ", save);
+    if (tgt == NULL || word == NULL) {
+        fprintf(stderr, "invalid target range or source size\n");
+        goto fail;
+    }
+    char* end;
+    *src_blocks = strtoul(word, &end, 10);
+    if (word[0] < '0' || word[0] > '9' || *end != '\0' ||
+        *src_blocks == 0 || *src_blocks > MAX_BLOCKS) {
+        fprintf(stderr, "invalid source size \"%s\"\n", word);
+        goto fail;
+    }
+    if (allocate(*src_blocks * BLOCKSIZE, &ts->buffer,
+                 &ts->buffer_alloc) != 0) {
+        goto fail;
+    }
+
+    word = strtok_r(NULL, " ", save);
+    if (word == NULL) {
+        fprintf(stderr, "missing source range\n");
+        goto fail;
+    }
+    if (strcmp(word, "-") != 0) {
+        src = parse_range(word);
+        if (src == NULL || src->size > *src_blocks) {
+            fprintf(stderr, "invalid source range\n");
+            goto fail;
+        }
+        if (read_blocks(ts->fd, src, ts->buffer) != 0) {
+            goto fail;
+        }
+
+        word = strtok_r(NULL, " ", save);
+        if (word == NULL) {
+            // The whole source comes from the partition.
+            if (src->size != *src_blocks) {
+                fprintf(stderr, "source range has %zu blocks, expected %zu\n",
+                        src->size, *src_blocks);
+                goto fail;
+            }
+            free(src);
+            return tgt;
+        }
+
+        locs = parse_range(word);
+        if (locs == NULL || locs->size != src->size ||
+            locs->pos[locs->count*2-1] > *src_blocks) {
+            fprintf(stderr, "invalid source locations\n");
+            goto fail;
+        }
+        move_range(ts->buffer, locs, ts->buffer);
+        free(locs);
+        locs = NULL;
+    }
+
+    while ((word = strtok_r(NULL, " ", save)) != NULL) {
+        char* colon = strchr(word, ':');
+        if (colon == NULL) {
+            fprintf(stderr, "invalid stash reference \"%s\"\n", word);
+            goto fail;
+        }
+        *colon = '\0';
+        int id = strtol(word, NULL, 10);
+        if (id < 0 || id >= ts->max_stash_entries || ts->stash[id] == NULL) {
+            fprintf(stderr, "no stash entry %d\n", id);
+            goto fail;
+        }
+        locs = parse_range(colon+1);
+        if (locs == NULL || locs->size != ts->stash_blocks[id] ||
+            locs->pos[locs->count*2-1] > *src_blocks) {
+            fprintf(stderr, "invalid locations for stash entry %d\n", id);
+            goto fail;
+        }
+        move_range(ts->buffer, locs, ts->stash[id]);
+        free(locs);
+        locs = NULL;
+    }
+
+    free(src);
+    return tgt;
+
+  fail:
+    free(src);
+    free(tgt);
+    free(locs);
+    return NULL;
+}
+
+// block_image_update(block_device, transfer_list, new_data_entry,
+//                    patch_data_entry)
+//
+// Apply the transfer list (usually package_extract_file() of a
+// ".transfer.list" entry) to the block device, taking the data for
+// "new" commands from the named package entry (which may be
+// compressed) and patches from the other (which must be stored).
+Value* BlockImageUpdateFn(const char* name, State* state,
+                          int argc, Expr* argv[]) {
+    Value* blockdev_filename;
+    Value* transfer_list_value;
+    Value* new_data_fn;
+    Value* patch_data_fn;
+    char* transfer_list = NULL;
+    int result = -1;
+    int fd = -1;
+    int i;
+
+    if (argc != 4) {
+        return ErrorAbort(state, "%s() expects 4 args, got %d", name, argc);
+    }
+    if (ReadValueArgs(state, argv, 4, &blockdev_filename,
+                      &transfer_list_value, &new_data_fn,
+                      &patch_data_fn) < 0) {
+        return NULL;
+    }
+
+    TransferState ts;
+    memset(&ts, 0, sizeof(ts));
+
+    NewThreadInfo nti;
+    memset(&nti, 0, sizeof(nti));
+    pthread_mutex_init(&nti.lock, NULL);
+    pthread_cond_init(&nti.cond, NULL);
+    pthread_t new_data_thread;
+    int thread_started = 0;
+
+    if (blockdev_filename->type != VAL_STRING ||
+        new_data_fn->type != VAL_STRING ||
+        patch_data_fn->type != VAL_STRING) {
+        ErrorAbort(state, "%s(): block device and entry names must be "
+                   "strings", name);
+        goto done;
+    }
+
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    ZipArchive* za = ui->package_zip;
+
+    const ZipEntry* patch_entry = mzFindZipEntry(za, patch_data_fn->data);
+    if (patch_entry == NULL) {
+        fprintf(stderr, "%s(): no file \"%s\" in package\n",
+                name, patch_data_fn->data);
+        goto done;
+    }
+    if (patch_entry->compression != 0) {
+        // Patches are read in place from the mapped package.
+        fprintf(stderr, "%s(): \"%s\" must be stored uncompressed\n",
+                name, patch_data_fn->data);
+        goto done;
+    }
+    const unsigned char* patch_start =
+        (const unsigned char*)za->map.addr + mzGetZipEntryOffset(patch_entry);
+    size_t patch_size = patch_entry->uncompLen;
+
+    nti.za = za;
+    nti.entry = mzFindZipEntry(za, new_data_fn->data);
+    if (nti.entry == NULL) {
+        fprintf(stderr, "%s(): no file \"%s\" in package\n",
+                name, new_data_fn->data);
+        goto done;
+    }
+
+    fd = open(blockdev_filename->data, O_RDWR);
+    if (fd < 0) {
+        fprintf(stderr, "%s(): failed to open %s: %s\n",
+                name, blockdev_filename->data, strerror(errno));
+        goto done;
+    }
+    ts.fd = fd;
+
+    if (pthread_create(&new_data_thread, NULL, unzip_new_data, &nti) != 0) {
+        fprintf(stderr, "%s(): failed to start new data thread\n", name);
+        goto done;
+    }
+    thread_started = 1;
+
+    transfer_list = malloc(transfer_list_value->size + 1);
+    memcpy(transfer_list, transfer_list_value->data, transfer_list_value->size);
+    transfer_list[transfer_list_value->size] = '\0';
+
+    char* line_save;
+    char* line = strtok_r(transfer_list, "\n", &line_save);
+    ts.version = line ? strtol(line, NULL, 10) : 0;
+    if (ts.version < 1 || ts.version > 2) {
+        fprintf(stderr, "%s(): unsupported transfer list version %s\n",
+                name, line ? line : "(none)");
+        goto done;
+    }
+
+    line = strtok_r(NULL, "\n", &line_save);
+    size_t total_blocks = line ? strtoul(line, NULL, 10) : 0;
+    size_t blocks_so_far = 0;
+
+    if (ts.version >= 2) {
+        line = strtok_r(NULL, "\n", &line_save);
+        ts.max_stash_entries = line ? strtol(line, NULL, 10) : -1;
+        line = strtok_r(NULL, "\n", &line_save);
+        long max_stash_blocks = line ? strtol(line, NULL, 10) : -1;
+        if (ts.max_stash_entries < 0 || max_stash_blocks < 0) {
+            fprintf(stderr, "%s(): invalid stash limits\n", name);
+            goto done;
+        }
+        fprintf(stderr, "maximum stash: %d entries, %ld blocks\n",
+                ts.max_stash_entries, max_stash_blocks);
+        ts.max_stash_blocks = max_stash_blocks;
+        ts.stash = calloc(ts.max_stash_entries, sizeof(unsigned char*));
+        ts.stash_blocks = calloc(ts.max_stash_entries, sizeof(size_t));
+    }
+
+    while ((line = strtok_r(NULL, "\n", &line_save)) != NULL) {
+        char* save;
+        char* cmd = strtok_r(line, " ", &save);
+        RangeSet* tgt = NULL;
+        int ok = 0;
+
+        if (cmd == NULL) {
+            continue;
+        } else if (strcmp(cmd, "erase") == 0) {
+            tgt = parse_range(strtok_r(NULL, " ", &save));
+            if (tgt != NULL) {
+                ok = 1;
+                for (i = 0; i < tgt->count; ++i) {
+                    uint64_t range[2];
+                    range[0] = (uint64_t)tgt->pos[i*2] * BLOCKSIZE;
+                    range[1] = (uint64_t)(tgt->pos[i*2+1] - tgt->pos[i*2]) *
+                               BLOCKSIZE;
+                    // Discarding is only a hint to the device, so
+                    // carry on if it isn't supported.
+                    if (ioctl(fd, BLKDISCARD, &range) < 0) {
+                        fprintf(stderr, "discard of blocks %zu-%zu failed: "
+                                "%s\n", tgt->pos[i*2], tgt->pos[i*2+1],
+                                strerror(errno));
+                    }
+                }
+            }
+        } else if (strcmp(cmd, "zero") == 0) {
+            tgt = parse_range(strtok_r(NULL, " ", &save));
+            if (tgt != NULL &&
+                allocate(BLOCKSIZE, &ts.buffer, &ts.buffer_alloc) == 0) {
+                memset(ts.buffer, 0, BLOCKSIZE);
+                ok = 1;
+                for (i = 0; i < tgt->count && ok; ++i) {
+                    size_t b;
+                    ok = seek_block(fd, tgt->pos[i*2]) == 0;
+                    for (b = tgt->pos[i*2]; b < tgt->pos[i*2+1] && ok; ++b) {
+                        ok = write_all(fd, ts.buffer, BLOCKSIZE) == 0;
+                    }
+                }
+                blocks_so_far += tgt->size;
+            }
+        } else if (strcmp(cmd, "new") == 0) {
+            tgt = parse_range(strtok_r(NULL, " ", &save));
+            if (tgt != NULL) {
+                ok = write_new_data(&nti, fd, tgt) == 0;
+                blocks_so_far += tgt->size;
+            }
+        } else if (strcmp(cmd, "move") == 0) {
+            size_t src_blocks;
+            tgt = load_src_tgt(&ts, &save, &src_blocks);
+            if (tgt != NULL) {
+                if (src_blocks != tgt->size) {
+                    fprintf(stderr, "move of %zu blocks to %zu blocks\n",
+                            src_blocks, tgt->size);
+                } else {
+                    ok = write_blocks(fd, tgt, ts.buffer) == 0;
+                }
+                blocks_so_far += tgt->size;
+            }
+        } else if (strcmp(cmd, "bsdiff") == 0 || strcmp(cmd, "imgdiff") == 0) {
+            char* offset_str = strtok_r(NULL, " ", &save);
+            char* len_str = strtok_r(NULL, " ", &save);
+            size_t offset = offset_str ? strtoul(offset_str, NULL, 10) : 0;
+            size_t len = len_str ? strtoul(len_str, NULL, 10) : 0;
+            size_t src_blocks;
+
+            if (len_str == NULL || offset > patch_size ||
+                len > patch_size - offset) {
+                fprintf(stderr, "patch range is outside %s\n",
+                        patch_data_fn->data);
+            } else if ((tgt = load_src_tgt(&ts, &save, &src_blocks)) != NULL) {
+                Value patch_value;
+                patch_value.type = VAL_BLOB;
+                patch_value.size = len;
+                patch_value.data = (char*)(patch_start + offset);
+
+                RangeSinkState rss;
+                init_range_sink(&rss, fd, tgt);
+                if (!rss.failed) {
+                    if (cmd[0] == 'b') {
+                        ok = ApplyBSDiffPatch(ts.buffer, src_blocks * BLOCKSIZE,
+                                              &patch_value, 0, RangeSinkWrite,
+                                              &rss, NULL) == 0;
+                    } else {
+                        ok = ApplyImagePatch(ts.buffer, src_blocks * BLOCKSIZE,
+                                             &patch_value, RangeSinkWrite,
+                                             &rss, NULL, NULL) == 0;
+                    }
+                }
+                if (ok && !range_sink_done(&rss)) {
+                    fprintf(stderr, "patch produced too little data for "
+                            "%zu blocks\n", tgt->size);
+                    ok = 0;
+                }
+                blocks_so_far += tgt->size;
+            }
+        } else if (strcmp(cmd, "stash") == 0 && ts.version >= 2) {
+            char* id_str = strtok_r(NULL, " ", &save);
+            int id = id_str ? strtol(id_str, NULL, 10) : -1;
+            RangeSet* src = parse_range(strtok_r(NULL, " ", &save));
+            if (id < 0 || id >= ts.max_stash_entries || src == NULL) {
+                fprintf(stderr, "invalid stash command\n");
+            } else if (ts.stashed_blocks - ts.stash_blocks[id] + src->size >
+                       ts.max_stash_blocks) {
+                // The header's limit is what the generator promised
+                // would fit; going past it means the list is bad.
+                fprintf(stderr, "stash %d of %zu blocks would hold %zu "
+                        "blocks; limit is %zu\n", id, src->size,
+                        ts.stashed_blocks - ts.stash_blocks[id] + src->size,
+                        ts.max_stash_blocks);
+            } else {
+                free(ts.stash[id]);
+                ts.stashed_blocks -= ts.stash_blocks[id];
+                ts.stash[id] = malloc(src->size * BLOCKSIZE);
+                ts.stash_blocks[id] = src->size;
+                ts.stashed_blocks += src->size;
+                ok = ts.stash[id] != NULL &&
+                     read_blocks(fd, src, ts.stash[id]) == 0;
+            }
+            free(src);
+        } else if (strcmp(cmd, "free") == 0 && ts.version >= 2) {
+            char* id_str = strtok_r(NULL, " ", &save);
+            int id = id_str ? strtol(id_str, NULL, 10) : -1;
+            if (id < 0 || id >= ts.max_stash_entries) {
+                fprintf(stderr, "invalid free command\n");
+            } else {
+                free(ts.stash[id]);
+                ts.stash[id] = NULL;
+                ts.stashed_blocks -= ts.stash_blocks[id];
+                ts.stash_blocks[id] = 0;
+                ok = 1;
+            }
+        } else {
+            fprintf(stderr, "unknown transfer list command \"%s\"\n", cmd);
+        }
+
+        free(tgt);
+        if (!ok) {
+            fprintf(stderr, "%s(): \"%s\" command failed\n", name, cmd);
+            goto done;
+        }
+
+        if (total_blocks > 0) {
+            UpdaterSetProgress(ui, (double)blocks_so_far / total_blocks);
+        }
+    }
+
+    if (fsync(fd) != 0) {
+        fprintf(stderr, "%s(): fsync of %s failed: %s\n",
+                name, blockdev_filename->data, strerror(errno));
+        goto done;
+    }
+    fprintf(stderr, "wrote %zu blocks; expected %zu\n",
+            blocks_so_far, total_blocks);
+    result = 0;
+
+  done:
+    if (thread_started) {
+        pthread_mutex_lock(&nti.lock);
+        nti.stop = 1;
+        pthread_cond_broadcast(&nti.cond);
+        pthread_mutex_unlock(&nti.lock);
+        pthread_join(new_data_thread, NULL);
+    }
+    pthread_mutex_destroy(&nti.lock);
+    pthread_cond_destroy(&nti.cond);
+    if (fd >= 0) close(fd);
+    for (i = 0; i < ts.max_stash_entries && ts.stash; ++i) {
+        free(ts.stash[i]);
+    }
+    free(ts.stash);
+    free(ts.stash_blocks);
+    free(ts.buffer);
+    free(transfer_list);
+    FreeValue(blockdev_filename);
+    FreeValue(transfer_list_value);
+    FreeValue(new_data_fn);
+    FreeValue(patch_data_fn);
+
+    if (state->errmsg != NULL) {
+        return NULL;
+    }
+    return StringValue(strdup(result == 0 ? "t" : ""));
+}
+
+// range_sha1(block_device, ranges)
+//
+// Return the SHA-1 (as a hex string) of the given blocks of the
+// device, so that a script can check that a partition holds the
+// expected source before running block_image_update() on it.
+Value* RangeSha1Fn(const char* name, State* state, int argc, Expr* argv[]) {
+    char* blockdev_filename;
+    char* ranges;
+    char* result = NULL;
+    unsigned char* buffer = NULL;
+    RangeSet* rs = NULL;
+    int fd = -1;
+    int i;
+
+    if (argc != 2) {
+        return ErrorAbort(state, "%s() expects 2 args, got %d", name, argc);
+    }
+    if (ReadArgs(state, argv, 2, &blockdev_filename, &ranges) < 0) {
+        return NULL;
+    }
+
+    if ((rs = parse_range(ranges)) == NULL) {
+        ErrorAbort(state, "%s(): invalid range set", name);
+        goto done;
+    }
+
+    fd = open(blockdev_filename, O_RDONLY);
+    if (fd < 0) {
+        ErrorAbort(state, "%s(): failed to open %s: %s",
+                   name, blockdev_filename, strerror(errno));
+        goto done;
+    }
+
+    SHA_CTX ctx;
+    SHA_init(&ctx);
+    buffer = malloc(BLOCKSIZE);
+    for (i = 0; i < rs->count; ++i) {
+        size_t b;
+        if (seek_block(fd, rs->pos[i*2]) != 0) {
+            ErrorAbort(state, "%s(): failed to seek %s", name,
+                       blockdev_filename);
+            goto done;
+        }
+        for (b = rs->pos[i*2]; b < rs->pos[i*2+1]; ++b) {
+            if (read_all(fd, buffer, BLOCKSIZE) != 0) {
+                ErrorAbort(state, "%s(): failed to read %s", name,
+                           blockdev_filename);
+                goto done;
+            }
+            SHA_update(&ctx, buffer, BLOCKSIZE);
+        }
+    }
+    const uint8_t* digest = SHA_final(&ctx);
+
+    static const char hex[] = "0123456789abcdef";
+    result = malloc(SHA_DIGEST_SIZE*2 + 1);
+    for (i = 0; i < SHA_DIGEST_SIZE; ++i) {
+        result[i*2] = hex[digest[i] >> 4];
+        result[i*2+1] = hex[digest[i] & 0xf];
+    }
+    result[SHA_DIGEST_SIZE*2] = '\0';
+
+  done:
+    if (fd >= 0) close(fd);
+    free(buffer);
+    free(rs);
+    free(blockdev_filename);
+    free(ranges);
+    return result ? StringValue(result) : NULL;
+}
+
+void RegisterBlockImageFunctions() {
+    RegisterSerializedFunction("block_image_update", BlockImageUpdateFn);
+    RegisterFunction("range_sha1", RangeSha1Fn);
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests for the stash handling in block_image_update().  Each test
+// runs a short transfer list against a small image file, using a
+// package whose new and patch data entries are empty.
+//
+// usage: blockimg_test [<scratch-dir>]
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+#include "updater.h"
+#include "blockimg.h"
+#include "testutil/testutil.h"
+
+#define BLOCKSIZE 4096
+#define IMAGE_BLOCKS 16
+
+extern int yyparse(Expr** root, int* error_count);
+
+static char image_path[FILENAME_MAX];
+static char package_path[FILENAME_MAX];
+static ZipArchive package;
+
+// Write a zip holding empty "new.dat" and "patch.dat" entries.
+static int WritePackage(const char* path) {
+    static const TestZipEntry entries[] = {
+        { "new.dat", "", 0 },
+        { "patch.dat", "", 0 },
+    };
+    return WriteStoredZip(path, entries, 2);
+}
+
+// Fill every block of the image with its own number.
+static int WriteImage() {
+    FILE* f = fopen(image_path, "wb");
+    if (f == NULL) return -1;
+    unsigned char block[BLOCKSIZE];
+    int i;
+    for (i = 0; i < IMAGE_BLOCKS; ++i) {
+        memset(block, i, sizeof(block));
+        fwrite(block, 1, sizeof(block), f);
+    }
+    return fclose(f);
+}
+
+// Return the byte that fills 'block' of the image, or -1 if the block
+// isn't filled with a single value.
+static int BlockValue(int block) {
+    unsigned char data[BLOCKSIZE];
+    FILE* f = fopen(image_path, "rb");
+    if (f == NULL) return -1;
+    fseek(f, (long)block * BLOCKSIZE, SEEK_SET);
+    size_t n = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    if (n != sizeof(data)) return -1;
+    size_t i;
+    for (i = 1; i < sizeof(data); ++i) {
+        if (data[i] != data[0]) return -1;
+    }
+    return data[0];
+}
+
+// Run block_image_update() on a fresh image with the transfer list
+// made of 'lines'.  Returns 1 if it succeeded, 0 if it failed.
+static int RunTransferList(const char* name, const char** lines) {
+    printf("%s\n", name);
+    if (WriteImage() != 0) {
+        printf("  failed to write %s: %s\n", image_path, strerror(errno));
+        return -1;
+    }
+
+    // The transfer list goes into the script as a string literal.
+    char script[4096];
+    size_t len = snprintf(script, sizeof(script),
+                          "block_image_update(\"%s\", \"", image_path);
+    for (; *lines != NULL; ++lines) {
+        len += snprintf(script + len, sizeof(script) - len, "%s\\n", *lines);
+    }
+    snprintf(script + len, sizeof(script) - len,
+             "\", \"new.dat\", \"patch.dat\")");
+
+    Expr* root;
+    int error_count = 0;
+    yy_scan_string(script);
+    if (yyparse(&root, &error_count) != 0 || error_count > 0) {
+        printf("  failed to parse script\n");
+        return -1;
+    }
+
+    UpdaterInfo ui;
+    ui.cmd_pipe = fopen("/dev/null", "w");
+    ui.package_zip = &package;
+    ui.version = 3;
+    ui.progress = NULL;
+    ui.progress_slot = 0;
+
+    State state;
+    state.cookie = &ui;
+    state.script = script;
+    state.errmsg = NULL;
+
+    char* result = Evaluate(&state, root);
+    int ok = result != NULL && strcmp(result, "t") == 0;
+    free(result);
+    free(state.errmsg);
+    fclose(ui.cmd_pipe);
+    return ok;
+}
+
+static void TestWithinLimit() {
+    // Four blocks are held at most, though six pass through the stash.
+    const char* lines[] = {
+        "2", "4", "2", "4",
+        "stash 0 2,0,2",
+        "stash 1 2,2,4",
+        "free 0",
+        "stash 0 2,4,6",
+        "move 2,8,12 4 - 0:2,0,2 1:2,2,4",
+        "free 0",
+        "free 1",
+        NULL
+    };
+    EXPECT(RunTransferList("stash within the limit", lines) == 1);
+    EXPECT(BlockValue(8) == 4);
+    EXPECT(BlockValue(9) == 5);
+    EXPECT(BlockValue(10) == 2);
+    EXPECT(BlockValue(11) == 3);
+}
+
+static void TestReplaceWithinLimit() {
+    // Stashing over an entry drops the old copy first.
+    const char* lines[] = {
+        "2", "2", "1", "2",
+        "stash 0 2,0,2",
+        "stash 0 2,2,4",
+        "move 2,8,10 2 - 0:2,0,2",
+        "free 0",
+        NULL
+    };
+    EXPECT(RunTransferList("restash within the limit", lines) == 1);
+    EXPECT(BlockValue(8) == 2);
+    EXPECT(BlockValue(9) == 3);
+}
+
+static void TestOverLimit() {
+    const char* lines[] = {
+        "2", "2", "2", "3",
+        "stash 0 2,0,2",
+        "stash 1 2,2,4",
+        "zero 2,8,10",
+        NULL
+    };
+    EXPECT(RunTransferList("stash over the limit fails", lines) == 0);
+    // Nothing after the failed stash is run.
+    EXPECT(BlockValue(8) == 8);
+    EXPECT(BlockValue(9) == 9);
+}
+
+static void TestOverLimitAfterFree() {
+    // Freed entries stop counting, but only once they're freed.
+    const char* lines[] = {
+        "2", "2", "2", "2",
+        "stash 0 2,0,2",
+        "free 0",
+        "stash 1 2,2,4",
+        "stash 0 2,4,5",
+        "zero 2,8,10",
+        NULL
+    };
+    EXPECT(RunTransferList("stash over the limit after a free fails",
+                           lines) == 0);
+    EXPECT(BlockValue(8) == 8);
+}
+
+static void TestBadSourceSize() {
+    // Sizes that don't parse, or whose size in bytes would wrap.
+    static const char* sizes[] = { "2x", "0", "-2", "4503599627370497" };
+    size_t i;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        char move[64];
+        snprintf(move, sizeof(move), "move 2,8,10 %s 2,0,2", sizes[i]);
+        const char* lines[] = { "2", "2", "0", "0", move, NULL };
+        EXPECT(RunTransferList(move, lines) == 0);
+        EXPECT(BlockValue(8) == 8);
+    }
+}
+
+static void TestHugeRange() {
+    // The range's size in bytes would wrap, even on 64-bit devices.
+    const char* lines[] = {
+        "2", "2", "0", "0",
+        "move 2,8,10 2 4,0,2,2,18446744073709551615",
+        NULL
+    };
+    EXPECT(RunTransferList("range too large fails", lines) == 0);
+    EXPECT(BlockValue(8) == 8);
+}
+
+int main(int argc, char** argv) {
+    const char* dir = TestScratchDir(argc, argv, "blockimg_test");
+    if (dir == NULL) return 2;
+    snprintf(image_path, sizeof(image_path), "%s/image", dir);
+    snprintf(package_path, sizeof(package_path), "%s/package.zip", dir);
+
+    if (WritePackage(package_path) != 0 ||
+        mzOpenZipArchive(package_path, &package) != 0) {
+        printf("failed to make package %s\n", package_path);
+        return 2;
+    }
+
+    RegisterBuiltins();
+    RegisterBlockImageFunctions();
+    FinishRegistration();
+
+    TestWithinLimit();
+    TestReplaceWithinLimit();
+    TestOverLimit();
+    TestOverLimitAfterFree();
+    TestBadSourceSize();
+    TestHugeRange();
+
+    mzCloseZipArchive(&package);
+    unlink(image_path);
+    unlink(package_path);
+    return TestFinish();
+}
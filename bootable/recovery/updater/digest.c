@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Streaming digest functions for verifying what an install has written:
+ *
+ *   sha_file(path[, algo])
+ *   sha_entry(zip_path[, algo])
+ *   sha_range(blockdev, offset, length[, algo])
+ *
+ * Each returns the digest of the file, the package entry or the byte
+ * range of the block device as a lowercase hex string, or "" if the
+ * data can't be read.  algo is "sha1" (the default), "sha256" or
+ * "crc32".  Unlike sha1_check(read_file(...)), the data is hashed a
+ * buffer at a time and never held in memory as a whole, so whole
+ * partitions can be checked.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "edify/expr.h"
+#include "mincrypt/sha.h"
+#include "minzip/Zip.h"
+#include "updater.h"
+#include "digest.h"
+
+#define DIGEST_BUFFER_SIZE (256 * 1024)
+
+// libmincrypt only has SHA-1 in this release, so SHA-256 is here.
+
+#define SHA256_DIGEST_SIZE 32
+
+typedef struct {
+    uint64_t count;
+    uint32_t state[8];
+    uint8_t buf[64];
+} Sha256Ctx;
+
+static const uint32_t K256[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ror(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void Sha256Transform(Sha256Ctx* ctx, const uint8_t* p) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; ++i, p += 4) {
+        w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+               ((uint32_t)p[2] << 8) | p[3];
+    }
+    for (i = 16; i < 64; ++i) {
+        uint32_t s0 = ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+
+    a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2];
+    d = ctx->state[3]; e = ctx->state[4]; f = ctx->state[5];
+    g = ctx->state[6]; h = ctx->state[7];
+
+    for (i = 0; i < 64; ++i) {
+        uint32_t s1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + K256[i] + w[i];
+        uint32_t s0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c;
+    ctx->state[3] += d; ctx->state[4] += e; ctx->state[5] += f;
+    ctx->state[6] += g; ctx->state[7] += h;
+}
+
+static void Sha256Init(Sha256Ctx* ctx) {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(ctx->state, init, sizeof(init));
+    ctx->count = 0;
+}
+
+static void Sha256Update(Sha256Ctx* ctx, const uint8_t* data, size_t len) {
+    size_t used = ctx->count & 63;
+    ctx->count += len;
+    if (used > 0) {
+        size_t n = 64 - used;
+        if (n > len) n = len;
+        memcpy(ctx->buf + used, data, n);
+        data += n;
+        len -= n;
+        if (used + n < 64) return;
+        Sha256Transform(ctx, ctx->buf);
+    }
+    for (; len >= 64; data += 64, len -= 64) {
+        Sha256Transform(ctx, data);
+    }
+    memcpy(ctx->buf, data, len);
+}
+
+static void Sha256Final(Sha256Ctx* ctx, uint8_t digest[SHA256_DIGEST_SIZE]) {
+    uint64_t bits = ctx->count * 8;
+    uint8_t pad[72];
+    size_t padlen = 64 - ((ctx->count + 8) & 63);
+    int i;
+
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; ++i) {
+        pad[padlen + i] = bits >> (56 - i * 8);
+    }
+    Sha256Update(ctx, pad, padlen + 8);
+
+    for (i = 0; i < 8; ++i) {
+        digest[i*4] = ctx->state[i] >> 24;
+        digest[i*4+1] = ctx->state[i] >> 16;
+        digest[i*4+2] = ctx->state[i] >> 8;
+        digest[i*4+3] = ctx->state[i];
+    }
+}
+
+// A digest of any of the supported kinds, fed a piece at a time.
+
+typedef enum { DIGEST_SHA1, DIGEST_SHA256, DIGEST_CRC32 } DigestType;
+
+typedef struct {
+    DigestType type;
+    union {
+        SHA_CTX sha1;
+        Sha256Ctx sha256;
+        uLong crc32;
+    } u;
+} Digest;
+
+static int DigestInit(Digest* d, const char* algo) {
+    if (algo == NULL || strcmp(algo, "sha1") == 0) {
+        d->type = DIGEST_SHA1;
+        SHA_init(&d->u.sha1);
+    } else if (strcmp(algo, "sha256") == 0) {
+        d->type = DIGEST_SHA256;
+        Sha256Init(&d->u.sha256);
+    } else if (strcmp(algo, "crc32") == 0) {
+        d->type = DIGEST_CRC32;
+        d->u.crc32 = crc32(0L, Z_NULL, 0);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static void DigestUpdate(Digest* d, const unsigned char* data, size_t len) {
+    switch (d->type) {
+        case DIGEST_SHA1:
+            SHA_update(&d->u.sha1, data, len);
+            break;
+        case DIGEST_SHA256:
+            Sha256Update(&d->u.sha256, data, len);
+            break;
+        case DIGEST_CRC32:
+            d->u.crc32 = crc32(d->u.crc32, data, len);
+            break;
+    }
+}
+
+// Returns the digest as a malloc'd hex string.
+static char* DigestFinal(Digest* d) {
+    uint8_t bytes[SHA256_DIGEST_SIZE];
+    const uint8_t* digest = bytes;
+    int size = 0;
+
+    switch (d->type) {
+        case DIGEST_SHA1:
+            digest = SHA_final(&d->u.sha1);
+            size = SHA_DIGEST_SIZE;
+            break;
+        case DIGEST_SHA256:
+            Sha256Final(&d->u.sha256, bytes);
+            size = SHA256_DIGEST_SIZE;
+            break;
+        case DIGEST_CRC32:
+            bytes[0] = d->u.crc32 >> 24;
+            bytes[1] = d->u.crc32 >> 16;
+            bytes[2] = d->u.crc32 >> 8;
+            bytes[3] = d->u.crc32;
+            size = 4;
+            break;
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    char* result = malloc(size*2 + 1);
+    int i;
+    for (i = 0; i < size; ++i) {
+        result[i*2] = hex[digest[i] >> 4];
+        result[i*2+1] = hex[digest[i] & 0xf];
+    }
+    result[size*2] = '\0';
+    return result;
+}
+
+// Hash up to 'length' bytes of fd from its current position, or until
+// EOF if length is negative.  Returns 0 if that many bytes were read.
+static int DigestFd(Digest* d, int fd, off64_t length) {
+    unsigned char* buffer = malloc(DIGEST_BUFFER_SIZE);
+    int result = -1;
+    while (length != 0) {
+        size_t want = DIGEST_BUFFER_SIZE;
+        if (length > 0 && (off64_t)want > length) want = length;
+        ssize_t r = read(fd, buffer, want);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) goto done;
+        if (r == 0) {
+            if (length > 0) errno = EIO;  // device or file too short
+            break;
+        }
+        DigestUpdate(d, buffer, r);
+        if (length > 0) length -= r;
+    }
+    result = (length > 0) ? -1 : 0;
+  done:
+    free(buffer);
+    return result;
+}
+
+static bool digest_entry_cb(const unsigned char* data, int data_len,
+                            void* cookie) {
+    DigestUpdate((Digest*)cookie, data, data_len);
+    return true;
+}
+
+// Read the leading arguments into args[] and the optional trailing
+// algorithm name into *algo (NULL if absent), and start the digest.
+// Returns 0 on success; on failure state->errmsg is set.
+static int ReadDigestArgs(const char* name, State* state, int argc,
+                          Expr* argv[], int nargs, char** args,
+                          char** algo, Digest* d) {
+    if (argc != nargs && argc != nargs + 1) {
+        ErrorAbort(state, "%s() expects %d or %d args, got %d",
+                   name, nargs, nargs + 1, argc);
+        return -1;
+    }
+    char** all = ReadVarArgs(state, argc, argv);
+    if (all == NULL) return -1;
+    memcpy(args, all, nargs * sizeof(char*));
+    *algo = (argc > nargs) ? all[nargs] : NULL;
+    free(all);
+
+    if (DigestInit(d, *algo) != 0) {
+        ErrorAbort(state, "%s(): unknown algorithm \"%s\"", name, *algo);
+        int i;
+        for (i = 0; i < nargs; ++i) free(args[i]);
+        free(*algo);
+        return -1;
+    }
+    return 0;
+}
+
+// sha_file(path[, algo])
+Value* ShaFileFn(const char* name, State* state, int argc, Expr* argv[]) {
+    char* path;
+    char* algo;
+    Digest d;
+    if (ReadDigestArgs(name, state, argc, argv, 1, &path, &algo, &d) < 0) {
+        return NULL;
+    }
+
+    char* result = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || DigestFd(&d, fd, -1) != 0) {
+        fprintf(stderr, "%s: failed to read %s: %s\n",
+                name, path, strerror(errno));
+        result = strdup("");
+    } else {
+        result = DigestFinal(&d);
+    }
+    if (fd >= 0) close(fd);
+
+    free(path);
+    free(algo);
+    return StringValue(result);
+}
+
+// sha_entry(zip_path[, algo])
+Value* ShaEntryFn(const char* name, State* state, int argc, Expr* argv[]) {
+    char* zip_path;
+    char* algo;
+    Digest d;
+    if (ReadDigestArgs(name, state, argc, argv, 1, &zip_path, &algo, &d) < 0) {
+        return NULL;
+    }
+
+    char* result = NULL;
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+    if (entry == NULL) {
+        fprintf(stderr, "%s: no %s in package\n", name, zip_path);
+        result = strdup("");
+    } else if (!mzProcessZipEntryContents(za, entry, digest_entry_cb, &d)) {
+        fprintf(stderr, "%s: failed to read %s from package\n",
+                name, zip_path);
+        result = strdup("");
+    } else {
+        result = DigestFinal(&d);
+    }
+
+    free(zip_path);
+    free(algo);
+    return StringValue(result);
+}
+
+// sha_range(blockdev, offset, length[, algo])
+Value* ShaRangeFn(const char* name, State* state, int argc, Expr* argv[]) {
+    char* args[3];
+    char* algo;
+    Digest d;
+    if (ReadDigestArgs(name, state, argc, argv, 3, args, &algo, &d) < 0) {
+        return NULL;
+    }
+    char* blockdev = args[0];
+    char* result = NULL;
+    int fd = -1;
+
+    char* end;
+    off64_t offset = strtoll(args[1], &end, 10);
+    if (args[1][0] == '\0' || *end != '\0' || offset < 0) {
+        ErrorAbort(state, "%s(): bad offset \"%s\"", name, args[1]);
+        goto done;
+    }
+    off64_t length = strtoll(args[2], &end, 10);
+    if (args[2][0] == '\0' || *end != '\0' || length < 0) {
+        ErrorAbort(state, "%s(): bad length \"%s\"", name, args[2]);
+        goto done;
+    }
+
+    fd = open(blockdev, O_RDONLY);
+    if (fd < 0 || lseek64(fd, offset, SEEK_SET) != offset ||
+        DigestFd(&d, fd, length) != 0) {
+        fprintf(stderr, "%s: failed to read %s: %s\n",
+                name, blockdev, strerror(errno));
+        result = strdup("");
+    } else {
+        result = DigestFinal(&d);
+    }
+
+  done:
+    if (fd >= 0) close(fd);
+    free(args[0]);
+    free(args[1]);
+    free(args[2]);
+    free(algo);
+    return result ? StringValue(result) : NULL;
+}
+
+void RegisterDigestFunctions() {
+    RegisterFunction("sha_file", ShaFileFn);
+    RegisterFunction("sha_entry", ShaEntryFn);
+    RegisterFunction("sha_range", ShaRangeFn);
+}
@@ -26,6 +26,7 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <time.h>
 
 #include "cutils/misc.h"
@@ -36,6 +37,7 @@
 #include "mtdutils/mounts.h"
 #include "mtdutils/mtdutils.h"
 #include "updater.h"
+#include "parallel.h"
 #include "applypatch/applypatch.h"
 #include "cutils/android_reboot.h"
 #include "mtdutils/rk29.h"
@@ -377,8 +379,7 @@ Value* ShowProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
     double frac = strtod(frac_str, NULL);
     int sec = strtol(sec_str, NULL, 10);
 
-    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "progress %f %d\n", frac, sec);
+    UpdaterShowProgress((UpdaterInfo*)(state->cookie), frac, sec);
 
     free(sec_str);
     return StringValue(frac_str);
@@ -395,8 +396,7 @@ Value* SetProgressFn(const char* name, State* state, int argc, Expr* argv[]) {
 
     double frac = strtod(frac_str, NULL);
 
-    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
-    fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+    UpdaterSetProgress((UpdaterInfo*)(state->cookie), frac);
 
     return StringValue(frac_str);
 }
@@ -777,10 +777,129 @@ static bool write_raw_image_cb(const unsigned char* data,
     return false;
 }
 
-// write_raw_image(filename_or_blob, partition)
+static bool write_emmc_image_cb(const unsigned char* data,
+                                int data_len, void* ctx) {
+    ssize_t r = emmc_write_data((EmmcWriteContext*)ctx, (const char *)data, data_len);
+    if (r == data_len) return true;
+    fprintf(stderr, "%s\n", strerror(errno));
+    return false;
+}
+
+// Images are read in chunks this big; the eMMC writer gathers them into
+// its own larger buffers.
+#define RAW_IMAGE_READ_SIZE (1 << 20)
+
+// A write_raw_image() source string with this prefix names an entry in
+// the package, which is inflated straight into the partition rather
+// than being extracted to /tmp first.
+#define PACKAGE_SOURCE_PREFIX "package:"
+
+// Where write_raw_image() gets its image from: a file, a package
+// entry, or a blob.
+typedef struct {
+    FILE* file;
+    ZipArchive* za;
+    const ZipEntry* entry;
+    const Value* blob;
+    off64_t length;
+} RawImageSource;
+
+static bool OpenRawImageSource(const char* name, State* state,
+                               const Value* contents, RawImageSource* src) {
+    memset(src, 0, sizeof(*src));
+    if (contents->type != VAL_STRING) {
+        // we're given a blob as the contents
+        src->blob = contents;
+        src->length = contents->size;
+        return true;
+    }
+
+    const char* filename = contents->data;
+    size_t prefix_len = strlen(PACKAGE_SOURCE_PREFIX);
+    if (strncmp(filename, PACKAGE_SOURCE_PREFIX, prefix_len) == 0) {
+        // we're given an entry in the package
+        const char* zip_path = filename + prefix_len;
+        src->za = ((UpdaterInfo*)(state->cookie))->package_zip;
+        src->entry = mzFindZipEntry(src->za, zip_path);
+        if (src->entry == NULL) {
+            fprintf(stderr, "%s: no %s in package\n", name, zip_path);
+            return false;
+        }
+        src->length = mzGetZipEntryUncompLen(src->entry);
+        return true;
+    }
+
+    // we're given a filename as the contents
+    struct stat st;
+    src->file = fopen(filename, "rb");
+    if (src->file == NULL || fstat(fileno(src->file), &st) != 0) {
+        fprintf(stderr, "%s: can't open %s: %s\n",
+                name, filename, strerror(errno));
+        if (src->file != NULL) fclose(src->file);
+        src->file = NULL;
+        return false;
+    }
+    src->length = st.st_size;
+    return true;
+}
+
+// Pass the whole image to 'sink', in pieces.
+static bool CopyRawImageSource(RawImageSource* src,
+                               ProcessZipEntryContentsFunction sink, void* ctx) {
+    if (src->entry != NULL) {
+        return mzProcessZipEntryContents(src->za, src->entry, sink, ctx);
+    }
+    if (src->blob != NULL) {
+        return sink((const unsigned char*)src->blob->data, src->blob->size, ctx);
+    }
+
+    bool success = true;
+    unsigned char* buffer = malloc(RAW_IMAGE_READ_SIZE);
+    int read;
+    while (success &&
+           (read = fread(buffer, 1, RAW_IMAGE_READ_SIZE, src->file)) > 0) {
+        success = sink(buffer, read, ctx);
+    }
+    if (ferror(src->file)) {
+        fprintf(stderr, "error reading image: %s\n", strerror(errno));
+        success = false;
+    }
+    free(buffer);
+    return success;
+}
+
+static void CloseRawImageSource(RawImageSource* src) {
+    if (src->file != NULL) fclose(src->file);
+}
+
+// write_raw_image(filename_or_blob, partition[, "discard"])
+//   filename_or_blob may also be "package:<zip_path>" to write an
+//   entry from the package.  With "discard", an eMMC partition has the
+//   range the image will cover discarded first; knowing its old
+//   contents are dead lets the controller skip read-modify-write, but
+//   not every part handles discards well, so the script must ask.
 Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     char* result = NULL;
 
+    if (argc != 2 && argc != 3) {
+        return ErrorAbort(state, "%s() expects 2 or 3 args, got %d", name, argc);
+    }
+
+    int discard = 0;
+    if (argc == 3) {
+        char* option;
+        if (ReadArgs(state, argv+2, 1, &option) < 0) {
+            return NULL;
+        }
+        discard = strcmp(option, "discard") == 0;
+        if (!discard) {
+            ErrorAbort(state, "unknown option \"%s\" to %s", option, name);
+            free(option);
+            return NULL;
+        }
+        free(option);
+    }
+
     Value* partition_value;
     Value* contents;
     if (ReadValueArgs(state, argv, 2, &contents, &partition_value) < 0) {
@@ -807,54 +926,49 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
     Volume *v = NULL;
     bool success;
 
+    RawImageSource src;
+    if (!OpenRawImageSource(name, state, contents, &src)) {
+        result = strdup("");
+        goto done;
+    }
+
     if(emmcEnabled) {
     	load_volume_table();
     	char path[32] = "/";
     	strcat(path, partition);
     	v = volume_for_path(path);
-    	FILE *dest_partition = fopen(v->device, "wb");
-    	if(dest_partition == NULL) {
-    		fprintf(stderr, "%s: no emmc partition named \"%s\"\n", name, v->device);
+    	if (v == NULL) {
+    		fprintf(stderr, "%s: no emmc partition named \"%s\"\n", name, partition);
+    		CloseRawImageSource(&src);
+			result = strdup("");
+			goto done;
+    	}
+
+    	EmmcWriteContext* ctx = emmc_write_partition(v->device,
+    	                                             discard ? src.length : 0);
+    	if (ctx == NULL) {
+    		fprintf(stderr, "%s: can't write emmc partition \"%s\"\n",
+    				name, v->device);
+    		CloseRawImageSource(&src);
 			result = strdup("");
 			goto done;
     	}
 
-    	if (contents->type == VAL_STRING) {
-    		// we're given a filename as the contents
-			char* filename = contents->data;
-			FILE* f = fopen(filename, "rb");
-			if (f == NULL) {
-				fprintf(stderr, "%s: can't open %s: %s\n",
-						name, filename, strerror(errno));
-				result = strdup("");
-				goto done;
-			}
-
-			success = true;
-			char* buffer = malloc(BUFSIZ);
-			int read;
-			while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
-				int wrote = fwrite(buffer, 1, read, dest_partition);
-				success = success && (wrote == read);
-			}
-			free(buffer);
-			fclose(f);
-    	}else {
-    		// we're given a blob as the contents
-			ssize_t wrote = fwrite(contents->data, 1, contents->size, dest_partition);
-			success = (wrote == contents->size);
-
-			if (!success) {
-				fprintf(stderr, "emmc data write to %s failed: %s\n",
-						v->device, strerror(errno));
-			}
+    	success = CopyRawImageSource(&src, write_emmc_image_cb, ctx);
+    	if (!success) {
+    		fprintf(stderr, "emmc data write to %s failed\n", v->device);
     	}
 
+    	if (emmc_write_close(ctx) != 0) {
+    		fprintf(stderr, "%s: error closing write of %s\n", name, v->device);
+    		success = false;
+    	}
     }else {
 		mtd_scan_partitions();
 		const MtdPartition* mtd = mtd_find_partition_by_name(partition);
 		if (mtd == NULL) {
 			fprintf(stderr, "%s: no mtd partition named \"%s\"\n", name, partition);
+			CloseRawImageSource(&src);
 			result = strdup("");
 			goto done;
 		}
@@ -863,38 +977,14 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
 		if (ctx == NULL) {
 			fprintf(stderr, "%s: can't write mtd partition \"%s\"\n",
 					name, partition);
+			CloseRawImageSource(&src);
 			result = strdup("");
 			goto done;
 		}
 
-		if (contents->type == VAL_STRING) {
-			// we're given a filename as the contents
-			char* filename = contents->data;
-			FILE* f = fopen(filename, "rb");
-			if (f == NULL) {
-				fprintf(stderr, "%s: can't open %s: %s\n",
-						name, filename, strerror(errno));
-				result = strdup("");
-				goto done;
-			}
-
-			success = true;
-			char* buffer = malloc(BUFSIZ);
-			int read;
-			while (success && (read = fread(buffer, 1, BUFSIZ, f)) > 0) {
-				int wrote = mtd_write_data(ctx, buffer, read);
-				success = success && (wrote == read);
-			}
-			free(buffer);
-			fclose(f);
-		} else {
-			// we're given a blob as the contents
-			ssize_t wrote = mtd_write_data(ctx, contents->data, contents->size);
-			success = (wrote == contents->size);
-		}
+		success = CopyRawImageSource(&src, write_raw_image_cb, ctx);
 		if (!success) {
-			fprintf(stderr, "mtd_write_data to %s failed: %s\n",
-					partition, strerror(errno));
+			fprintf(stderr, "mtd_write_data to %s failed\n", partition);
 		}
 
 		if (mtd_erase_blocks(ctx, -1) == -1) {
@@ -903,11 +993,11 @@ Value* WriteRawImageFn(const char* name, State* state, int argc, Expr* argv[]) {
 		if (mtd_write_close(ctx) != 0) {
 			fprintf(stderr, "%s: error closing write of %s\n", name, partition);
 		}
-
-		printf("%s %s partition\n",
-			   success ? "wrote" : "failed to write", partition);
     }
+    CloseRawImageSource(&src);
 
+    printf("%s %s partition\n",
+           success ? "wrote" : "failed to write", partition);
     result = success ? partition : strdup("");
 
 done:
@@ -1387,6 +1477,237 @@ Value* ApplyPatchCheckFn(const char* name, State* state,
     return StringValue(strdup(result == 0 ? "t" : ""));
 }
 
+// One file to be checked by apply_patch_check_all() or
+// apply_patch_check_manifest().
+typedef struct {
+    char* filename;
+    int num_sha1s;
+    char** sha1s;
+    int result;
+} PatchCheck;
+
+typedef struct {
+    PatchCheck* checks;
+    int count;
+    int next;            // next check to hand out
+    int done;            // checks finished, for progress
+    int failed;
+    UpdaterInfo* ui;
+    pthread_mutex_t lock;
+} PatchCheckQueue;
+
+#define PATCH_CHECK_MAX_THREADS 8
+
+static void FinishPatchCheck(PatchCheckQueue* q, PatchCheck* pc) {
+    pthread_mutex_lock(&q->lock);
+    ++q->done;
+    if (pc->result != 0) {
+        ++q->failed;
+        fprintf(q->ui->cmd_pipe, "ui_print \"%s\" has unexpected contents.\n",
+                pc->filename);
+    }
+    UpdaterSetProgress(q->ui, (double)q->done / q->count);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Reading partitions goes through shared state in applypatch, so
+// those are checked one at a time, before the threads start.
+static int IsPartitionCheck(const PatchCheck* pc) {
+    return strncmp(pc->filename, "MTD:", 4) == 0 ||
+           strncmp(pc->filename, "EMMC:", 5) == 0;
+}
+
+static void* PatchCheckThread(void* cookie) {
+    PatchCheckQueue* q = (PatchCheckQueue*)cookie;
+    for (;;) {
+        pthread_mutex_lock(&q->lock);
+        while (q->next < q->count && IsPartitionCheck(q->checks + q->next)) {
+            ++q->next;
+        }
+        PatchCheck* pc = q->next < q->count ? q->checks + q->next++ : NULL;
+        pthread_mutex_unlock(&q->lock);
+        if (pc == NULL) break;
+
+        pc->result = applypatch_check(pc->filename, pc->num_sha1s, pc->sha1s);
+        FinishPatchCheck(q, pc);
+    }
+    return NULL;
+}
+
+// Run applypatch_check() on every entry of checks[], in parallel.
+// Returns the number that failed.
+static int RunPatchChecks(PatchCheck* checks, int count, UpdaterInfo* ui) {
+    PatchCheckQueue q;
+    q.checks = checks;
+    q.count = count;
+    q.next = 0;
+    q.done = 0;
+    q.failed = 0;
+    q.ui = ui;
+    pthread_mutex_init(&q.lock, NULL);
+
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (IsPartitionCheck(checks+i)) {
+            checks[i].result = applypatch_check(checks[i].filename,
+                                                checks[i].num_sha1s,
+                                                checks[i].sha1s);
+            FinishPatchCheck(&q, checks+i);
+        }
+    }
+
+    // The checks are mostly waiting for the disk, so use more threads
+    // than there are CPUs to keep several reads in flight.
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN) * 2;
+    if (num_threads < 1) num_threads = 1;
+    if (num_threads > PATCH_CHECK_MAX_THREADS) {
+        num_threads = PATCH_CHECK_MAX_THREADS;
+    }
+
+    pthread_t threads[PATCH_CHECK_MAX_THREADS];
+    int started = 0;
+    for (i = 0; i < num_threads; ++i) {
+        if (pthread_create(threads+i, NULL, PatchCheckThread, &q) != 0) {
+            break;
+        }
+        ++started;
+    }
+    if (started == 0) {
+        PatchCheckThread(&q);
+    }
+    for (i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&q.lock);
+    return q.failed;
+}
+
+// Split 'list' (which is modified) at any of the characters in
+// 'delims', appending each piece to pc->sha1s.
+static void AddSha1s(PatchCheck* pc, char* list, const char* delims) {
+    char* save;
+    char* sha1;
+    for (sha1 = strtok_r(list, delims, &save); sha1 != NULL;
+         sha1 = strtok_r(NULL, delims, &save)) {
+        pc->sha1s = realloc(pc->sha1s, (pc->num_sha1s+1) * sizeof(char*));
+        pc->sha1s[pc->num_sha1s++] = strdup(sha1);
+    }
+}
+
+static Value* RunPatchCheckBatch(const char* name, State* state,
+                                 PatchCheck* checks, int count) {
+    int failed = RunPatchChecks(checks, count, (UpdaterInfo*)(state->cookie));
+    fprintf(stderr, "%s: %d of %d files failed the check\n",
+            name, failed, count);
+
+    int i, j;
+    for (i = 0; i < count; ++i) {
+        free(checks[i].filename);
+        for (j = 0; j < checks[i].num_sha1s; ++j) {
+            free(checks[i].sha1s[j]);
+        }
+        free(checks[i].sha1s);
+    }
+    free(checks);
+
+    return StringValue(strdup(failed == 0 ? "t" : ""));
+}
+
+// apply_patch_check_all(file1, "sha1_1:sha1_2:...", file2, "...", ...)
+//
+// Like calling apply_patch_check() on each file with the given list
+// of acceptable sha1s, but the files are checked in parallel.  Every
+// file is checked (and each failure reported) before this returns;
+// the result is true only if all of them passed.
+Value* ApplyPatchCheckAllFn(const char* name, State* state,
+                            int argc, Expr* argv[]) {
+    if (argc < 2 || argc % 2 != 0) {
+        return ErrorAbort(state, "%s(): expected an even number of args, "
+                          "got %d", name, argc);
+    }
+
+    char** args = ReadVarArgs(state, argc, argv);
+    if (args == NULL) {
+        return NULL;
+    }
+
+    int count = argc / 2;
+    PatchCheck* checks = calloc(count, sizeof(PatchCheck));
+    int i;
+    for (i = 0; i < count; ++i) {
+        checks[i].filename = args[i*2];
+        AddSha1s(checks+i, args[i*2+1], ":");
+        free(args[i*2+1]);
+    }
+    free(args);
+
+    return RunPatchCheckBatch(name, state, checks, count);
+}
+
+// apply_patch_check_manifest(package_path)
+//
+// Check the files listed in the given entry of the package in
+// parallel, as apply_patch_check_all() does.  Each line of the entry
+// is a filename followed by its acceptable sha1s, separated by
+// spaces; blank lines and lines starting with '#' are ignored.
+Value* ApplyPatchCheckManifestFn(const char* name, State* state,
+                                 int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+
+    char* zip_path;
+    if (ReadArgs(state, argv, 1, &zip_path) < 0) {
+        return NULL;
+    }
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+    if (entry == NULL) {
+        Value* v = ErrorAbort(state, "%s(): no %s in package", name, zip_path);
+        free(zip_path);
+        return v;
+    }
+
+    size_t size = mzGetZipEntryUncompLen(entry);
+    char* manifest = malloc(size+1);
+    if (!mzExtractZipEntryToBuffer(za, entry, (unsigned char*)manifest)) {
+        free(manifest);
+        Value* v = ErrorAbort(state, "%s(): failed to read %s",
+                              name, zip_path);
+        free(zip_path);
+        return v;
+    }
+    manifest[size] = '\0';
+    free(zip_path);
+
+    int count = 0;
+    int alloc = 64;
+    PatchCheck* checks = malloc(alloc * sizeof(PatchCheck));
+
+    char* line_save;
+    char* line;
+    for (line = strtok_r(manifest, "\n", &line_save); line != NULL;
+         line = strtok_r(NULL, "\n", &line_save)) {
+        char* save;
+        char* filename = strtok_r(line, " \t\r", &save);
+        if (filename == NULL || filename[0] == '#') continue;
+
+        if (count >= alloc) {
+            alloc *= 2;
+            checks = realloc(checks, alloc * sizeof(PatchCheck));
+        }
+        memset(checks+count, 0, sizeof(PatchCheck));
+        checks[count].filename = strdup(filename);
+        AddSha1s(checks+count, save, " \t\r");
+        ++count;
+    }
+    free(manifest);
+
+    return RunPatchCheckBatch(name, state, checks, count);
+}
+
 Value* UIPrintFn(const char* name, State* state, int argc, Expr* argv[]) {
     char** args = ReadVarArgs(state, argc, argv);
     if (args == NULL) {
@@ -1574,10 +1895,10 @@ Value* ReadFileFn(const char* name, State* state, int argc, Expr* argv[]) {
 }
 
 void RegisterInstallFunctions() {
-    RegisterFunction("mount", MountFn);
-    RegisterFunction("is_mounted", IsMountedFn);
-    RegisterFunction("unmount", UnmountFn);
-    RegisterFunction("format", FormatFn);
+    RegisterSerializedFunction("mount", MountFn);
+    RegisterSerializedFunction("is_mounted", IsMountedFn);
+    RegisterSerializedFunction("unmount", UnmountFn);
+    RegisterSerializedFunction("format", FormatFn);
     RegisterFunction("show_progress", ShowProgressFn);
     RegisterFunction("set_progress", SetProgressFn);
     RegisterFunction("delete", DeleteFn);
@@ -1590,18 +1911,20 @@ void RegisterInstallFunctions() {
 
     RegisterFunction("getprop", GetPropFn);
     RegisterFunction("file_getprop", FileGetPropFn);
-    RegisterFunction("write_raw_image", WriteRawImageFn);
-    RegisterFunction("write_raw_parameter_image", WriteRawParameterImageFn);
-    RegisterFunction("clear_misc_command", ClearMiscCommandFn);
+    RegisterSerializedFunction("write_raw_image", WriteRawImageFn);
+    RegisterSerializedFunction("write_raw_parameter_image", WriteRawParameterImageFn);
+    RegisterSerializedFunction("clear_misc_command", ClearMiscCommandFn);
 
-    RegisterFunction("apply_patch", ApplyPatchFn);
-    RegisterFunction("apply_patch_check", ApplyPatchCheckFn);
-    RegisterFunction("apply_patch_space", ApplyPatchSpaceFn);
+    RegisterSerializedFunction("apply_patch", ApplyPatchFn);
+    RegisterSerializedFunction("apply_patch_check", ApplyPatchCheckFn);
+    RegisterSerializedFunction("apply_patch_check_all", ApplyPatchCheckAllFn);
+    RegisterSerializedFunction("apply_patch_check_manifest", ApplyPatchCheckManifestFn);
+    RegisterSerializedFunction("apply_patch_space", ApplyPatchSpaceFn);
 
-    RegisterFunction("read_file", ReadFileFn);
+    RegisterSerializedFunction("read_file", ReadFileFn);
     RegisterFunction("sha1_check", Sha1CheckFn);
 
-    RegisterFunction("wipe_cache", WipeCacheFn);
+    RegisterSerializedFunction("wipe_cache", WipeCacheFn);
 
     RegisterFunction("ui_print", UIPrintFn);
 
@@ -0,0 +1,314 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * apply_metadata(manifest_entry)
+ *
+ * Sets the ownership, mode and capabilities of every file in a table
+ * read from the package, and creates its symlinks, in place of the
+ * thousands of separate set_perm(), set_perm_recursive() and
+ * symlink() calls a full update script would otherwise make.  Each
+ * line of the table is
+ *
+ *   <type> <path> <uid> <gid> <mode> <capabilities> [<target>]
+ *
+ * where type is
+ *
+ *   f   a file (or other non-directory), which must already exist
+ *   d   a directory, created if it doesn't exist
+ *   l   a symlink to <target>, replacing whatever is at <path>
+ *
+ * Paths are absolute and can't contain whitespace.  mode and
+ * capabilities are numbers in C syntax ("0755", "0x1000"); both are
+ * ignored for symlinks, and capabilities of 0 leaves the file with
+ * none.  Blank lines and lines starting with '#' are skipped.
+ *
+ * Each path is changed relative to its parent directory's fd, and the
+ * directories on the way to the last entry are kept open, so a table
+ * in sorted order opens each directory once and never looks up a full
+ * path.  Entries can come in any order, but a directory has to be
+ * listed (or already exist) before the entries inside it.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/capability.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+#include "updater.h"
+#include "metadata.h"
+
+#ifndef XATTR_NAME_CAPS
+#define XATTR_NAME_CAPS "security.capability"
+#endif
+
+typedef struct {
+    char* path;       // "" for the root
+    int fd;
+} OpenDir;
+
+typedef struct {
+    OpenDir* dirs;    // dirs[i+1] is inside dirs[i]
+    int count;
+    int alloc;
+} DirStack;
+
+static void PushDir(DirStack* ds, char* path, int fd) {
+    if (ds->count >= ds->alloc) {
+        ds->alloc = ds->alloc ? ds->alloc * 2 : 16;
+        ds->dirs = realloc(ds->dirs, ds->alloc * sizeof(OpenDir));
+    }
+    ds->dirs[ds->count].path = path;
+    ds->dirs[ds->count].fd = fd;
+    ++ds->count;
+}
+
+static void PopDir(DirStack* ds) {
+    --ds->count;
+    close(ds->dirs[ds->count].fd);
+    free(ds->dirs[ds->count].path);
+}
+
+// Is 'dir' the directory 'top', or inside it?
+static int IsWithin(const char* top, const char* dir) {
+    size_t len = strlen(top);
+    return strncmp(dir, top, len) == 0 && (dir[len] == '\0' || dir[len] == '/');
+}
+
+// Return an fd for the directory 'dir' ("" for the root), opening it
+// relative to the deepest directory on the stack that contains it.
+// Returns -1 on failure.
+static int OpenParent(DirStack* ds, const char* dir) {
+    while (!IsWithin(ds->dirs[ds->count-1].path, dir)) {
+        PopDir(ds);
+    }
+    for (;;) {
+        OpenDir* top = ds->dirs + ds->count - 1;
+        size_t len = strlen(top->path);
+        if (dir[len] == '\0') return top->fd;
+
+        const char* start = dir + len + 1;
+        const char* end = strchr(start, '/');
+        if (end == NULL) end = start + strlen(start);
+
+        char* name = strndup(start, end - start);
+        int fd = openat(top->fd, name, O_RDONLY | O_DIRECTORY);
+        if (fd < 0) {
+            fprintf(stderr, "apply_metadata: can't open %.*s: %s\n",
+                    (int)(end - dir), dir, strerror(errno));
+            free(name);
+            return -1;
+        }
+        free(name);
+        PushDir(ds, strndup(dir, end - dir), fd);
+    }
+}
+
+// Bionic has no symlinkat() wrapper, so make the system call directly.
+static int SymlinkAt(const char* target, int dirfd, const char* name) {
+    return syscall(__NR_symlinkat, target, dirfd, name);
+}
+
+static int SetCapabilities(int dirfd, const char* name, uint64_t capabilities) {
+    if (capabilities == 0) {
+        // Changing the owner has already dropped any old ones.
+        return 0;
+    }
+    struct vfs_cap_data cap_data;
+    memset(&cap_data, 0, sizeof(cap_data));
+    cap_data.magic_etc = VFS_CAP_REVISION_2 | VFS_CAP_FLAGS_EFFECTIVE;
+    cap_data.data[0].permitted = (uint32_t)(capabilities & 0xffffffff);
+    cap_data.data[1].permitted = (uint32_t)(capabilities >> 32);
+
+    // O_NONBLOCK so that a fifo doesn't wait for a writer.
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOCTTY);
+    if (fd < 0) return -1;
+    int r = fsetxattr(fd, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0);
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return r;
+}
+
+// Apply one line of the table.  Returns the number of changes that
+// failed, or -1 if the line is malformed.
+static int ApplyEntry(DirStack* ds, char* line) {
+    char* fields[7];
+    int count = 0;
+    char* save;
+    char* tok;
+    for (tok = strtok_r(line, " \t\r", &save); tok != NULL && count < 7;
+         tok = strtok_r(NULL, " \t\r", &save)) {
+        fields[count++] = tok;
+    }
+
+    if (count < 6 || strlen(fields[0]) != 1) return -1;
+    char type = fields[0][0];
+    char* path = fields[1];
+    char* target = (count > 6) ? fields[6] : NULL;
+    if ((type == 'l') != (target != NULL)) return -1;
+    if (type != 'f' && type != 'd' && type != 'l') return -1;
+
+    char* end;
+    int i;
+    unsigned long values[3];
+    for (i = 0; i < 3; ++i) {
+        values[i] = strtoul(fields[i+2], &end, 0);
+        if (*end != '\0') return -1;
+    }
+    uid_t uid = values[0];
+    gid_t gid = values[1];
+    mode_t mode = values[2];
+    uint64_t capabilities = strtoull(fields[5], &end, 0);
+    if (*end != '\0') return -1;
+
+    size_t len = strlen(path);
+    while (len > 1 && path[len-1] == '/') path[--len] = '\0';
+    char* slash = strrchr(path, '/');
+    if (path[0] != '/' || slash[1] == '\0') return -1;
+
+    *slash = '\0';
+    int dirfd = OpenParent(ds, path);
+    *slash = '/';
+    if (dirfd < 0) return 1;
+    const char* base = slash + 1;
+
+    int bad = 0;
+    if (type == 'l') {
+        if (unlinkat(dirfd, base, 0) < 0 && errno != ENOENT) {
+            fprintf(stderr, "apply_metadata: failed to remove %s: %s\n",
+                    path, strerror(errno));
+            return 1;
+        }
+        if (SymlinkAt(target, dirfd, base) < 0) {
+            fprintf(stderr, "apply_metadata: failed to symlink %s to %s: %s\n",
+                    path, target, strerror(errno));
+            return 1;
+        }
+        if (fchownat(dirfd, base, uid, gid, AT_SYMLINK_NOFOLLOW) < 0) {
+            fprintf(stderr, "apply_metadata: lchown of %s to %d %d failed: %s\n",
+                    path, uid, gid, strerror(errno));
+            ++bad;
+        }
+        return bad;
+    }
+
+    if (type == 'd' && mkdirat(dirfd, base, mode) < 0 && errno != EEXIST) {
+        fprintf(stderr, "apply_metadata: failed to mkdir %s: %s\n",
+                path, strerror(errno));
+        return 1;
+    }
+    if (fchownat(dirfd, base, uid, gid, 0) < 0) {
+        fprintf(stderr, "apply_metadata: chown of %s to %d %d failed: %s\n",
+                path, uid, gid, strerror(errno));
+        ++bad;
+    }
+    if (fchmodat(dirfd, base, mode, 0) < 0) {
+        fprintf(stderr, "apply_metadata: chmod of %s to %o failed: %s\n",
+                path, mode, strerror(errno));
+        ++bad;
+    }
+    if (SetCapabilities(dirfd, base, capabilities) < 0) {
+        fprintf(stderr, "apply_metadata: setting capabilities of %s failed: %s\n",
+                path, strerror(errno));
+        ++bad;
+    }
+    return bad;
+}
+
+Value* ApplyMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+    char* zip_path;
+    if (ReadArgs(state, argv, 1, &zip_path) < 0) return NULL;
+
+    char* manifest = NULL;
+    DirStack ds = { NULL, 0, 0 };
+    Value* result = NULL;
+    int bad = 0;
+    int entries = 0;
+
+    ZipArchive* za = ((UpdaterInfo*)(state->cookie))->package_zip;
+    const ZipEntry* entry = mzFindZipEntry(za, zip_path);
+    if (entry == NULL) {
+        ErrorAbort(state, "%s: no %s in package", name, zip_path);
+        goto done;
+    }
+    size_t size = mzGetZipEntryUncompLen(entry);
+    manifest = malloc(size + 1);
+    if (manifest == NULL ||
+        !mzExtractZipEntryToBuffer(za, entry, (unsigned char*)manifest)) {
+        ErrorAbort(state, "%s: failed to read %s", name, zip_path);
+        goto done;
+    }
+    manifest[size] = '\0';
+
+    int root = open("/", O_RDONLY | O_DIRECTORY);
+    if (root < 0) {
+        ErrorAbort(state, "%s: can't open /: %s", name, strerror(errno));
+        goto done;
+    }
+    PushDir(&ds, strdup(""), root);
+
+    int lineno = 0;
+    char* line;
+    char* next;
+    for (line = manifest; line != NULL; line = next) {
+        next = strchr(line, '\n');
+        if (next != NULL) *next++ = '\0';
+        ++lineno;
+        while (*line == ' ' || *line == '\t') ++line;
+        if (*line == '\0' || *line == '#') continue;
+
+        int r = ApplyEntry(&ds, line);
+        if (r < 0) {
+            ErrorAbort(state, "%s: bad entry at %s line %d",
+                       name, zip_path, lineno);
+            goto done;
+        }
+        bad += r;
+        ++entries;
+    }
+
+    printf("%s: applied %d entries from %s\n", name, entries, zip_path);
+    if (bad) {
+        ErrorAbort(state, "%s: some changes failed", name);
+    } else {
+        result = StringValue(strdup(""));
+    }
+
+  done:
+    while (ds.count > 0) PopDir(&ds);
+    free(ds.dirs);
+    free(manifest);
+    free(zip_path);
+    return result;
+}
+
+void RegisterMetadataFunctions() {
+    RegisterFunction("apply_metadata", ApplyMetadataFn);
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests for apply_metadata().  Each test writes a manifest into a
+// package and applies it to files in the scratch directory.  Must be
+// run as root, on a filesystem that takes security.* xattrs.
+//
+// usage: metadata_test [<scratch-dir>]
+
+#include <fcntl.h>
+#include <linux/capability.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "edify/expr.h"
+#include "minzip/Zip.h"
+#include "updater.h"
+#include "metadata.h"
+#include "testutil/testutil.h"
+
+extern int yyparse(Expr** root, int* error_count);
+
+static const char* dir;
+static char package_path[FILENAME_MAX];
+
+// Run apply_metadata() with a manifest made of 'lines'; "%s" in a line
+// is replaced by the scratch directory.  Returns 1 if it succeeded, 0
+// if it failed.
+static int RunManifest(const char* name, const char** lines) {
+    printf("%s\n", name);
+
+    char manifest[4096];
+    size_t len = 0;
+    for (; *lines != NULL; ++lines) {
+        len += snprintf(manifest + len, sizeof(manifest) - len, *lines, dir);
+        len += snprintf(manifest + len, sizeof(manifest) - len, "\n");
+    }
+
+    TestZipEntry entry = { "manifest", manifest, len };
+    ZipArchive package;
+    if (WriteStoredZip(package_path, &entry, 1) != 0 ||
+        mzOpenZipArchive(package_path, &package) != 0) {
+        printf("  failed to make package %s\n", package_path);
+        return -1;
+    }
+
+    const char* script = "apply_metadata(\"manifest\")";
+    Expr* root;
+    int error_count = 0;
+    yy_scan_string(script);
+    if (yyparse(&root, &error_count) != 0 || error_count > 0) {
+        printf("  failed to parse script\n");
+        mzCloseZipArchive(&package);
+        return -1;
+    }
+
+    UpdaterInfo ui;
+    ui.cmd_pipe = fopen("/dev/null", "w");
+    ui.package_zip = &package;
+    ui.version = 3;
+    ui.progress = NULL;
+    ui.progress_slot = 0;
+
+    State state;
+    state.cookie = &ui;
+    state.script = (char*)script;
+    state.errmsg = NULL;
+
+    char* result = Evaluate(&state, root);
+    int ok = result != NULL;
+    free(result);
+    free(state.errmsg);
+    fclose(ui.cmd_pipe);
+    mzCloseZipArchive(&package);
+    return ok;
+}
+
+static char* Path(const char* name) {
+    static char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    return path;
+}
+
+static int MakeFile(const char* name) {
+    int fd = open(Path(name), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return -1;
+    return close(fd);
+}
+
+// Return the permitted capabilities set on 'name', or -1 if it has
+// none (or they can't be read).
+static long long Capabilities(const char* name) {
+    struct vfs_cap_data cap_data;
+    ssize_t len = lgetxattr(Path(name), "security.capability",
+                            &cap_data, sizeof(cap_data));
+    if (len != sizeof(cap_data)) return -1;
+    return cap_data.data[0].permitted |
+        ((long long)cap_data.data[1].permitted << 32);
+}
+
+static void TestModeAndOwner() {
+    MakeFile("file");
+    const char* lines[] = {
+        "f %s/file 1000 2000 0640 0",
+        "d %s/sub 1001 1001 0750 0",
+        NULL
+    };
+    EXPECT(RunManifest("mode and owner", lines) == 1);
+
+    struct stat st;
+    EXPECT(lstat(Path("file"), &st) == 0);
+    EXPECT(S_ISREG(st.st_mode));
+    EXPECT((st.st_mode & 07777) == 0640);
+    EXPECT(st.st_uid == 1000);
+    EXPECT(st.st_gid == 2000);
+
+    EXPECT(lstat(Path("sub"), &st) == 0);
+    EXPECT(S_ISDIR(st.st_mode));
+    EXPECT((st.st_mode & 07777) == 0750);
+    EXPECT(st.st_uid == 1001);
+    EXPECT(st.st_gid == 1001);
+
+    unlink(Path("file"));
+    rmdir(Path("sub"));
+}
+
+static void TestSymlink() {
+    // Whatever is at the path is replaced, and the link itself (not
+    // what it points to) gets the owner.
+    MakeFile("target");
+    MakeFile("link");
+    const char* lines[] = {
+        "l %s/link 1000 1000 0 0 target",
+        NULL
+    };
+    EXPECT(RunManifest("symlink", lines) == 1);
+
+    char buf[64];
+    ssize_t len = readlink(Path("link"), buf, sizeof(buf));
+    EXPECT(len == 6 && memcmp(buf, "target", 6) == 0);
+    struct stat st;
+    EXPECT(lstat(Path("link"), &st) == 0);
+    EXPECT(S_ISLNK(st.st_mode));
+    EXPECT(st.st_uid == 1000);
+    EXPECT(stat(Path("target"), &st) == 0);
+    EXPECT(st.st_uid == 0);
+
+    unlink(Path("link"));
+    unlink(Path("target"));
+}
+
+static void TestCapabilities() {
+    MakeFile("caps");
+    MakeFile("nocaps");
+    const char* set[] = {
+        "f %s/caps 0 2000 0750 0x1000000c00",
+        "f %s/nocaps 0 2000 0750 0x1000",
+        NULL
+    };
+    EXPECT(RunManifest("capabilities", set) == 1);
+    EXPECT(Capabilities("caps") == 0x1000000c00LL);
+    EXPECT(Capabilities("nocaps") == 0x1000);
+
+    // Changing the owner drops the old capabilities.
+    const char* clear[] = {
+        "f %s/nocaps 1000 2000 0750 0",
+        NULL
+    };
+    EXPECT(RunManifest("capabilities cleared", clear) == 1);
+    EXPECT(Capabilities("caps") == 0x1000000c00LL);
+    EXPECT(Capabilities("nocaps") == -1);
+
+    unlink(Path("caps"));
+    unlink(Path("nocaps"));
+}
+
+static void TestMissingFile() {
+    // A missing file fails the call, but the other entries still apply.
+    MakeFile("file");
+    const char* lines[] = {
+        "f %s/missing 0 0 0644 0",
+        "f %s/file 1000 1000 0644 0",
+        NULL
+    };
+    EXPECT(RunManifest("missing file fails", lines) == 0);
+    struct stat st;
+    EXPECT(lstat(Path("file"), &st) == 0);
+    EXPECT(st.st_uid == 1000);
+    unlink(Path("file"));
+}
+
+static void TestBadEntry() {
+    const char* lines[] = {
+        "x %s/file 0 0 0644 0",
+        NULL
+    };
+    EXPECT(RunManifest("bad entry fails", lines) == 0);
+}
+
+int main(int argc, char** argv) {
+    if ((dir = TestScratchDir(argc, argv, "metadata_test")) == NULL) {
+        return 2;
+    }
+    snprintf(package_path, sizeof(package_path), "%s/package.zip", dir);
+
+    RegisterBuiltins();
+    RegisterMetadataFunctions();
+    FinishRegistration();
+
+    TestModeAndOwner();
+    TestSymlink();
+    TestCapabilities();
+    TestMissingFile();
+    TestBadEntry();
+
+    unlink(package_path);
+    return TestFinish();
+}
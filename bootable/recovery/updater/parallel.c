@@ -0,0 +1,315 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * parallel(expr, expr, ...)
+ *
+ * Evaluates each argument on its own thread, so that steps working on
+ * different devices can overlap, e.g.
+ *
+ *   parallel(package_extract_dir("system", "/system"),
+ *            write_raw_image("package:boot.img", "boot"));
+ *
+ * Like a sequence of statements, the result is the value of the last
+ * argument.  If any argument fails, parallel() fails with the first
+ * error once all of them have finished; a function can't be safely
+ * interrupted, so the others are left to run to completion.  Branches
+ * must not depend on each other's effects.
+ *
+ * Branches read the package concurrently (minzip uses pread()), but
+ * builtins registered with RegisterSerializedFunction() -- mounting,
+ * formatting, writing raw images, applypatch and block_image_update,
+ * which share process-wide tables and scratch files -- take a lock
+ * and so run one at a time.  A branch may still wait on another
+ * branch's mount() or apply_patch(), but never corrupts it.  A
+ * parallel() inside the arguments of a serialized builtin runs its
+ * branches one after another on the calling thread, since that
+ * thread holds the lock the branches would wait for.
+ *
+ * Each branch's show_progress() and set_progress() calls are tracked
+ * separately, and recovery is shown their combined progress: the
+ * fractions the branches claim add up to the share of the bar that
+ * parallel() fills.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "edify/expr.h"
+#include "updater.h"
+#include "parallel.h"
+
+typedef struct {
+    double closed;        // fraction of the bar in segments now over
+    double size;          // fraction in the current segment
+    double fraction;      // how far through the current segment
+} ProgressSlot;
+
+struct ProgressGroup {
+    pthread_mutex_t lock;
+    UpdaterInfo* parent;  // where the combined progress goes
+    ProgressSlot* slots;
+    int count;
+
+    // The segment of the parent's bar opened so far.  The recovery UI
+    // counts a segment as complete when the next one is opened, so a
+    // new one is only opened once the branches have caught up.
+    int opened;
+    double scope_start;
+    double scope_size;
+    double last_sent;
+
+    // Shared error state: the first branch to fail leaves its message.
+    int failed;
+    char* errmsg;
+};
+
+#define MAX_SERIALIZED_FUNCTIONS 32
+
+static struct {
+    const char* name;
+    Function fn;
+} serialized[MAX_SERIALIZED_FUNCTIONS];
+static int serialized_count = 0;
+
+// Recursive, since a serialized builtin's arguments can call another.
+// serial_depth_key holds how many times the calling thread has taken
+// it (bionic has no __thread).
+static pthread_mutex_t serial_lock;
+static pthread_key_t serial_depth_key;
+static pthread_once_t serial_lock_once = PTHREAD_ONCE_INIT;
+
+static void InitSerialLock() {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&serial_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_key_create(&serial_depth_key, NULL);
+}
+
+static int SerialDepth() {
+    pthread_once(&serial_lock_once, InitSerialLock);
+    return (int)(intptr_t)pthread_getspecific(serial_depth_key);
+}
+
+static Value* SerializedFn(const char* name, State* state,
+                           int argc, Expr* argv[]) {
+    Function fn = NULL;
+    int i;
+    for (i = 0; i < serialized_count; ++i) {
+        if (strcmp(serialized[i].name, name) == 0) {
+            fn = serialized[i].fn;
+            break;
+        }
+    }
+    if (fn == NULL) {
+        return ErrorAbort(state, "%s: not a serialized function", name);
+    }
+    int depth = SerialDepth();
+    pthread_mutex_lock(&serial_lock);
+    pthread_setspecific(serial_depth_key, (void*)(intptr_t)(depth + 1));
+    Value* result = fn(name, state, argc, argv);
+    pthread_setspecific(serial_depth_key, (void*)(intptr_t)depth);
+    pthread_mutex_unlock(&serial_lock);
+    return result;
+}
+
+void RegisterSerializedFunction(const char* name, Function fn) {
+    if (serialized_count >= MAX_SERIALIZED_FUNCTIONS) {
+        fprintf(stderr, "too many serialized functions; %s isn't locked\n",
+                name);
+        RegisterFunction(name, fn);
+        return;
+    }
+    serialized[serialized_count].name = name;
+    serialized[serialized_count].fn = fn;
+    ++serialized_count;
+    RegisterFunction(name, SerializedFn);
+}
+
+typedef struct {
+    ProgressGroup* group;
+    Expr* expr;
+    State state;
+    UpdaterInfo info;
+    Value* result;
+    pthread_t thread;
+    int started;
+} Branch;
+
+// Pass the group's combined progress up to its parent.  Called with
+// group->lock held.
+static void UpdateGroup(ProgressGroup* group) {
+    double done = 0, declared = 0;
+    int i;
+    for (i = 0; i < group->count; ++i) {
+        ProgressSlot* s = group->slots + i;
+        done += s->closed + s->size * s->fraction;
+        declared += s->closed + s->size;
+    }
+    if (declared <= 0) return;
+
+    double scope_end = group->scope_start + group->scope_size;
+    if (!group->opened) {
+        UpdaterShowProgress(group->parent, declared, 0);
+        group->opened = 1;
+        group->scope_start = 0;
+        group->scope_size = declared;
+        group->last_sent = 0;
+    } else if (done >= scope_end - 1e-6 && declared > scope_end + 1e-6) {
+        UpdaterShowProgress(group->parent, declared - scope_end, 0);
+        group->scope_start = scope_end;
+        group->scope_size = declared - scope_end;
+        group->last_sent = 0;
+    }
+
+    double p = (done - group->scope_start) / group->scope_size;
+    if (p < 0) p = 0;
+    if (p > 1) p = 1;
+    // Don't flood the pipe with changes too small to see.
+    if (p - group->last_sent >= 0.001 || (p >= 1 && group->last_sent < 1)) {
+        UpdaterSetProgress(group->parent, p);
+        group->last_sent = p;
+    }
+}
+
+void UpdaterShowProgress(UpdaterInfo* ui, double frac, int seconds) {
+    ProgressGroup* group = ui->progress;
+    if (group == NULL) {
+        fprintf(ui->cmd_pipe, "progress %f %d\n", frac, seconds);
+        return;
+    }
+    // The branches' time estimates overlap, so they're dropped.
+    pthread_mutex_lock(&group->lock);
+    ProgressSlot* s = group->slots + ui->progress_slot;
+    s->closed += s->size;
+    s->size = frac;
+    s->fraction = 0;
+    UpdateGroup(group);
+    pthread_mutex_unlock(&group->lock);
+}
+
+void UpdaterSetProgress(UpdaterInfo* ui, double frac) {
+    ProgressGroup* group = ui->progress;
+    if (group == NULL) {
+        fprintf(ui->cmd_pipe, "set_progress %f\n", frac);
+        return;
+    }
+    pthread_mutex_lock(&group->lock);
+    group->slots[ui->progress_slot].fraction = frac;
+    UpdateGroup(group);
+    pthread_mutex_unlock(&group->lock);
+}
+
+static void* BranchThread(void* cookie) {
+    Branch* b = (Branch*)cookie;
+    ProgressGroup* group = b->group;
+
+    b->result = EvaluateValue(&b->state, b->expr);
+
+    pthread_mutex_lock(&group->lock);
+    if (b->result == NULL && !group->failed) {
+        group->failed = 1;
+        group->errmsg = b->state.errmsg;
+        b->state.errmsg = NULL;
+    }
+    // Whatever the branch left unreported is done now.
+    ProgressSlot* s = group->slots + b->info.progress_slot;
+    s->fraction = 1;
+    UpdateGroup(group);
+    pthread_mutex_unlock(&group->lock);
+
+    free(b->state.errmsg);
+    b->state.errmsg = NULL;
+    return NULL;
+}
+
+Value* ParallelFn(const char* name, State* state, int argc, Expr* argv[]) {
+    if (argc < 1) {
+        return ErrorAbort(state, "%s() expects at least 1 arg", name);
+    }
+
+    UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    ProgressGroup group;
+    pthread_mutex_init(&group.lock, NULL);
+    group.parent = ui;
+    group.slots = calloc(argc, sizeof(ProgressSlot));
+    group.count = argc;
+    group.opened = 0;
+    group.scope_start = 0;
+    group.scope_size = 0;
+    group.last_sent = 0;
+    group.failed = 0;
+    group.errmsg = NULL;
+
+    // Branch threads would block on the serial lock this thread holds,
+    // while it waited for them to finish.
+    int run_inline = SerialDepth() > 0;
+
+    Branch* branches = calloc(argc, sizeof(Branch));
+    int i;
+    for (i = 0; i < argc; ++i) {
+        Branch* b = branches + i;
+        b->group = &group;
+        b->expr = argv[i];
+        b->info = *ui;
+        b->info.progress = &group;
+        b->info.progress_slot = i;
+        b->state.cookie = &b->info;
+        b->state.script = state->script;
+        b->state.errmsg = NULL;
+        if (run_inline) {
+            BranchThread(b);
+            continue;
+        }
+        b->started = pthread_create(&b->thread, NULL, BranchThread, b) == 0;
+        if (!b->started) {
+            fprintf(stderr, "%s: can't start a thread; running branch %d "
+                    "in turn\n", name, i);
+            BranchThread(b);
+        }
+    }
+
+    for (i = 0; i < argc; ++i) {
+        if (branches[i].started) {
+            pthread_join(branches[i].thread, NULL);
+        }
+    }
+
+    Value* result = NULL;
+    if (group.failed) {
+        free(state->errmsg);
+        state->errmsg = group.errmsg;
+    } else {
+        result = branches[argc-1].result;
+        branches[argc-1].result = NULL;
+    }
+    for (i = 0; i < argc; ++i) {
+        FreeValue(branches[i].result);
+    }
+    free(branches);
+    free(group.slots);
+    pthread_mutex_destroy(&group.lock);
+    return result;
+}
+
+void RegisterParallelFunctions() {
+    RegisterFunction("parallel", ParallelFn);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _UPDATER_PARALLEL_H_
+#define _UPDATER_PARALLEL_H_
+
+#include "edify/expr.h"
+#include "updater.h"
+
+void RegisterParallelFunctions();
+
+// Register a builtin that uses state shared by the whole process --
+// the MTD partition table, the volume table, applypatch's single
+// cache copy of a patch source, /cache space management.  Calls to
+// these run one at a time, even in different branches of parallel().
+void RegisterSerializedFunction(const char* name, Function fn);
+
+// Send a "progress" or "set_progress" command to recovery.  Inside
+// parallel(), these are combined with the progress of the other
+// branches first, so every function that reports progress should go
+// through them rather than writing to cmd_pipe itself.
+void UpdaterShowProgress(UpdaterInfo* ui, double frac, int seconds);
+void UpdaterSetProgress(UpdaterInfo* ui, double frac);
+
+#endif
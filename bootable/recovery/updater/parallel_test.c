@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2009 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Tests for parallel() and serialized builtins.  A script that
+// deadlocks fails the test by alarm.
+//
+// usage: parallel_test
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "edify/expr.h"
+#include "updater.h"
+#include "parallel.h"
+#include "testutil/testutil.h"
+
+extern int yyparse(Expr** root, int* error_count);
+
+static pthread_mutex_t active_lock = PTHREAD_MUTEX_INITIALIZER;
+static int active = 0;
+static int max_active = 0;
+
+// serial_echo(value): returns value, after holding on to it for a
+// moment so that overlapping calls would be seen.
+static Value* SerialEchoFn(const char* name, State* state,
+                           int argc, Expr* argv[]) {
+    if (argc != 1) {
+        return ErrorAbort(state, "%s() expects 1 arg, got %d", name, argc);
+    }
+    char* value;
+    if (ReadArgs(state, argv, 1, &value) < 0) return NULL;
+
+    pthread_mutex_lock(&active_lock);
+    if (++active > max_active) max_active = active;
+    pthread_mutex_unlock(&active_lock);
+    usleep(10000);
+    pthread_mutex_lock(&active_lock);
+    --active;
+    pthread_mutex_unlock(&active_lock);
+
+    return StringValue(value);
+}
+
+// Run 'script' and return its result, or NULL if it failed.  The
+// caller frees the result.
+static char* RunScript(const char* script) {
+    printf("%s\n", script);
+    Expr* root;
+    int error_count = 0;
+    yy_scan_string(script);
+    if (yyparse(&root, &error_count) != 0 || error_count > 0) {
+        printf("  failed to parse script\n");
+        return NULL;
+    }
+
+    UpdaterInfo ui;
+    ui.cmd_pipe = fopen("/dev/null", "w");
+    ui.package_zip = NULL;
+    ui.version = 3;
+    ui.progress = NULL;
+    ui.progress_slot = 0;
+
+    State state;
+    state.cookie = &ui;
+    state.script = (char*)script;
+    state.errmsg = NULL;
+
+    max_active = 0;
+    char* result = Evaluate(&state, root);
+    free(state.errmsg);
+    fclose(ui.cmd_pipe);
+    return result;
+}
+
+static void TestSerializedInParallel() {
+    char* result = RunScript("parallel(serial_echo(\"a\"), serial_echo(\"b\"), "
+                             "serial_echo(\"c\"))");
+    EXPECT(result != NULL && strcmp(result, "c") == 0);
+    EXPECT(max_active == 1);
+    free(result);
+}
+
+static void TestParallelInSerialized() {
+    // The branches need the lock the outer call holds.
+    char* result = RunScript("serial_echo(parallel(serial_echo(\"a\"), "
+                             "serial_echo(\"b\")))");
+    EXPECT(result != NULL && strcmp(result, "b") == 0);
+    EXPECT(max_active == 1);
+    free(result);
+}
+
+static void TestNestedParallelFails() {
+    char* result = RunScript("serial_echo(parallel(abort(\"x\"), "
+                             "serial_echo(\"b\")))");
+    EXPECT(result == NULL);
+    free(result);
+}
+
+static void Timeout(int sig) {
+    static const char msg[] = "  FAILED: timed out\nFAILURE\n";
+    write(STDOUT_FILENO, msg, sizeof(msg) - 1);
+    _exit(1);
+}
+
+int main(int argc, char** argv) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    signal(SIGALRM, Timeout);
+    alarm(30);
+
+    RegisterBuiltins();
+    RegisterParallelFunctions();
+    RegisterSerializedFunction("serial_echo", SerialEchoFn);
+    FinishRegistration();
+
+    TestSerializedInParallel();
+    TestParallelInSerialized();
+    TestNestedParallelFails();
+
+    return TestFinish();
+}
@@ -21,7 +21,12 @@
 #include "edify/expr.h"
 #include "updater.h"
 #include "install.h"
+#include "blockimg.h"
+#include "digest.h"
+#include "metadata.h"
+#include "parallel.h"
 #include "minzip/Zip.h"
+#include "applypatch/applypatch.h"
 
 // Generated by the makefile, this function defines the
 // RegisterDeviceExtensions() function, which calls all the
@@ -32,6 +37,10 @@
 // (Note it's "updateR-script", not the older "update-script".)
 #define SCRIPT_NAME "META-INF/com/google/android/updater-script"
 
+// Where the timing trace of the script's function calls goes; recovery
+// copies it to /cache/recovery when it finishes.
+#define TRACE_FILE "/tmp/update_trace.json"
+
 //add by mmk@rock-chips.com
 char* g_package_file;
 
@@ -95,6 +104,10 @@ int main(int argc, char** argv) {
 
     RegisterBuiltins();
     RegisterInstallFunctions();
+    RegisterBlockImageFunctions();
+    RegisterDigestFunctions();
+    RegisterMetadataFunctions();
+    RegisterParallelFunctions();
     RegisterDeviceExtensions();
     FinishRegistration();
 
@@ -108,6 +121,7 @@ int main(int argc, char** argv) {
         fprintf(stderr, "%d parse errors\n", error_count);
         return 6;
     }
+    root = OptimizeExpr(root);
 
 #ifdef HAVE_SELINUX
     struct selinux_opt seopts[] = {
@@ -128,13 +142,21 @@ int main(int argc, char** argv) {
     updater_info.cmd_pipe = cmd_pipe;
     updater_info.package_zip = &za;
     updater_info.version = atoi(version);
+    updater_info.progress = NULL;
+    updater_info.progress_slot = 0;
 
     State state;
     state.cookie = &updater_info;
     state.script = script;
     state.errmsg = NULL;
 
+    // Reuse the source hashes computed by an earlier, interrupted
+    // attempt at this install.
+    HashCacheOpen(CACHE_HASH_FILE);
+
+    TraceOpen(TRACE_FILE);
     char* result = Evaluate(&state, root);
+    TraceClose();
     if (result == NULL) {
         if (state.errmsg == NULL) {
             fprintf(stderr, "script aborted (no error message)\n");
@@ -153,6 +175,7 @@ int main(int argc, char** argv) {
     } else {
         fprintf(stderr, "script result was [%s]\n", result);
         free(result);
+        HashCacheDiscard();
     }
 
     if (updater_info.package_zip) {
@@ -27,10 +27,17 @@
 struct selabel_handle;
 #endif
 
+typedef struct ProgressGroup ProgressGroup;
+
 typedef struct {
     FILE* cmd_pipe;
     ZipArchive* package_zip;
     int version;
+
+    // Inside parallel(), the group this branch's progress is combined
+    // in and its place in it; NULL otherwise.
+    ProgressGroup* progress;
+    int progress_slot;
 } UpdaterInfo;
 
 extern struct selabel_handle *sehandle;
@@ -24,12 +24,222 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 extern RecoveryUI* ui;
 
+// A chunk-signed package carries a manifest of per-chunk SHA-1 hashes
+// in the archive comment, just ahead of the RSA signature:
+//
+//    0      8   "CHUNKED1"
+//    8      4   chunk size in bytes (little-endian)
+//    12     4   chunk count
+//    16     8   number of bytes covered (the same signed_len as for a
+//               whole-file signature)
+//    24   20*N  SHA-1 of each chunk, in file order
+//
+// The RSA signature is over the SHA-1 of the manifest itself, so one
+// RSA_verify() still decides trust; the chunks can then be hashed
+// independently, which lets us spread the work across all the cores.
+
+#define CHUNK_MANIFEST_MAGIC "CHUNKED1"
+#define CHUNK_MANIFEST_HEADER_SIZE 24
+#define MAX_HASH_THREADS 8
+
+typedef struct {
+    const char* path;
+    const uint8_t* leaf_sha1;   // points into the manifest
+    size_t chunk_size;
+    size_t chunk_count;
+    size_t signed_len;
+
+    pthread_mutex_t lock;
+    size_t next_chunk;          // protected by lock
+    size_t chunks_done;         // protected by lock
+    double frac;                // protected by lock
+    bool failed;                // protected by lock
+} ChunkVerifyJob;
+
+static unsigned int read_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long long read_le64(const unsigned char* p) {
+    return read_le32(p) | ((unsigned long long)read_le32(p+4) << 32);
+}
+
+// Worker for verify_chunks(): repeatedly claim the next unhashed
+// chunk, hash it with pread() on a private fd and compare it against
+// the manifest.
+static void* chunk_verify_thread(void* cookie) {
+    ChunkVerifyJob* job = (ChunkVerifyJob*)cookie;
+
+    int fd = open(job->path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("failed to open %s (%s)\n", job->path, strerror(errno));
+        pthread_mutex_lock(&job->lock);
+        job->failed = true;
+        pthread_mutex_unlock(&job->lock);
+        return NULL;
+    }
+
+    const size_t buffer_size = 65536;
+    unsigned char* buffer = (unsigned char*)malloc(buffer_size);
+
+    while (buffer != NULL) {
+        pthread_mutex_lock(&job->lock);
+        size_t i = job->next_chunk++;
+        bool stop = job->failed || i >= job->chunk_count;
+        pthread_mutex_unlock(&job->lock);
+        if (stop) break;
+
+        off_t start = (off_t)i * job->chunk_size;
+        size_t len = job->chunk_size;
+        if (job->signed_len - start < len) len = job->signed_len - start;
+
+        SHA_CTX ctx;
+        SHA_init(&ctx);
+        size_t so_far = 0;
+        bool ok = true;
+        while (so_far < len) {
+            size_t size = buffer_size;
+            if (len - so_far < size) size = len - so_far;
+            ssize_t r = pread(fd, buffer, size, start + so_far);
+            if (r != (ssize_t)size) {
+                LOGE("failed to read data from %s (%s)\n",
+                     job->path, strerror(errno));
+                ok = false;
+                break;
+            }
+            SHA_update(&ctx, buffer, size);
+            so_far += size;
+        }
+        if (ok && memcmp(SHA_final(&ctx), job->leaf_sha1 + i * SHA_DIGEST_SIZE,
+                         SHA_DIGEST_SIZE) != 0) {
+            LOGE("chunk %d of %s doesn't match manifest\n", (int)i, job->path);
+            ok = false;
+        }
+
+        pthread_mutex_lock(&job->lock);
+        if (!ok) job->failed = true;
+        ++job->chunks_done;
+        double f = job->chunks_done / (double)job->chunk_count;
+        if (f > job->frac + 0.02 || job->chunks_done == job->chunk_count) {
+            ui->SetProgress(f);
+            job->frac = f;
+        }
+        pthread_mutex_unlock(&job->lock);
+    }
+
+    if (buffer == NULL) {
+        LOGE("failed to alloc memory for sha1 buffer\n");
+        pthread_mutex_lock(&job->lock);
+        job->failed = true;
+        pthread_mutex_unlock(&job->lock);
+    }
+    free(buffer);
+    close(fd);
+    return NULL;
+}
+
+// Check that the chunk manifest (manifest_len bytes at 'manifest')
+// describes exactly the first signed_len bytes of the file, then hash
+// every chunk in parallel.  On success, store the hash of the
+// manifest (the value the RSA signature is over) in sha1 and return
+// true.
+static bool verify_chunks(const char* path, const unsigned char* manifest,
+                          size_t manifest_len, size_t signed_len,
+                          uint8_t* sha1) {
+    if (manifest_len < CHUNK_MANIFEST_HEADER_SIZE ||
+        memcmp(manifest, CHUNK_MANIFEST_MAGIC, 8) != 0) {
+        LOGE("chunk manifest is missing or corrupt\n");
+        return false;
+    }
+
+    size_t chunk_size = read_le32(manifest + 8);
+    size_t chunk_count = read_le32(manifest + 12);
+    unsigned long long covered = read_le64(manifest + 16);
+    if (chunk_size == 0 || covered != signed_len ||
+        chunk_count != signed_len / chunk_size +
+                       (signed_len % chunk_size != 0) ||
+        (manifest_len - CHUNK_MANIFEST_HEADER_SIZE) % SHA_DIGEST_SIZE != 0 ||
+        (manifest_len - CHUNK_MANIFEST_HEADER_SIZE) / SHA_DIGEST_SIZE !=
+            chunk_count) {
+        LOGE("chunk manifest doesn't describe this file\n");
+        return false;
+    }
+
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > MAX_HASH_THREADS) threads = MAX_HASH_THREADS;
+    if ((size_t)threads > chunk_count) threads = chunk_count;
+    LOGI("verifying %d chunks of %d bytes with %d threads\n",
+         (int)chunk_count, (int)chunk_size, threads);
+
+    ChunkVerifyJob job;
+    job.path = path;
+    job.leaf_sha1 = manifest + CHUNK_MANIFEST_HEADER_SIZE;
+    job.chunk_size = chunk_size;
+    job.chunk_count = chunk_count;
+    job.signed_len = signed_len;
+    pthread_mutex_init(&job.lock, NULL);
+    job.next_chunk = 0;
+    job.chunks_done = 0;
+    job.frac = -1.0;
+    job.failed = false;
+
+    pthread_t tids[MAX_HASH_THREADS];
+    int started = 0;
+    for (int i = 0; i < threads; ++i) {
+        if (pthread_create(&tids[started], NULL, chunk_verify_thread, &job) == 0) {
+            ++started;
+        }
+    }
+    if (started == 0) {
+        // Couldn't get any threads; do the work on this one.
+        chunk_verify_thread(&job);
+    }
+    for (int i = 0; i < started; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    pthread_mutex_destroy(&job.lock);
+
+    if (job.failed || job.chunks_done != chunk_count) {
+        return false;
+    }
+
+    SHA(manifest, manifest_len, sha1);
+    return true;
+}
+
+// Check the RSA block at the end of the EOCD record against sha1
+// using each of the given keys.  Takes ownership of eocd.
+static int verify_signature(unsigned char* eocd, size_t eocd_size,
+                            const uint8_t* sha1,
+                            const RSAPublicKey *pKeys, unsigned int numKeys) {
+    unsigned int i;
+    for (i = 0; i < numKeys; ++i) {
+        // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
+        // the signing tool appends after the signature itself.
+        if (RSA_verify(pKeys+i, eocd + eocd_size - 6 - RSANUMBYTES,
+                       RSANUMBYTES, sha1)) {
+            LOGI("signature verified against key %d\n", i);
+            free(eocd);
+            return VERIFY_SUCCESS;
+        }
+    }
+    free(eocd);
+    LOGE("failed to verify signature\n");
+    return VERIFY_FAILURE;
+}
+
 // Look for an RSA signature embedded in the .ZIP file comment given
 // the path to the zip.  Verify it matches one of the given public
-// keys.
+// keys.  The signature is either over the whole file, or over a
+// manifest of chunk hashes (see above) that is checked against the
+// file in parallel.
 //
 // Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
 // or no key matches the signature).
@@ -51,6 +261,9 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     // archive comment.)  We start by reading this footer, this tells
     // us how far back from the end we have to start reading to find
     // the whole comment.
+    //
+    // A chunk-signed archive uses $fe $ff instead; its signature
+    // start points at the chunk manifest that precedes the signature.
 
 #define FOOTER_SIZE 6
 
@@ -67,10 +280,11 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
         return VERIFY_FAILURE;
     }
 
-    if (footer[2] != 0xff || footer[3] != 0xff) {
+    if ((footer[2] != 0xff && footer[2] != 0xfe) || footer[3] != 0xff) {
         fclose(f);
         return VERIFY_FAILURE;
     }
+    bool chunked = (footer[2] == 0xfe);
 
     size_t comment_size = footer[4] + (footer[5] << 8);
     size_t signature_start = footer[0] + (footer[1] << 8);
@@ -137,6 +351,26 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
         }
     }
 
+    uint8_t sha1[SHA_DIGEST_SIZE];
+
+    if (chunked) {
+        fclose(f);
+        // The manifest runs from signature_start bytes before the end
+        // up to the RSA block.
+        if (signature_start > comment_size) {
+            LOGE("signature start is outside the comment\n");
+            free(eocd);
+            return VERIFY_FAILURE;
+        }
+        if (!verify_chunks(path, eocd + eocd_size - signature_start,
+                           signature_start - FOOTER_SIZE - RSANUMBYTES,
+                           signed_len, sha1)) {
+            free(eocd);
+            return VERIFY_FAILURE;
+        }
+        return verify_signature(eocd, eocd_size, sha1, pKeys, numKeys);
+    }
+
 #define BUFFER_SIZE 4096
 
     SHA_CTX ctx;
@@ -170,18 +404,6 @@ int verify_file(const char* path, const RSAPublicKey *pKeys, unsigned int numKey
     fclose(f);
     free(buffer);
 
-    const uint8_t* sha1 = SHA_final(&ctx);
-    for (i = 0; i < numKeys; ++i) {
-        // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
-        // the signing tool appends after the signature itself.
-        if (RSA_verify(pKeys+i, eocd + eocd_size - 6 - RSANUMBYTES,
-                       RSANUMBYTES, sha1)) {
-            LOGI("whole-file signature verified against key %d\n", i);
-            free(eocd);
-            return VERIFY_SUCCESS;
-        }
-    }
-    free(eocd);
-    LOGE("failed to verify whole-file signature\n");
-    return VERIFY_FAILURE;
+    memcpy(sha1, SHA_final(&ctx), SHA_DIGEST_SIZE);
+    return verify_signature(eocd, eocd_size, sha1, pKeys, numKeys);
 }
@@ -95,6 +95,9 @@ expect_fail random.zip
 expect_fail fake-eocd.zip
 expect_fail alter-metadata.zip
 expect_fail alter-footer.zip
+expect_succeed_f4 otasigned_chunked_f4.zip
+expect_fail otasigned_chunked_f4.zip
+expect_fail_f4 alter-chunked.zip
 
 # --------------- cleanup ----------------------
 